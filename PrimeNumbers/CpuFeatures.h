@@ -0,0 +1,167 @@
+#pragma once
+#include "Platform.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/// <summary>
+/// Processor capabilities the join types depend on, read with CPUID once at startup.
+/// Join types whose instructions are missing are refused (or skipped in a sweep)
+/// instead of faulting with an illegal instruction.
+/// </summary>
+class CpuFeatures
+{
+public:
+    enum Feature
+    {
+        MonitorX,           // monitorx/mwaitx (AMD), CPUID.80000001h:ECX[29]
+        WaitPkg,            // umonitor/umwait/tpause (Intel), CPUID.(EAX=7,ECX=0):ECX[5]
+        Rdtscp,             // rdtscp, CPUID.80000001h:EDX[27]
+        InvariantTsc,       // TSC ticks at a constant rate in all P/C-states, CPUID.80000007h:EDX[8]
+        TscLeaf,            // TSC frequency enumerated by CPUID leaf 15h
+        Avx512,             // AVX-512F, with the ZMM state enabled by the OS
+        FeatureCount
+    };
+
+private:
+    bool m_features[FeatureCount];
+    uint64_t m_tscFrequency;
+    char m_vendor[13];
+    char m_brand[49];
+
+    static void Cpuid(unsigned int leaf, unsigned int subleaf, unsigned int regs[4])
+    {
+#ifdef _WIN32
+        __cpuidex((int*)regs, (int)leaf, (int)subleaf);
+#else
+        __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif // _WIN32
+    }
+
+    static uint64_t GetXcr0()
+    {
+#ifdef _WIN32
+        return _xgetbv(0);
+#else
+        unsigned int eax, edx;
+        __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return ((uint64_t)edx << 32) | eax;
+#endif // _WIN32
+    }
+
+public:
+    CpuFeatures() : m_tscFrequency(0)
+    {
+        memset(m_features, 0, sizeof(m_features));
+        m_vendor[0] = '\0';
+        m_brand[0] = '\0';
+    }
+
+    static const char* GetName(Feature feature)
+    {
+        switch (feature)
+        {
+        case MonitorX: return "MONITORX";
+        case WaitPkg: return "WAITPKG";
+        case Rdtscp: return "RDTSCP";
+        case InvariantTsc: return "invariant TSC";
+        case TscLeaf: return "TSC frequency leaf";
+        case Avx512: return "AVX-512";
+        default: return "unknown";
+        }
+    }
+
+    void Detect()
+    {
+        unsigned int regs[4];
+        Cpuid(0, 0, regs);
+        unsigned int maxLeaf = regs[0];
+        memcpy(m_vendor + 0, &regs[1], 4);
+        memcpy(m_vendor + 4, &regs[3], 4);
+        memcpy(m_vendor + 8, &regs[2], 4);
+        m_vendor[12] = '\0';
+
+        bool osxsave = false;
+        if (maxLeaf >= 1)
+        {
+            Cpuid(1, 0, regs);
+            osxsave = (regs[2] & (1u << 27)) != 0;
+        }
+
+        if (maxLeaf >= 7)
+        {
+            Cpuid(7, 0, regs);
+            m_features[WaitPkg] = (regs[2] & (1u << 5)) != 0;
+
+            // opmask, upper ZMM0-15 and ZMM16-31 state must all be enabled in XCR0.
+            const uint64_t avx512State = 0xE6;
+            m_features[Avx512] = ((regs[1] & (1u << 16)) != 0) && osxsave && ((GetXcr0() & avx512State) == avx512State);
+        }
+
+        if (maxLeaf >= 0x15)
+        {
+            // TSC = crystal clock * EBX / EAX. The crystal clock is 0 when it is not enumerated.
+            Cpuid(0x15, 0, regs);
+            if ((regs[0] != 0) && (regs[1] != 0) && (regs[2] != 0))
+            {
+                m_tscFrequency = (uint64_t)regs[2] * regs[1] / regs[0];
+                m_features[TscLeaf] = true;
+            }
+        }
+
+        Cpuid(0x80000000, 0, regs);
+        unsigned int maxExtendedLeaf = regs[0];
+        if (maxExtendedLeaf >= 0x80000001)
+        {
+            Cpuid(0x80000001, 0, regs);
+            m_features[MonitorX] = (regs[2] & (1u << 29)) != 0;
+            m_features[Rdtscp] = (regs[3] & (1u << 27)) != 0;
+        }
+        if (maxExtendedLeaf >= 0x80000004)
+        {
+            for (unsigned int i = 0; i < 3; i++)
+            {
+                Cpuid(0x80000002 + i, 0, regs);
+                memcpy(m_brand + i * 16, regs, 16);
+            }
+            m_brand[48] = '\0';
+        }
+        if (maxExtendedLeaf >= 0x80000007)
+        {
+            Cpuid(0x80000007, 0, regs);
+            m_features[InvariantTsc] = (regs[3] & (1u << 8)) != 0;
+        }
+    }
+
+    bool Has(Feature feature) const
+    {
+        return m_features[feature];
+    }
+
+    /// <summary>
+    /// TSC frequency in Hz from CPUID leaf 15h, or 0 if it is not enumerated.
+    /// </summary>
+    uint64_t GetTscFrequency() const
+    {
+        return m_tscFrequency;
+    }
+
+    void PrintSummary() const
+    {
+        const char* brand = m_brand;
+        while (*brand == ' ')
+        {
+            brand++;
+        }
+        printf("CPU: %s (%s).", (*brand != '\0') ? brand : "unknown", m_vendor);
+        for (int i = 0; i < FeatureCount; i++)
+        {
+            printf(" %s: %s.", GetName((Feature)i), m_features[i] ? "yes" : "no");
+        }
+        if (m_tscFrequency != 0)
+        {
+            printf(" TSC: %.2f MHz.", m_tscFrequency / 1e6);
+        }
+        printf("\n");
+    }
+};
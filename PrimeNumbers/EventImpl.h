@@ -1,14 +1,25 @@
-#include <windows.h>
-#include <handleapi.h>
+#pragma once
+#include "Platform.h"
 #include <cassert>
-#include <synchapi.h>
 
-// WindowsEvent is an implementation of GCEvent that forwards
-// directly to Win32 APIs.
+#ifdef _WIN32
+#include <handleapi.h>
+#include <synchapi.h>
+#else
+#include <climits>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 //#define INVALID_HANDLE_VALUE ((void*)-1)
 typedef unsigned int uint;
 
+#ifdef _WIN32
+
+// WindowsEvent is an implementation of GCEvent that forwards
+// directly to Win32 APIs.
+
 class EventImpl
 {
 private:
@@ -64,3 +75,131 @@ public:
         return IsValid();
     }
 };
+
+#else // _WIN32
+
+// Linux implementation of GCEvent. The event state is a single 32-bit word
+// and waiters block with FUTEX_WAIT on it, so Set() costs exactly one
+// FUTEX_WAKE syscall and Wait() on a signaled event costs none.
+class EventImpl
+{
+private:
+    volatile int m_state;
+    bool m_valid;
+    bool m_manualReset;
+
+    static long Futex(volatile int* addr, int op, int val, const struct timespec* timeout)
+    {
+        return syscall(SYS_futex, (int*)addr, op | FUTEX_PRIVATE_FLAG, val, timeout, nullptr, 0);
+    }
+
+    // Consumes the signal for auto-reset events. Returns true if the event was signaled.
+    bool TryAcquire()
+    {
+        if (m_manualReset)
+        {
+            return __atomic_load_n(&m_state, __ATOMIC_ACQUIRE) != 0;
+        }
+
+        int expected = 1;
+        return __atomic_compare_exchange_n(&m_state, &expected, 0, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    }
+
+public:
+    EventImpl() : m_state(0), m_valid(false), m_manualReset(false) {}
+
+    bool IsValid() const
+    {
+        return m_valid;
+    }
+
+    void Set()
+    {
+        assert(IsValid());
+        __atomic_store_n(&m_state, 1, __ATOMIC_RELEASE);
+        long result = Futex(&m_state, FUTEX_WAKE, m_manualReset ? INT_MAX : 1, nullptr);
+        assert(result >= 0 && "FUTEX_WAKE failed");
+        (void)result;
+    }
+
+    void Reset()
+    {
+        assert(IsValid());
+        __atomic_store_n(&m_state, 0, __ATOMIC_RELEASE);
+    }
+
+    uint Wait(uint timeout, bool alertable)
+    {
+        UNREFERENCED_PARAMETER(alertable);
+        assert(IsValid());
+
+        struct timespec deadline;
+        if (timeout != INFINITE)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += timeout / 1000;
+            deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+        }
+
+        while (!TryAcquire())
+        {
+            struct timespec remaining;
+            struct timespec* pRemaining = nullptr;
+            if (timeout != INFINITE)
+            {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+                remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+                if (remaining.tv_nsec < 0)
+                {
+                    remaining.tv_sec--;
+                    remaining.tv_nsec += 1000000000;
+                }
+                if (remaining.tv_sec < 0)
+                {
+                    return WAIT_TIMEOUT;
+                }
+                pRemaining = &remaining;
+            }
+
+            // FUTEX_WAIT returns immediately if the state is no longer 0, which closes
+            // the window between the check above and going to sleep.
+            if ((Futex(&m_state, FUTEX_WAIT, 0, pRemaining) != 0) && (errno != EAGAIN) && (errno != EINTR) && (errno != ETIMEDOUT))
+            {
+                return WAIT_FAILED;
+            }
+        }
+
+        return WAIT_OBJECT_0;
+    }
+
+    void CloseEvent()
+    {
+        assert(IsValid());
+        m_valid = false;
+    }
+
+    bool CreateAutoEvent(bool initialState)
+    {
+        m_state = initialState ? 1 : 0;
+        m_manualReset = false;
+        m_valid = true;
+        return IsValid();
+    }
+
+    bool CreateManualEvent(bool initialState)
+    {
+        m_state = initialState ? 1 : 0;
+        m_manualReset = true;
+        m_valid = true;
+        return IsValid();
+    }
+};
+
+#endif // _WIN32
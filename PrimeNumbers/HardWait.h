@@ -0,0 +1,576 @@
+#pragma once
+#include "Platform.h"
+#include "EventImpl.h"
+#include "common.h"
+#include "Volatile.h"
+
+#ifdef _WIN32
+#pragma comment(lib, "Synchronization.lib")
+#else
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#endif // _WIN32
+
+/// <summary>
+/// What threads block on once they gave up spinning.
+/// </summary>
+enum class hard_wait_kind
+{
+    event = 1,          // One of the manual-reset joined_event, reset by the last thread to arrive. What the GC does.
+    futex = 2,          // futex (WaitOnAddress on Windows) directly on lock_color.
+    eventfd = 3,        // eventfd in semaphore mode, one token per sleeping thread. Linux only.
+    condvar = 4,        // Condition variable, broadcast on restart.
+    semaphore = 5,      // Counting semaphore, one token per sleeping thread.
+};
+
+const int HARD_WAIT_KIND_COUNT = 5;
+
+inline const char* get_hard_wait_name(hard_wait_kind kind)
+{
+    switch (kind)
+    {
+    case hard_wait_kind::event: return "event";
+    case hard_wait_kind::futex: return "futex";
+    case hard_wait_kind::eventfd: return "eventfd";
+    case hard_wait_kind::condvar: return "condvar";
+    case hard_wait_kind::semaphore: return "semaphore";
+    }
+    return "unknown";
+}
+
+inline bool is_hard_wait_supported(hard_wait_kind kind)
+{
+#ifdef _WIN32
+    return kind != hard_wait_kind::eventfd;
+#else
+    UNREFERENCED_PARAMETER(kind);
+    return true;
+#endif // _WIN32
+}
+
+/// <summary>
+/// Hard-wait for a change of lock_color. The last thread to arrive calls reset()
+/// with the color of the next join, then restart() changes lock_color and calls
+/// wake() with the color of the join that just completed.
+///
+/// Sleepers count themselves as parked for their color before checking it one last
+/// time, and wake() reads that count after the color changed, so either the sleeper
+/// sees the new color or wake() sees the sleeper. When nobody parked, wake() and the
+/// reset() that follows skip their kernel calls altogether.
+///
+/// wakeEarly() wakes the sleepers of a color before it changes, so the join type
+/// can move them back to spinning while the last threads finish; until reset(),
+/// wait() then returns at once for that color.
+/// </summary>
+class hard_wait_backend
+{
+private:
+    // What wakeEarly() did for a color, until reset().
+    enum early_wake_state
+    {
+        not_woken = 0,
+        woken = 1,              // Also while the winner is still signaling.
+        woken_signaled = 2,
+    };
+
+    // 'earlyWoken' is read by every sleeper right after it counted itself, so it shares the line.
+    struct alignas(HS_CACHE_LINE_SIZE) parked_count
+    {
+        Volatile<int> count;
+        Volatile<int> earlyWoken;   // early_wake_state, only written by the thread that wins the early wake and by reset().
+    };
+
+    parked_count parked[2];
+
+    // Only written by the thread that completes a join. wakeEarly() can run at the same
+    // time, from any thread, so whether it signaled is kept in 'earlyWoken' instead.
+    bool signaled[2];
+    unsigned __int64 wakeCount;
+    unsigned __int64 skippedWakeCount;
+    unsigned __int64 resetCount;
+    unsigned __int64 skippedResetCount;
+
+    // Only written by the thread that wins the early wake of a join. The winners of two
+    // joins are ordered by their arrivals at join_lock, which are interlocked.
+    unsigned __int64 earlyWakeCount;
+    unsigned __int64 skippedEarlyWakeCount;
+    unsigned __int64 missedEarlyWakeCount;
+
+protected:
+    Volatile<int>& lock_color;
+
+    /// <summary>
+    /// Whether a thread waiting for 'color' still has to sleep: the color didn't change
+    /// and its sleepers weren't woken early.
+    /// </summary>
+    __forceinline bool shouldSleep(int color)
+    {
+        return (lock_color.LoadWithoutBarrier() == color) && (parked[color].earlyWoken.LoadWithoutBarrier() == not_woken);
+    }
+
+    /// <summary>
+    /// Blocks until woken for 'color', with the calling thread counted as parked.
+    /// Returns WAIT_OBJECT_0, or WAIT_FAILED on error.
+    /// </summary>
+    virtual uint32_t block(int color) = 0;
+
+    /// <summary>
+    /// Wakes the threads blocked for 'color', at least 'parkedCount' of them.
+    /// Returns false if the backend can tell that nobody was woken.
+    /// </summary>
+    virtual bool signal(int color, int parkedCount) = 0;
+
+    /// <summary>
+    /// Undoes signal() before 'color' is waited for again.
+    /// </summary>
+    virtual void clear(int color)
+    {
+        UNREFERENCED_PARAMETER(color);
+    }
+
+public:
+    hard_wait_backend(Volatile<int>& lockColor) :
+        wakeCount(0),
+        skippedWakeCount(0),
+        resetCount(0),
+        skippedResetCount(0),
+        earlyWakeCount(0),
+        skippedEarlyWakeCount(0),
+        missedEarlyWakeCount(0),
+        lock_color(lockColor)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            parked[i].count = 0;
+            parked[i].earlyWoken = not_woken;
+            signaled[i] = false;
+        }
+    }
+
+    virtual ~hard_wait_backend()
+    {
+    }
+
+    /// <summary>
+    /// Blocks until lock_color is no longer 'color', or until wakeEarly(color). Returns WAIT_OBJECT_0, or WAIT_FAILED on error.
+    /// Join types that know their backend at compile time pass it as 'Backend', so
+    /// block() is called directly instead of through the vtable.
+    /// </summary>
+    template<typename Backend = hard_wait_backend>
+    uint32_t wait(int color)
+    {
+        uint32_t result = WAIT_OBJECT_0;
+        if (parked[color].earlyWoken.LoadWithoutBarrier() != not_woken)
+        {
+            return result;
+        }
+
+        Interlocked::Increment(&parked[color].count);
+        if (shouldSleep(color))
+        {
+            result = static_cast<Backend*>(this)->block(color);
+        }
+        Interlocked::Decrement(&parked[color].count);
+        return result;
+    }
+
+    template<typename Backend = hard_wait_backend>
+    void wake(int color)
+    {
+        // lock_color was stored just before; order that store before reading the count.
+        MemoryBarrier();
+        int count = parked[color].count.LoadWithoutBarrier();
+        if (count == 0)
+        {
+            skippedWakeCount++;
+            return;
+        }
+        wakeCount++;
+        signaled[color] = true;
+        static_cast<Backend*>(this)->signal(color, count);
+    }
+
+    /// <summary>
+    /// Wakes the threads parked for 'color' while it is still current, and lets
+    /// those that wait for it later return at once. Only the first call of a
+    /// join does anything.
+    /// </summary>
+    template<typename Backend = hard_wait_backend>
+    void wakeEarly(int color)
+    {
+        if ((parked[color].earlyWoken.LoadWithoutBarrier() != not_woken) ||
+            (Interlocked::CompareExchange(&parked[color].earlyWoken, (int)woken, (int)not_woken) != not_woken))
+        {
+            return;
+        }
+
+        // The exchange is a full barrier, so either a sleeper sees the flag or we see it parked.
+        int count = parked[color].count.LoadWithoutBarrier();
+        if (count == 0)
+        {
+            skippedEarlyWakeCount++;
+            return;
+        }
+        parked[color].earlyWoken = woken_signaled;
+        if (static_cast<Backend*>(this)->signal(color, count))
+        {
+            earlyWakeCount++;
+        }
+        else
+        {
+            missedEarlyWakeCount++;
+        }
+    }
+
+    template<typename Backend = hard_wait_backend>
+    void reset(int color)
+    {
+        // Nobody waits for 'color' until the join that follows this one.
+        int earlyWoken = parked[color].earlyWoken.LoadWithoutBarrier();
+        if (earlyWoken != not_woken)
+        {
+            parked[color].earlyWoken = not_woken;
+        }
+
+        if (!signaled[color] && (earlyWoken != woken_signaled))
+        {
+            skippedResetCount++;
+            return;
+        }
+        resetCount++;
+        signaled[color] = false;
+        static_cast<Backend*>(this)->clear(color);
+    }
+
+    /// <summary>
+    /// Wakes and resets issued, and those skipped because nobody was parked.
+    /// </summary>
+    void printStats() const
+    {
+        PRINT_STATS("Hard-wait syscalls          : Wakes: %llu (skipped %llu), Resets: %llu (skipped %llu)",
+            (unsigned long long)wakeCount, (unsigned long long)skippedWakeCount, (unsigned long long)resetCount, (unsigned long long)skippedResetCount);
+        if ((earlyWakeCount != 0) || (skippedEarlyWakeCount != 0) || (missedEarlyWakeCount != 0))
+        {
+            PRINT_STATS("Early wakes                 : Issued: %llu, Skipped (nobody parked): %llu, Woke nobody: %llu",
+                (unsigned long long)earlyWakeCount, (unsigned long long)skippedEarlyWakeCount, (unsigned long long)missedEarlyWakeCount);
+        }
+    }
+};
+
+class hard_wait_event final : public hard_wait_backend
+{
+private:
+    friend class hard_wait_backend;
+
+    EventImpl* const joined_event;
+
+protected:
+    virtual uint32_t block(int color)
+    {
+        return joined_event[color].Wait(INFINITE, FALSE);
+    }
+
+    virtual bool signal(int color, int parkedCount)
+    {
+        UNREFERENCED_PARAMETER(parkedCount);
+        joined_event[color].Set();
+        return true;
+    }
+
+    virtual void clear(int color)
+    {
+        joined_event[color].Reset();
+    }
+
+public:
+    hard_wait_event(Volatile<int>& lockColor, EventImpl* joinedEvent) : hard_wait_backend(lockColor), joined_event(joinedEvent)
+    {
+    }
+};
+
+/// <summary>
+/// Waits on lock_color itself, so there is nothing to reset and no window in which
+/// a wake-up can be lost: the kernel only puts a thread to sleep if the color still
+/// has the value it was called with. That doesn't cover the early-wake flag: an early
+/// wake that slips in between the check and the syscall is lost, and the thread
+/// sleeps until the color changes. On Linux, the early wake then woke nobody, which
+/// FUTEX_WAKE reports, so it isn't counted as one.
+/// </summary>
+class hard_wait_futex final : public hard_wait_backend
+{
+private:
+    friend class hard_wait_backend;
+
+protected:
+    virtual uint32_t block(int color)
+    {
+        while (shouldSleep(color))
+        {
+#ifdef _WIN32
+            if (!WaitOnAddress((volatile VOID*)&lock_color, &color, sizeof(color), INFINITE))
+            {
+                return WAIT_FAILED;
+            }
+#else
+            long result = syscall(SYS_futex, (int*)&lock_color, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, color, nullptr, nullptr, 0);
+            if ((result != 0) && (errno != EAGAIN) && (errno != EINTR))
+            {
+                return WAIT_FAILED;
+            }
+#endif // _WIN32
+        }
+        return WAIT_OBJECT_0;
+    }
+
+    virtual bool signal(int color, int parkedCount)
+    {
+        UNREFERENCED_PARAMETER(color);
+        UNREFERENCED_PARAMETER(parkedCount);
+#ifdef _WIN32
+        WakeByAddressAll((PVOID)&lock_color);
+        return true;
+#else
+        // The number of threads woken.
+        return syscall(SYS_futex, (int*)&lock_color, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX, nullptr, nullptr, 0) > 0;
+#endif // _WIN32
+    }
+
+public:
+    hard_wait_futex(Volatile<int>& lockColor) : hard_wait_backend(lockColor)
+    {
+    }
+};
+
+/// <summary>
+/// Base of the backends where every sleeping thread consumes one token: signal()
+/// posts one per parked thread. A thread that counted itself as parked but then
+/// saw the new color leaves its token behind; the next sleeper of that color takes
+/// it, finds the color unchanged and goes back to sleep.
+///
+/// 'Tokens' is the derived class, which provides take() and post().
+/// </summary>
+template<typename Tokens>
+class hard_wait_tokens : public hard_wait_backend
+{
+protected:
+    virtual uint32_t block(int color)
+    {
+        uint32_t result = WAIT_OBJECT_0;
+        while (shouldSleep(color) && (result == WAIT_OBJECT_0))
+        {
+            result = static_cast<Tokens*>(this)->take(color) ? WAIT_OBJECT_0 : WAIT_FAILED;
+        }
+        return result;
+    }
+
+    virtual bool signal(int color, int parkedCount)
+    {
+        static_cast<Tokens*>(this)->post(color, parkedCount);
+        return true;
+    }
+
+public:
+    hard_wait_tokens(Volatile<int>& lockColor) : hard_wait_backend(lockColor)
+    {
+    }
+};
+
+#ifndef _WIN32
+class hard_wait_eventfd final : public hard_wait_tokens<hard_wait_eventfd>
+{
+private:
+    friend class hard_wait_backend;
+    friend class hard_wait_tokens<hard_wait_eventfd>;
+
+    int fds[2];
+
+protected:
+    bool take(int color)
+    {
+        uint64_t value;
+        ssize_t result = read(fds[color], &value, sizeof(value));
+        return (result == sizeof(value)) || (errno == EINTR);
+    }
+
+    void post(int color, int count)
+    {
+        uint64_t value = (uint64_t)count;
+        ssize_t result = write(fds[color], &value, sizeof(value));
+        assert(result == sizeof(value));
+        (void)result;
+    }
+
+public:
+    hard_wait_eventfd(Volatile<int>& lockColor) : hard_wait_tokens<hard_wait_eventfd>(lockColor)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            fds[i] = eventfd(0, EFD_SEMAPHORE);
+            assert(fds[i] >= 0);
+        }
+    }
+
+    virtual ~hard_wait_eventfd()
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            close(fds[i]);
+        }
+    }
+};
+#endif // !_WIN32
+
+class hard_wait_semaphore final : public hard_wait_tokens<hard_wait_semaphore>
+{
+private:
+    friend class hard_wait_backend;
+    friend class hard_wait_tokens<hard_wait_semaphore>;
+
+#ifdef _WIN32
+    HANDLE semaphores[2];
+#else
+    sem_t semaphores[2];
+#endif // _WIN32
+
+protected:
+    bool take(int color)
+    {
+#ifdef _WIN32
+        return WaitForSingleObject(semaphores[color], INFINITE) == WAIT_OBJECT_0;
+#else
+        return (sem_wait(&semaphores[color]) == 0) || (errno == EINTR);
+#endif // _WIN32
+    }
+
+    void post(int color, int count)
+    {
+#ifdef _WIN32
+        ReleaseSemaphore(semaphores[color], count, nullptr);
+#else
+        for (int i = 0; i < count; i++)
+        {
+            sem_post(&semaphores[color]);
+        }
+#endif // _WIN32
+    }
+
+public:
+    hard_wait_semaphore(Volatile<int>& lockColor) : hard_wait_tokens<hard_wait_semaphore>(lockColor)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+#ifdef _WIN32
+            semaphores[i] = CreateSemaphore(nullptr, 0, INT_MAX, nullptr);
+            assert(semaphores[i] != NULL);
+#else
+            int result = sem_init(&semaphores[i], 0, 0);
+            assert(result == 0);
+            (void)result;
+#endif // _WIN32
+        }
+    }
+
+    virtual ~hard_wait_semaphore()
+    {
+        for (int i = 0; i < 2; i++)
+        {
+#ifdef _WIN32
+            CloseHandle(semaphores[i]);
+#else
+            sem_destroy(&semaphores[i]);
+#endif // _WIN32
+        }
+    }
+};
+
+/// <summary>
+/// Sleepers check the color with the lock held and signal() takes the lock once after
+/// the color changed (or the early-wake flag was set), so a broadcast can't slip in
+/// between the check and the wait.
+/// </summary>
+class hard_wait_condvar final : public hard_wait_backend
+{
+private:
+    friend class hard_wait_backend;
+
+#ifdef _WIN32
+    SRWLOCK lock;
+    CONDITION_VARIABLE condition;
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t condition;
+#endif // _WIN32
+
+protected:
+    virtual uint32_t block(int color)
+    {
+        uint32_t result = WAIT_OBJECT_0;
+#ifdef _WIN32
+        AcquireSRWLockExclusive(&lock);
+        while (shouldSleep(color) && (result == WAIT_OBJECT_0))
+        {
+            result = SleepConditionVariableSRW(&condition, &lock, INFINITE, 0) ? WAIT_OBJECT_0 : WAIT_FAILED;
+        }
+        ReleaseSRWLockExclusive(&lock);
+#else
+        pthread_mutex_lock(&lock);
+        while (shouldSleep(color) && (result == WAIT_OBJECT_0))
+        {
+            result = (pthread_cond_wait(&condition, &lock) == 0) ? WAIT_OBJECT_0 : WAIT_FAILED;
+        }
+        pthread_mutex_unlock(&lock);
+#endif // _WIN32
+        return result;
+    }
+
+    virtual bool signal(int color, int parkedCount)
+    {
+        UNREFERENCED_PARAMETER(color);
+        UNREFERENCED_PARAMETER(parkedCount);
+#ifdef _WIN32
+        AcquireSRWLockExclusive(&lock);
+        ReleaseSRWLockExclusive(&lock);
+        WakeAllConditionVariable(&condition);
+#else
+        pthread_mutex_lock(&lock);
+        pthread_mutex_unlock(&lock);
+        pthread_cond_broadcast(&condition);
+#endif // _WIN32
+        return true;
+    }
+
+public:
+    hard_wait_condvar(Volatile<int>& lockColor) : hard_wait_backend(lockColor)
+    {
+#ifdef _WIN32
+        InitializeSRWLock(&lock);
+        InitializeConditionVariable(&condition);
+#else
+        pthread_mutex_init(&lock, nullptr);
+        pthread_cond_init(&condition, nullptr);
+#endif // _WIN32
+    }
+
+    virtual ~hard_wait_condvar()
+    {
+#ifndef _WIN32
+        pthread_cond_destroy(&condition);
+        pthread_mutex_destroy(&lock);
+#endif // !_WIN32
+    }
+};
+
+inline hard_wait_backend* create_hard_wait(hard_wait_kind kind, Volatile<int>& lockColor, EventImpl* joinedEvent)
+{
+    switch (kind)
+    {
+    case hard_wait_kind::event: return new hard_wait_event(lockColor, joinedEvent);
+    case hard_wait_kind::futex: return new hard_wait_futex(lockColor);
+#ifndef _WIN32
+    case hard_wait_kind::eventfd: return new hard_wait_eventfd(lockColor);
+#endif // !_WIN32
+    case hard_wait_kind::condvar: return new hard_wait_condvar(lockColor);
+    case hard_wait_kind::semaphore: return new hard_wait_semaphore(lockColor);
+    default: return nullptr;
+    }
+}
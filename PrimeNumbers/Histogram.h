@@ -0,0 +1,112 @@
+#pragma once
+#include "Platform.h"
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+/// <summary>
+/// Log-linear (HDR style) histogram of tick counts. Every power of two is split
+/// into SUB_BUCKET_COUNT linear buckets, so a recorded value is reported with a
+/// relative error of at most 1 / SUB_BUCKET_COUNT (~3%).
+///
+/// The bucket array is part of the object, so Record() never allocates and can
+/// be used on the hot path. Each thread records into its own histogram and the
+/// histograms are merged once all threads are done.
+/// </summary>
+class LatencyHistogram
+{
+private:
+    static const int SUB_BUCKET_BITS = 5;
+    static const int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static const int BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+    uint64_t counts[BUCKET_COUNT];
+    uint64_t totalCount;
+    uint64_t maxValue;
+
+    static int GetBucketIndex(uint64_t value)
+    {
+        if (value < SUB_BUCKET_COUNT)
+        {
+            return (int)value;
+        }
+#ifdef _MSC_VER
+        unsigned long highestBit;
+        _BitScanReverse64(&highestBit, value);
+#else
+        int highestBit = 63 - __builtin_clzll(value);
+#endif // _MSC_VER
+        int shift = (int)highestBit - SUB_BUCKET_BITS;
+        return ((shift + 1) << SUB_BUCKET_BITS) + (int)((value >> shift) - SUB_BUCKET_COUNT);
+    }
+
+    // Largest value that maps to the bucket.
+    static uint64_t GetBucketUpperBound(int index)
+    {
+        if (index < SUB_BUCKET_COUNT)
+        {
+            return (uint64_t)index;
+        }
+        int shift = (index >> SUB_BUCKET_BITS) - 1;
+        uint64_t subBucket = (uint64_t)(index & (SUB_BUCKET_COUNT - 1)) + SUB_BUCKET_COUNT;
+        return ((subBucket + 1) << shift) - 1;
+    }
+
+public:
+    LatencyHistogram()
+    {
+        Reset();
+    }
+
+    void Reset()
+    {
+        memset(counts, 0, sizeof(counts));
+        totalCount = 0;
+        maxValue = 0;
+    }
+
+    __forceinline void Record(uint64_t value)
+    {
+        counts[GetBucketIndex(value)]++;
+        totalCount++;
+        maxValue = std::max(maxValue, value);
+    }
+
+    void Merge(const LatencyHistogram& other)
+    {
+        for (int i = 0; i < BUCKET_COUNT; i++)
+        {
+            counts[i] += other.counts[i];
+        }
+        totalCount += other.totalCount;
+        maxValue = std::max(maxValue, other.maxValue);
+    }
+
+    uint64_t GetCount() const { return totalCount; }
+    uint64_t GetMax() const { return maxValue; }
+
+    /// <summary>
+    /// Value at or below which 'percentile' percent of the recorded values fall.
+    /// </summary>
+    uint64_t GetPercentile(double percentile) const
+    {
+        if (totalCount == 0)
+        {
+            return 0;
+        }
+
+        uint64_t target = (uint64_t)((percentile / 100.0) * totalCount + 0.5);
+        target = std::max((uint64_t)1, std::min(totalCount, target));
+
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKET_COUNT; i++)
+        {
+            seen += counts[i];
+            if (seen >= target)
+            {
+                return std::min(GetBucketUpperBound(i), maxValue);
+            }
+        }
+        return maxValue;
+    }
+};
@@ -0,0 +1,200 @@
+#pragma once
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "common.h"
+
+/// <summary>
+/// How the cost of a round is spread over the threads. How long the others wait at
+/// a join depends on how far the slowest thread is behind, not on the average, so
+/// the shape matters more than the mean.
+/// </summary>
+enum class imbalance_kind
+{
+    uniform = 1,    // Uniform between 0 and twice the mean. The original inputs.
+    normal = 2,     // Normal around the mean, cut off at 0.
+    lognormal = 3,  // Log-normal with the same mean: a long tail of slow threads.
+    zipf = 4,       // Every round, the threads get the ranks 1..N in random order, and rank k costs k^-s.
+    bimodal = 5,    // Most threads cost the mean, a fraction costs 'stragglerFactor' times as much.
+    straggler = 6,  // Every round, one thread costs 'stragglerFactor' times as much as the others.
+};
+
+const int IMBALANCE_KIND_COUNT = 6;
+
+inline const char* get_imbalance_name(imbalance_kind kind)
+{
+    switch (kind)
+    {
+    case imbalance_kind::uniform: return "uniform";
+    case imbalance_kind::normal: return "normal";
+    case imbalance_kind::lognormal: return "lognormal";
+    case imbalance_kind::zipf: return "zipf";
+    case imbalance_kind::bimodal: return "bimodal";
+    case imbalance_kind::straggler: return "straggler";
+    }
+    return "unknown";
+}
+
+struct imbalance_config
+{
+    imbalance_kind kind;
+    double cv;              // normal, lognormal: standard deviation relative to the mean.
+    double zipfExponent;    // zipf: 's'.
+    double slowFraction;    // bimodal: share of the threads that are slow.
+    double stragglerFactor; // bimodal, straggler: how much slower the slow threads are.
+    double correlation;     // Chance that a thread's cost of a round repeats its cost of the previous round.
+};
+
+/// <summary>
+/// Generates the inputs of every thread and round, as 'inputs[threadId * roundCount + round]'.
+/// The input is the work a round does, so 'meanInput' times a cost factor drawn from the
+/// distribution. The cost factor averages 1, except for bimodal and straggler, where the
+/// fast threads cost exactly 1.
+/// </summary>
+class imbalance_generator
+{
+private:
+    imbalance_config config;
+    double meanInput;
+    std::mt19937_64 random;
+
+    bool repeatsPreviousRound()
+    {
+        return (config.correlation > 0) && (std::uniform_real_distribution<double>(0, 1)(random) < config.correlation);
+    }
+
+    // uniform keeps using rand(), so with the default settings the inputs are the ones they always were.
+    double drawUniform()
+    {
+        float n = (float)rand() / RAND_MAX;
+        return n * (2 * meanInput);
+    }
+
+    // The cost factor of one thread, for the kinds that draw every thread on its own.
+    double drawFactor()
+    {
+        switch (config.kind)
+        {
+        case imbalance_kind::normal:
+            return (std::max)(0.0, std::normal_distribution<double>(1, config.cv)(random));
+        case imbalance_kind::lognormal:
+        {
+            // Picks mu so that the mean is 1.
+            double sigma = sqrt(log(1 + config.cv * config.cv));
+            return std::lognormal_distribution<double>(-sigma * sigma / 2, sigma)(random);
+        }
+        case imbalance_kind::bimodal:
+            return (std::uniform_real_distribution<double>(0, 1)(random) < config.slowFraction) ? config.stragglerFactor : 1;
+        default:
+            assert(!"Not drawn per thread");
+            return 1;
+        }
+    }
+
+    void generatePerThread(int threadCount, int roundCount, ulong* inputs)
+    {
+        for (int threadId = 0; threadId < threadCount; threadId++)
+        {
+            ulong* threadInputs = &inputs[threadId * roundCount];
+            for (int round = 0; round < roundCount; round++)
+            {
+                if ((round > 0) && repeatsPreviousRound())
+                {
+                    threadInputs[round] = threadInputs[round - 1];
+                }
+                else if (config.kind == imbalance_kind::uniform)
+                {
+                    threadInputs[round] = (ulong)drawUniform();
+                }
+                else
+                {
+                    threadInputs[round] = (ulong)(drawFactor() * meanInput);
+                }
+            }
+        }
+    }
+
+    // zipf and straggler hand out costs per round, so correlation repeats the whole round.
+    void generatePerRound(int threadCount, int roundCount, ulong* inputs)
+    {
+        std::vector<double> factors(threadCount);
+        if (config.kind == imbalance_kind::zipf)
+        {
+            double sum = 0;
+            for (int rank = 1; rank <= threadCount; rank++)
+            {
+                sum += pow(rank, -config.zipfExponent);
+            }
+            for (int rank = 1; rank <= threadCount; rank++)
+            {
+                factors[rank - 1] = threadCount * pow(rank, -config.zipfExponent) / sum;
+            }
+        }
+        else
+        {
+            std::fill(factors.begin(), factors.end(), 1.0);
+            factors[0] = config.stragglerFactor;
+        }
+
+        for (int round = 0; round < roundCount; round++)
+        {
+            if ((round == 0) || !repeatsPreviousRound())
+            {
+                std::shuffle(factors.begin(), factors.end(), random);
+            }
+            for (int threadId = 0; threadId < threadCount; threadId++)
+            {
+                inputs[threadId * roundCount + round] = (ulong)(factors[threadId] * meanInput);
+            }
+        }
+    }
+
+public:
+    imbalance_generator(const imbalance_config& config, double meanInput) :
+        config(config),
+        meanInput(meanInput),
+        random(1)
+    {
+    }
+
+    void generate(int threadCount, int roundCount, ulong* inputs)
+    {
+        if ((config.kind == imbalance_kind::zipf) || (config.kind == imbalance_kind::straggler))
+        {
+            generatePerRound(threadCount, roundCount, inputs);
+        }
+        else
+        {
+            generatePerThread(threadCount, roundCount, inputs);
+        }
+    }
+
+    /// <summary>
+    /// The slowest thread's input over the average input, averaged over the rounds:
+    /// how long a round takes compared to a perfectly balanced one.
+    /// </summary>
+    static double getAverageMaxOverMean(int threadCount, int roundCount, const ulong* inputs)
+    {
+        double total = 0;
+        int countedRounds = 0;
+        for (int round = 0; round < roundCount; round++)
+        {
+            double sum = 0, max = 0;
+            for (int threadId = 0; threadId < threadCount; threadId++)
+            {
+                double input = (double)inputs[threadId * roundCount + round];
+                sum += input;
+                max = (std::max)(max, input);
+            }
+            if (sum > 0)
+            {
+                total += max / (sum / threadCount);
+                countedRounds++;
+            }
+        }
+        return (countedRounds == 0) ? 1 : total / countedRounds;
+    }
+};
@@ -0,0 +1,555 @@
+#pragma once
+#include "Platform.h"
+#include <limits.h>
+#include "common.h"
+#include "HardWait.h"
+#include "t_join.h"
+
+// The join types that only differ in how a waiter spins and whether it falls into
+// hard-wait are one template, t_join_composed<Spin, Wait, Backend>:
+//
+//  - Spin: what a waiter does between two reads of lock_color (pause, mwaitx, umwait, tpause, backoff).
+//  - Wait: how long it spins, and whether it hard-waits afterwards.
+//  - Backend: the hard_wait_backend it blocks on, or hard_wait_backend itself to pick it at runtime.
+//
+// Everything is resolved at compile time, and t_join_composed is final, so a caller
+// that knows the instantiation (ThreadWorker<Join>) calls join(), joined() and
+// restart() without going through the vtable.
+
+/// <summary>
+/// Spin with 'pause'.
+/// </summary>
+struct pause_spin
+{
+    pause_spin(int numThreads)
+    {
+        UNREFERENCED_PARAMETER(numThreads);
+    }
+
+    /// <summary>
+    /// Called before every read of 'address' in the spin-loop.
+    /// </summary>
+    __forceinline void arm(const void* address)
+    {
+        UNREFERENCED_PARAMETER(address);
+    }
+
+    /// <summary>
+    /// Called after a read of 'address' saw the color unchanged, 'iteration' times before in this spin-loop.
+    /// </summary>
+    __forceinline void wait(int threadId, int iteration)
+    {
+        UNREFERENCED_PARAMETER(threadId);
+        UNREFERENCED_PARAMETER(iteration);
+        YieldProcessor();
+    }
+
+    /// <summary>
+    /// Iterations of the spin-loop before it gives up.
+    /// </summary>
+    __forceinline int getSpinCount() const
+    {
+        return SPIN_COUNT;
+    }
+
+    void printStats() {}
+};
+
+/// <summary>
+/// Spin with monitorx/mwaitx (AMD): wait for a store to lock_color, at most 'cycles'.
+/// </summary>
+struct mwaitx_spin
+{
+    const unsigned int cycles;
+
+    mwaitx_spin(int numThreads, int mwaitx_timeout) : cycles((unsigned int)mwaitx_timeout)
+    {
+        UNREFERENCED_PARAMETER(numThreads);
+    }
+
+    __forceinline void arm(const void* address)
+    {
+        _mm_monitorx(address, 0, 0);
+    }
+
+    __forceinline void wait(int threadId, int iteration)
+    {
+        UNREFERENCED_PARAMETER(threadId);
+        UNREFERENCED_PARAMETER(iteration);
+        _mm_mwaitx(2, 0, cycles);
+    }
+
+    __forceinline int getSpinCount() const
+    {
+        return SPIN_COUNT;
+    }
+
+    void printStats() {}
+};
+
+/// <summary>
+/// Intel's counterpart of monitorx/mwaitx (WAITPKG): umonitor arms the monitor,
+/// umwait waits for a store to the monitored line and tpause just waits, both until
+/// a TSC deadline at the latest. They return the carry flag, which is only set when
+/// the OS limit in IA32_UMWAIT_CONTROL ended the wait; reaching the caller's own
+/// deadline clears it. So every thread counts a wait as timed out when the TSC is
+/// past its deadline afterwards, as ended by the OS limit when the carry flag is
+/// set, and as woken early otherwise: by a store to the monitored line (umwait
+/// only) or by an interrupt.
+/// </summary>
+struct waitpkg_spin
+{
+    struct alignas(HS_CACHE_LINE_SIZE) wait_causes
+    {
+        ulong waitCount;
+        ulong timeoutCount;
+        ulong osLimitCount;
+    };
+
+    wait_causes* causes;
+    const int threadCount;
+    const unsigned int control;
+    const unsigned __int64 waitCycles;
+    const char* const earlyWakeCause;
+
+    /// <param name="deepState">Use C0.2 (lower power, slower wakeup) instead of C0.1.</param>
+    /// <param name="wait_cycles">TSC ticks each umwait/tpause waits at most.</param>
+    /// <param name="earlyWakeCause">What ends a wait before its deadline, for the stats.</param>
+    waitpkg_spin(int numThreads, bool deepState, int wait_cycles, const char* earlyWakeCause) :
+        threadCount(numThreads),
+        control(deepState ? 0 : 1),
+        waitCycles((unsigned __int64)wait_cycles),
+        earlyWakeCause(earlyWakeCause)
+    {
+        causes = new wait_causes[numThreads];
+        for (int i = 0; i < numThreads; i++)
+        {
+            causes[i].waitCount = 0;
+            causes[i].timeoutCount = 0;
+            causes[i].osLimitCount = 0;
+        }
+    }
+
+    ~waitpkg_spin()
+    {
+        delete[] causes;
+    }
+
+    waitpkg_spin(const waitpkg_spin&) = delete;
+    waitpkg_spin& operator=(const waitpkg_spin&) = delete;
+
+    __forceinline int getSpinCount() const
+    {
+        return SPIN_COUNT;
+    }
+
+    /// <param name="deadline">The TSC deadline the wait was given.</param>
+    /// <param name="osLimit">The carry flag umwait/tpause returned.</param>
+    __forceinline void recordWait(int threadId, unsigned __int64 deadline, unsigned char osLimit)
+    {
+        causes[threadId].waitCount++;
+        if (osLimit)
+        {
+            causes[threadId].osLimitCount++;
+        }
+        else if (__rdtsc() >= deadline)
+        {
+            causes[threadId].timeoutCount++;
+        }
+    }
+
+    void printStats()
+    {
+        ulong totalWaits = 0, totalTimeouts = 0, totalOsLimits = 0;
+        for (int i = 0; i < threadCount; i++)
+        {
+            totalWaits += causes[i].waitCount;
+            totalTimeouts += causes[i].timeoutCount;
+            totalOsLimits += causes[i].osLimitCount;
+            PRINT_THEAD_STATS("[Thread #%d] Waits: %llu, Woken by %s: %llu, Timed out: %llu, OS limit: %llu", i, causes[i].waitCount, earlyWakeCause,
+                causes[i].waitCount - causes[i].timeoutCount - causes[i].osLimitCount, causes[i].timeoutCount, causes[i].osLimitCount);
+        }
+        PRINT_STATS("WAITPKG waits (C0.%d, %llu cycles): Total: %llu, Woken by %s: %llu, Timed out: %llu, OS limit: %llu", (control == 0) ? 2 : 1, (unsigned long long)waitCycles,
+            (unsigned long long)totalWaits, earlyWakeCause, (unsigned long long)(totalWaits - totalTimeouts - totalOsLimits), (unsigned long long)totalTimeouts, (unsigned long long)totalOsLimits);
+    }
+};
+
+/// <summary>
+/// Spin with umonitor/umwait.
+/// </summary>
+struct umwait_spin : waitpkg_spin
+{
+    umwait_spin(int numThreads, bool deepState, int wait_cycles) : waitpkg_spin(numThreads, deepState, wait_cycles, "a store or interrupt")
+    {
+    }
+
+    __forceinline void arm(const void* address)
+    {
+        _umonitor((void*)address);
+    }
+
+    __forceinline void wait(int threadId, int iteration)
+    {
+        UNREFERENCED_PARAMETER(iteration);
+        unsigned __int64 deadline = __rdtsc() + waitCycles;
+        recordWait(threadId, deadline, _umwait(control, deadline));
+    }
+};
+
+/// <summary>
+/// Spin with tpause instead of pause. tpause doesn't monitor anything, so a wait
+/// lasts until its deadline unless an interrupt or the OS limit ends it.
+/// </summary>
+struct tpause_spin : waitpkg_spin
+{
+    tpause_spin(int numThreads, bool deepState, int wait_cycles) : waitpkg_spin(numThreads, deepState, wait_cycles, "an interrupt")
+    {
+    }
+
+    __forceinline void arm(const void* address)
+    {
+        UNREFERENCED_PARAMETER(address);
+    }
+
+    __forceinline void wait(int threadId, int iteration)
+    {
+        UNREFERENCED_PARAMETER(iteration);
+        unsigned __int64 deadline = __rdtsc() + waitCycles;
+        recordWait(threadId, deadline, _tpause(control, deadline));
+    }
+};
+
+/// <summary>
+/// Tiered backoff, after the runtime's SpinWait: batches of pause that double every
+/// iteration, then giving up the time slice, then short sleeps, and once all of these
+/// are used up, hard-wait. Every thread accounts the time it spent in each tier.
+/// </summary>
+struct backoff_spin
+{
+    enum tier
+    {
+        pause_tier,
+        yield_tier,
+        sleep_tier,
+        tier_count
+    };
+
+    struct alignas(HS_CACHE_LINE_SIZE) tier_times
+    {
+        unsigned __int64 ticks[tier_count];
+        ulong rounds[tier_count];
+        ulong spinCount;
+    };
+
+    // Largest pause batch, so the color is still checked every few microseconds.
+    static const int MAX_PAUSE_SHIFT = 12;
+
+    tier_times* times;
+    const int threadCount;
+    const int pauseRounds;
+    const int yieldRounds;
+    const int sleepRounds;
+    const unsigned int sleepMicroseconds;
+
+    /// <param name="pause_rounds">Iterations spent in pause batches of 1, 2, 4... pauses.</param>
+    /// <param name="yield_rounds">Iterations that yield the processor after those.</param>
+    /// <param name="sleep_rounds">Iterations that sleep 'sleep_us' after those.</param>
+    backoff_spin(int numThreads, int pause_rounds, int yield_rounds, int sleep_rounds, int sleep_us) :
+        threadCount(numThreads),
+        pauseRounds(pause_rounds),
+        yieldRounds(yield_rounds),
+        sleepRounds(sleep_rounds),
+        sleepMicroseconds((unsigned int)sleep_us)
+    {
+        times = new tier_times[numThreads];
+        memset((void*)times, 0, sizeof(tier_times) * numThreads);
+    }
+
+    ~backoff_spin()
+    {
+        delete[] times;
+    }
+
+    backoff_spin(const backoff_spin&) = delete;
+    backoff_spin& operator=(const backoff_spin&) = delete;
+
+    static const char* getTierName(int tier)
+    {
+        switch (tier)
+        {
+        case pause_tier: return "Pause";
+        case yield_tier: return "Yield";
+        case sleep_tier: return "Sleep";
+        default: return "unknown";
+        }
+    }
+
+    __forceinline void arm(const void* address)
+    {
+        UNREFERENCED_PARAMETER(address);
+    }
+
+    __forceinline void wait(int threadId, int iteration)
+    {
+        tier_times& thread = times[threadId];
+        unsigned __int64 start = __rdtsc();
+        int tier;
+        thread.spinCount += (iteration == 0);
+        if (iteration < pauseRounds)
+        {
+            tier = pause_tier;
+            int pauses = 1 << ((iteration < MAX_PAUSE_SHIFT) ? iteration : MAX_PAUSE_SHIFT);
+            for (int i = 0; i < pauses; i++)
+            {
+                YieldProcessor();
+            }
+        }
+        else if (iteration < pauseRounds + yieldRounds)
+        {
+            tier = yield_tier;
+            YieldThread();
+        }
+        else
+        {
+            tier = sleep_tier;
+            SleepMicroseconds(sleepMicroseconds);
+        }
+        thread.ticks[tier] += __rdtsc() - start;
+        thread.rounds[tier]++;
+    }
+
+    __forceinline int getSpinCount() const
+    {
+        return pauseRounds + yieldRounds + sleepRounds;
+    }
+
+    void printStats()
+    {
+        tier_times total = {};
+        for (int i = 0; i < threadCount; i++)
+        {
+            for (int tier = 0; tier < tier_count; tier++)
+            {
+                total.ticks[tier] += times[i].ticks[tier];
+                total.rounds[tier] += times[i].rounds[tier];
+            }
+            total.spinCount += times[i].spinCount;
+            PRINT_THEAD_STATS("[Thread #%d] Spins: %llu, Pause: %llu ticks, Yield: %llu ticks, Sleep: %llu ticks", i, (unsigned long long)times[i].spinCount,
+                times[i].ticks[pause_tier], times[i].ticks[yield_tier], times[i].ticks[sleep_tier]);
+        }
+
+        PRINT_STATS("Backoff                     : Spins: %llu, Pause rounds: %d, Yield rounds: %d, Sleep rounds: %d x %u us", (unsigned long long)total.spinCount, pauseRounds, yieldRounds, sleepRounds, sleepMicroseconds);
+        for (int tier = 0; tier < tier_count; tier++)
+        {
+            PRINT_STATS("Backoff tier %-15s: Rounds: %llu, Ticks: %llu, Ticks per spin: %.0f", getTierName(tier), (unsigned long long)total.rounds[tier],
+                (unsigned long long)total.ticks[tier], (total.spinCount == 0) ? 0.0 : (double)total.ticks[tier] / total.spinCount);
+        }
+    }
+};
+
+/// <summary>
+/// How a waiter soft-waits before it hard-waits, if it does.
+/// </summary>
+enum class soft_wait
+{
+    none,       // Straight to hard-wait.
+    once,       // A single Spin::wait().
+    loop,       // Up to Spin::getSpinCount() Spin::wait(), leaving as soon as the color changed.
+};
+
+/// <summary>
+/// Soft-wait 'Soft', then hard-wait if 'HardWait', else soft-wait again until the color changed.
+/// </summary>
+template<soft_wait Soft, bool HardWait>
+struct wait_policy
+{
+    static const soft_wait soft = Soft;
+    static const bool hard_wait = HardWait;
+};
+
+typedef wait_policy<soft_wait::loop, true> spin_then_hard_wait;
+typedef wait_policy<soft_wait::once, true> wait_once_then_hard_wait;
+typedef wait_policy<soft_wait::none, true> hard_wait_only;
+typedef wait_policy<soft_wait::loop, false> soft_wait_only;
+typedef wait_policy<soft_wait::once, false> wait_once_soft_wait_only;
+
+template<typename Spin, typename Wait, typename Backend>
+class t_join_composed final : public t_join
+{
+private:
+    Spin spin;
+
+    __forceinline Backend* backend()
+    {
+        return static_cast<Backend*>(hardWait);
+    }
+
+public:
+    static const bool uses_hard_wait = Wait::hard_wait;
+
+    /// <param name="spinArgs">Arguments of the Spin constructor, after the number of threads.</param>
+    template<typename... SpinArgs>
+    t_join_composed(int numThreads, join_layout layout, hard_wait_kind hardWaitKind, SpinArgs... spinArgs) :
+        t_join(numThreads, layout, hardWaitKind),
+        spin(numThreads, spinArgs...)
+    {
+        assert(dynamic_cast<Backend*>(hardWait) != nullptr);
+    }
+
+    /// <summary>
+    /// Soft-waits for the color to change as Wait says, then hard-waits on Backend if
+    /// Wait says so and the color still didn't change.
+    /// </summary>
+    /// <param name="inputIndex">index for which join is performed.</param>
+    /// <param name="threadId">Thread id</param>
+    /// <param name="wasHardWait">If there was hardwait needed</param>
+    /// <param name="spinLoopStopTime">Time tick at which the soft-wait was completed
+    /// (either because color was changed sooner, or it had to hard-wait, in which case
+    /// it utilized all the spin iterations.</param>
+    /// <returns>Total spin iterations performed.</returns>
+    virtual ulong join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime)
+    {
+        UNREFERENCED_PARAMETER(inputIndex);
+        ulong totalIterations = 0;
+        *wasHardWait = false;
+        int color = join_struct.lock_color.LoadWithoutBarrier();
+        int stillRunning = Interlocked::Decrement(&join_struct.join_lock);
+        if (stillRunning != 0)
+        {
+            // earlyWakeThreads and spinBudgetTicks are runtime settings, unlike the policies:
+            // as template parameters they would quadruple the instantiations of every alias
+            // and backend, for a compare per arrival and one per spin that always goes the same way.
+
+            // Only where a woken thread has a soft-wait to go back to.
+            if constexpr (Wait::hard_wait && (Wait::soft != soft_wait::none))
+            {
+                if (stillRunning == earlyWakeThreads)
+                {
+                    backend()->template wakeEarly<Backend>(color);
+                }
+            }
+
+            if (color == join_struct.lock_color.LoadWithoutBarrier())
+            {
+                *spinLoopStartTime = GetCounter();
+respin:
+                if constexpr (Wait::soft == soft_wait::loop)
+                {
+                    // With a spin budget, the loop ends at a TSC deadline rather than after getSpinCount() iterations.
+                    const bool budgeted = (spinBudgetTicks != 0);
+                    const int spinCount = budgeted ? INT_MAX : spin.getSpinCount();
+                    // Taken at every respin, so a thread back from wait() spins a whole budget again,
+                    // the way it spins getSpinCount() iterations again without one.
+                    const unsigned __int64 deadline = budgeted ? (GetCounter() + spinBudgetTicks) : 0;
+                    int j = 0;
+                    for (; j < spinCount; j++)
+                    {
+                        spin.arm((const void*)&join_struct.lock_color);
+                        if (color != join_struct.lock_color.LoadWithoutBarrier())
+                        {
+                            PRINT_SOFT_WAIT("%d. %llu iterations.", threadId, inputIndex, totalIterations + j);
+                            break;
+                        }
+                        spin.wait(threadId, j);
+                        if (budgeted && (__rdtsc() >= deadline))
+                        {
+                            j++;
+                            break;
+                        }
+                    }
+                    totalIterations += j;
+                }
+                else if constexpr (Wait::soft == soft_wait::once)
+                {
+                    spin.arm((const void*)&join_struct.lock_color);
+                    if (color == join_struct.lock_color.LoadWithoutBarrier())
+                    {
+                        spin.wait(threadId, 0);
+                    }
+                    totalIterations += 1;
+                }
+
+                if constexpr (Wait::hard_wait)
+                {
+                    *spinLoopStopTime = GetCounter();
+
+                    // we've spun, and if color still hasn't changed, fall into hard wait
+                    if (color == join_struct.lock_color.LoadWithoutBarrier())
+                    {
+                        PRINT_HARD_WAIT("%d. %llu iterations.", threadId, inputIndex, totalIterations);
+                        *wasHardWait = true;
+                        uint32_t dwJoinWait = backend()->template wait<Backend>(color);
+
+                        if (dwJoinWait != WAIT_OBJECT_0)
+                        {
+                            printf("Fatal error");
+                            exit(1);
+                        }
+                    }
+                }
+
+                // avoid race due to the thread about to reset the event (occasionally) being
+                // preempted before ResetEvent()
+                if (color == join_struct.lock_color.LoadWithoutBarrier())
+                {
+                    goto respin;
+                }
+
+                if constexpr (!Wait::hard_wait)
+                {
+                    *spinLoopStopTime = GetCounter();
+                }
+            }
+        }
+        else
+        {
+            PRINT_RELEASE("%d", threadId, inputIndex);
+            PRINT_RELEASE("---------------\n", threadId);
+            join_struct.joined_p = true;
+            if constexpr (Wait::hard_wait)
+            {
+                backend()->template reset<Backend>(!color);
+            }
+        }
+        return totalIterations;
+    }
+
+    /// <summary>
+    /// Same as t_join::restart(), with the wake-up going straight to Backend.
+    /// </summary>
+    virtual void restart(int threadId, int numberIndex, bool isLastIteration)
+    {
+        UNREFERENCED_PARAMETER(threadId);
+        UNREFERENCED_PARAMETER(numberIndex);
+        join_struct.joined_p = false;
+        join_struct.join_lock = join_struct.n_threads;
+        int color = join_struct.lock_color.LoadWithoutBarrier();
+
+        recordRestartStartTime();
+        join_struct.lock_color = !color;
+        backend()->template wake<Backend>(color);
+
+        if (isLastIteration)
+        {
+            signalCompletion();
+        }
+    }
+
+    virtual void printStats()
+    {
+        spin.printStats();
+    }
+};
+
+// The join types 1-7 and 13-15, by the name of the class each used to be, and 16.
+template<typename Backend> using t_join_pause = t_join_composed<pause_spin, spin_then_hard_wait, Backend>;
+template<typename Backend> using t_join_pause_soft_wait_only = t_join_composed<pause_spin, soft_wait_only, Backend>;
+template<typename Backend> using t_join_mwaitx_loop = t_join_composed<mwaitx_spin, spin_then_hard_wait, Backend>;
+template<typename Backend> using t_join_mwaitx_loop_soft_wait_only = t_join_composed<mwaitx_spin, soft_wait_only, Backend>;
+template<typename Backend> using t_join_mwaitx_noloop = t_join_composed<mwaitx_spin, wait_once_then_hard_wait, Backend>;
+template<typename Backend> using t_join_mwaitx_noloop_soft_wait_only = t_join_composed<mwaitx_spin, wait_once_soft_wait_only, Backend>;
+template<typename Backend> using t_join_hard_wait_only = t_join_composed<pause_spin, hard_wait_only, Backend>;
+template<typename Backend> using t_join_umwait_loop = t_join_composed<umwait_spin, spin_then_hard_wait, Backend>;
+template<typename Backend> using t_join_umwait_noloop = t_join_composed<umwait_spin, wait_once_then_hard_wait, Backend>;
+template<typename Backend> using t_join_tpause_loop = t_join_composed<tpause_spin, spin_then_hard_wait, Backend>;
+template<typename Backend> using t_join_backoff = t_join_composed<backoff_spin, spin_then_hard_wait, Backend>;
@@ -0,0 +1,248 @@
+#pragma once
+#include "Platform.h"
+#include <version>
+#ifdef __cpp_lib_barrier
+#include <barrier>
+#endif // __cpp_lib_barrier
+#ifdef _OPENMP
+#include <omp.h>
+#endif // _OPENMP
+#include "common.h"
+#include "t_join.h"
+
+// Join types that wrap the barriers the standard library, the OS and OpenMP ship,
+// as a baseline for the runtime's own join. None of them says whether a waiter spun
+// or slept, so a wait counts as a hard-wait when the thread made a voluntary
+// context switch during it, and the whole wait shows up as its spin-loop time.
+
+/// <summary>
+/// What t_join_std_barrier, t_join_pthread_barrier and t_join_omp_barrier share:
+/// timing and classifying the wait, and the restart time. The barriers release
+/// everyone themselves, so every thread waited and nobody calls restart(); thread 0
+/// signals completion once it is finished.
+/// </summary>
+class t_join_native : public t_join
+{
+private:
+    struct alignas(HS_CACHE_LINE_SIZE) native_wait_state
+    {
+        unsigned __int64 wakeupLatency;
+        long long contextSwitches;
+    };
+
+    native_wait_state* states;
+
+protected:
+    t_join_native(int numThreads, join_layout layout) : t_join(numThreads, layout, hard_wait_kind::event)
+    {
+        states = new native_wait_state[numThreads];
+        for (int i = 0; i < numThreads; i++)
+        {
+            states[i].wakeupLatency = 0;
+            states[i].contextSwitches = -1;
+        }
+    }
+
+    /// <summary>
+    /// For barriers that can't run code once everyone arrived: the last thread to
+    /// arrive at join_lock records the restart time before it enters the barrier,
+    /// which is as close to the release as can be observed from outside.
+    /// </summary>
+    __forceinline void recordArrival()
+    {
+        if (Interlocked::Decrement(&join_struct.join_lock) == 0)
+        {
+            // Nobody arrives again before we entered the barrier too.
+            join_struct.join_lock = join_struct.n_threads;
+            recordRestartStartTime();
+        }
+    }
+
+    /// <summary>
+    /// Calls 'wait', which arrives at the barrier and returns once it was released.
+    /// </summary>
+    template<typename Wait>
+    __forceinline void timeWait(int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime, Wait wait)
+    {
+        native_wait_state& state = states[threadId];
+
+        // Afterwards, the count is read once per join, after the wait: the work between
+        // two joins doesn't block, so the previous reading is as good as a new one.
+        if (state.contextSwitches < 0)
+        {
+            state.contextSwitches = GetVoluntaryContextSwitches();
+        }
+
+        *spinLoopStartTime = GetCounter();
+        wait();
+        unsigned __int64 wakeTime = GetCounter();
+        *spinLoopStopTime = wakeTime;
+
+        // The next restart time can't be recorded before this thread arrived again.
+        unsigned __int64 restartTime = join_struct.restartStartTime;
+        state.wakeupLatency = (wakeTime > restartTime) ? (wakeTime - restartTime) : 0;
+
+        long long contextSwitches = GetVoluntaryContextSwitches();
+        *wasHardWait = (contextSwitches != state.contextSwitches);
+        state.contextSwitches = contextSwitches;
+    }
+
+public:
+    virtual bool joined(int threadId)
+    {
+        UNREFERENCED_PARAMETER(threadId);
+        return false;
+    }
+
+    virtual void finished(int threadId)
+    {
+        if (threadId == 0)
+        {
+            signalCompletion();
+        }
+    }
+
+    virtual unsigned __int64 getTicksSinceRestart(int threadId)
+    {
+        return states[threadId].wakeupLatency;
+    }
+
+    virtual ~t_join_native()
+    {
+        delete[] states;
+    }
+};
+
+#ifdef __cpp_lib_barrier
+class t_join_std_barrier final : public t_join_native
+{
+private:
+    // Run by one thread once everyone arrived, before anyone is released.
+    struct record_restart
+    {
+        t_join_std_barrier* join;
+
+        void operator()() noexcept
+        {
+            join->recordRestartStartTime();
+        }
+    };
+
+    std::barrier<record_restart> barrier;
+
+public:
+    t_join_std_barrier(int numThreads, join_layout layout) :
+        t_join_native(numThreads, layout),
+        barrier(numThreads, record_restart{ this })
+    {
+    }
+
+    /// <summary>
+    /// std::barrier::arrive_and_wait(). Its completion function records the restart time.
+    /// </summary>
+    /// <param name="inputIndex">index for which join is performed.</param>
+    /// <param name="threadId">Thread id</param>
+    /// <param name="wasHardWait">If the thread blocked while waiting</param>
+    /// <returns>0, the spin iterations are not observable.</returns>
+    virtual ulong join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime)
+    {
+        UNREFERENCED_PARAMETER(inputIndex);
+        timeWait(threadId, wasHardWait, spinLoopStartTime, spinLoopStopTime, [this]()
+        {
+            barrier.arrive_and_wait();
+        });
+        return 0;
+    }
+};
+#endif // __cpp_lib_barrier
+
+/// <summary>
+/// pthread_barrier_wait() on Linux. Windows has no pthreads, so there it is
+/// EnterSynchronizationBarrier() with its default spin count, the OS's own barrier.
+/// </summary>
+class t_join_pthread_barrier final : public t_join_native
+{
+private:
+#ifdef _WIN32
+    SYNCHRONIZATION_BARRIER barrier;
+#else
+    pthread_barrier_t barrier;
+#endif // _WIN32
+
+public:
+    t_join_pthread_barrier(int numThreads, join_layout layout) : t_join_native(numThreads, layout)
+    {
+#ifdef _WIN32
+        BOOL result = InitializeSynchronizationBarrier(&barrier, numThreads, -1);
+        assert(result);
+#else
+        int result = pthread_barrier_init(&barrier, nullptr, (unsigned)numThreads);
+        assert(result == 0);
+#endif // _WIN32
+        (void)result;
+    }
+
+    /// <param name="inputIndex">index for which join is performed.</param>
+    /// <param name="threadId">Thread id</param>
+    /// <param name="wasHardWait">If the thread blocked while waiting</param>
+    /// <returns>0, the spin iterations are not observable.</returns>
+    virtual ulong join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime)
+    {
+        UNREFERENCED_PARAMETER(inputIndex);
+        recordArrival();
+        timeWait(threadId, wasHardWait, spinLoopStartTime, spinLoopStopTime, [this]()
+        {
+#ifdef _WIN32
+            EnterSynchronizationBarrier(&barrier, 0);
+#else
+            int result = pthread_barrier_wait(&barrier);
+            if ((result != 0) && (result != PTHREAD_BARRIER_SERIAL_THREAD))
+            {
+                printf("Fatal error");
+                exit(1);
+            }
+#endif // _WIN32
+        });
+        return 0;
+    }
+
+    virtual ~t_join_pthread_barrier()
+    {
+#ifdef _WIN32
+        DeleteSynchronizationBarrier(&barrier);
+#else
+        pthread_barrier_destroy(&barrier);
+#endif // _WIN32
+    }
+};
+
+#ifdef _OPENMP
+/// <summary>
+/// '#pragma omp barrier'. It only synchronizes the threads of an OpenMP team, so
+/// the workers of this join type run on one (see RunOpenMPTeam()) instead of
+/// on threads of their own. How long libgomp spins before it sleeps is up to
+/// OMP_WAIT_POLICY and GOMP_SPINCOUNT.
+/// </summary>
+class t_join_omp_barrier final : public t_join_native
+{
+public:
+    t_join_omp_barrier(int numThreads, join_layout layout) : t_join_native(numThreads, layout)
+    {
+    }
+
+    /// <param name="inputIndex">index for which join is performed.</param>
+    /// <param name="threadId">Thread id</param>
+    /// <param name="wasHardWait">If the thread blocked while waiting</param>
+    /// <returns>0, the spin iterations are not observable.</returns>
+    virtual ulong join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime)
+    {
+        UNREFERENCED_PARAMETER(inputIndex);
+        recordArrival();
+        timeWait(threadId, wasHardWait, spinLoopStartTime, spinLoopStopTime, []()
+        {
+#pragma omp barrier
+        });
+        return 0;
+    }
+};
+#endif // _OPENMP
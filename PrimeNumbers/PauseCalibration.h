@@ -0,0 +1,104 @@
+#pragma once
+#include "Platform.h"
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include "CpuFeatures.h"
+
+/// <summary>
+/// What a 'pause' costs on this processor, measured once at startup the way the
+/// runtime normalizes YieldProcessor(): its latency ranges from about 10 cycles
+/// (before Skylake, Zen) to about 140 (Skylake-SP and later), so SPIN_COUNT pauses
+/// last a very different time depending on where the binary runs. Spin budgets are
+/// given in time instead and converted to TSC ticks with the frequency found here.
+/// </summary>
+class PauseCalibration
+{
+private:
+    static const int PAUSES_PER_TRIAL = 1000;
+    static const int TRIAL_COUNT = 100;
+
+    // How long the TSC is compared against the steady clock when CPUID doesn't enumerate its frequency.
+    static constexpr int TSC_MEASURE_MILLISECONDS = 50;
+
+    double m_pauseTicks;
+    uint64_t m_tscFrequency;
+    bool m_tscFrequencyFromCpuid;
+
+    static uint64_t MeasureTscFrequency()
+    {
+        auto begin = std::chrono::steady_clock::now();
+        uint64_t beginTicks = __rdtsc();
+        std::chrono::steady_clock::duration elapsed;
+        do
+        {
+            elapsed = std::chrono::steady_clock::now() - begin;
+        } while (elapsed < std::chrono::milliseconds(TSC_MEASURE_MILLISECONDS));
+        uint64_t ticks = __rdtsc() - beginTicks;
+        return (uint64_t)((double)ticks * 1e9 / (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+public:
+    PauseCalibration() : m_pauseTicks(0), m_tscFrequency(0), m_tscFrequencyFromCpuid(false)
+    {
+    }
+
+    void Calibrate(const CpuFeatures& features)
+    {
+        m_tscFrequency = features.GetTscFrequency();
+        m_tscFrequencyFromCpuid = (m_tscFrequency != 0);
+        if (!m_tscFrequencyFromCpuid)
+        {
+            m_tscFrequency = MeasureTscFrequency();
+        }
+
+        // The fastest trial is the one that was neither interrupted nor descheduled.
+        uint64_t fastestTrial = UINT64_MAX;
+        for (int trial = 0; trial < TRIAL_COUNT; trial++)
+        {
+            uint64_t begin = __rdtsc();
+            for (int i = 0; i < PAUSES_PER_TRIAL; i++)
+            {
+                YieldProcessor();
+            }
+            uint64_t ticks = __rdtsc() - begin;
+            if (ticks < fastestTrial)
+            {
+                fastestTrial = ticks;
+            }
+        }
+        m_pauseTicks = (double)fastestTrial / PAUSES_PER_TRIAL;
+    }
+
+    /// <summary>
+    /// TSC ticks per 'pause'.
+    /// </summary>
+    double GetPauseTicks() const
+    {
+        return m_pauseTicks;
+    }
+
+    uint64_t GetTscFrequency() const
+    {
+        return m_tscFrequency;
+    }
+
+    double TicksToNanoseconds(double ticks) const
+    {
+        return ticks * 1e9 / (double)m_tscFrequency;
+    }
+
+    uint64_t NanosecondsToTicks(uint64_t nanoseconds) const
+    {
+        return (uint64_t)((double)nanoseconds * (double)m_tscFrequency / 1e9);
+    }
+
+    /// <param name="spinCount">Iterations of a 'pause' spin-loop, to show how long they take here.</param>
+    void PrintSummary(int spinCount) const
+    {
+        printf("Calibration: TSC: %.2f MHz (%s). pause: %.1f ticks (%.2f ns). %d pauses: %.1f us.\n",
+            m_tscFrequency / 1e6, m_tscFrequencyFromCpuid ? "CPUID" : "measured",
+            m_pauseTicks, TicksToNanoseconds(m_pauseTicks),
+            spinCount, TicksToNanoseconds(m_pauseTicks * spinCount) / 1000);
+    }
+};
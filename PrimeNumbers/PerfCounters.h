@@ -0,0 +1,127 @@
+#pragma once
+#include "Platform.h"
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif // !_WIN32
+
+/// <summary>
+/// Per-thread hardware cache counters, used as a proxy for the coherence traffic a
+/// join generates: every time a waiter's copy of a shared line is invalidated, its
+/// next load misses in L1D and, if the line is owned by another core, goes to the
+/// LLC or beyond.
+///
+/// Counts only user mode, for the calling thread, from Open() until Read(). Uses
+/// perf_event_open on Linux; not available on Windows or when the kernel does not
+/// allow it (see /proc/sys/kernel/perf_event_paranoid), in which case IsValid()
+/// is false and everything reads as 0.
+/// </summary>
+class PerfCounters
+{
+public:
+    enum Counter
+    {
+        L1DReadMisses,
+        LLCMisses,
+        CounterCount
+    };
+
+private:
+    int m_fds[CounterCount];
+    bool m_valid;
+
+#ifndef _WIN32
+    static int OpenCounter(uint32_t type, uint64_t config)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return (int)syscall(SYS_perf_event_open, &attr, 0 /* this thread */, -1 /* any cpu */, -1, 0);
+    }
+#endif // !_WIN32
+
+public:
+    PerfCounters() : m_valid(false)
+    {
+        for (int i = 0; i < CounterCount; i++)
+        {
+            m_fds[i] = -1;
+        }
+    }
+
+    ~PerfCounters()
+    {
+        Close();
+    }
+
+    static const char* GetName(Counter counter)
+    {
+        switch (counter)
+        {
+        case L1DReadMisses: return "L1D read misses";
+        case LLCMisses: return "LLC misses";
+        default: return "unknown";
+        }
+    }
+
+    bool IsValid() const { return m_valid; }
+
+    /// <summary>
+    /// Starts counting for the calling thread.
+    /// </summary>
+    bool Open()
+    {
+#ifndef _WIN32
+        m_fds[L1DReadMisses] = OpenCounter(PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        m_fds[LLCMisses] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+        m_valid = true;
+        for (int i = 0; i < CounterCount; i++)
+        {
+            m_valid &= (m_fds[i] >= 0);
+        }
+        if (!m_valid)
+        {
+            Close();
+        }
+#endif // !_WIN32
+        return m_valid;
+    }
+
+    void Read(uint64_t values[CounterCount])
+    {
+        for (int i = 0; i < CounterCount; i++)
+        {
+            values[i] = 0;
+#ifndef _WIN32
+            if (m_valid && (read(m_fds[i], &values[i], sizeof(values[i])) != sizeof(values[i])))
+            {
+                values[i] = 0;
+            }
+#endif // !_WIN32
+        }
+    }
+
+    void Close()
+    {
+#ifndef _WIN32
+        for (int i = 0; i < CounterCount; i++)
+        {
+            if (m_fds[i] >= 0)
+            {
+                close(m_fds[i]);
+                m_fds[i] = -1;
+            }
+        }
+#endif // !_WIN32
+        m_valid = false;
+    }
+};
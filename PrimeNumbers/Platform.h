@@ -0,0 +1,249 @@
+#pragma once
+
+// Minimal platform abstraction so the join simulation builds both with MSVC
+// on Windows and with GCC/Clang on Linux. On Windows everything forwards to
+// the Win32 headers; on Linux we provide the handful of Win32 names that the
+// code extracted from dotnet/runtime relies on.
+
+#ifdef _WIN32
+
+#include <windows.h>
+#include <intrin.h>
+#include <io.h>
+#include <malloc.h>
+#include <stdio.h>
+
+typedef HANDLE ThreadHandle;
+
+#else // _WIN32
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <x86intrin.h>
+#include <cpuid.h>
+
+typedef uint32_t DWORD;
+typedef int BOOL;
+typedef long long LONGLONG;
+typedef void* LPVOID;
+typedef pthread_t ThreadHandle;
+
+#define __int64 long long
+#define __forceinline inline __attribute__((always_inline))
+#define WINAPI
+
+#define TRUE 1
+#define FALSE 0
+
+#define INFINITE 0xFFFFFFFF
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT 258
+#define WAIT_FAILED 0xFFFFFFFF
+
+#define UNREFERENCED_PARAMETER(P) (void)(P)
+
+#define YieldProcessor() _mm_pause()
+#define MemoryBarrier() __sync_synchronize()
+#define GetLastError() ((DWORD)errno)
+
+#define _strcmpi strcasecmp
+#define sprintf_s snprintf
+
+#endif // _WIN32
+
+typedef DWORD (WINAPI *ThreadProc)(LPVOID lpParam);
+
+inline void* AlignedAlloc(size_t alignment, size_t size)
+{
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    void* result = nullptr;
+    return (posix_memalign(&result, alignment, size) == 0) ? result : nullptr;
+#endif // _WIN32
+}
+
+inline void AlignedFree(void* ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif // _WIN32
+}
+
+inline ThreadHandle GetCurrentThreadHandle()
+{
+#ifdef _WIN32
+    return GetCurrentThread();
+#else
+    return pthread_self();
+#endif // _WIN32
+}
+
+// Gives the rest of the time slice to another thread that is ready to run on this processor, if any.
+inline void YieldThread()
+{
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif // _WIN32
+}
+
+// Windows only sleeps in whole milliseconds (of the timer resolution), so the
+// duration is rounded up there.
+inline void SleepMicroseconds(unsigned int microseconds)
+{
+#ifdef _WIN32
+    Sleep((microseconds + 999) / 1000);
+#else
+    struct timespec duration;
+    duration.tv_sec = microseconds / 1000000;
+    duration.tv_nsec = (long)(microseconds % 1000000) * 1000;
+    nanosleep(&duration, nullptr);
+#endif // _WIN32
+}
+
+// How often the calling thread blocked so far. Windows doesn't count them per thread
+// without the native API, so it is always 0 there.
+inline long long GetVoluntaryContextSwitches()
+{
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return (long long)usage.ru_nvcsw;
+#endif // _WIN32
+}
+
+// Allocates whole pages that are not backed by memory until first touched. Since
+// both Linux and Windows place a page on the NUMA node of the thread that first
+// touches it, memory allocated and initialized by an affinitized thread is local to it.
+inline void* AllocatePages(size_t size)
+{
+#ifdef _WIN32
+    return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void* result = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (result == MAP_FAILED) ? nullptr : result;
+#endif // _WIN32
+}
+
+inline void FreePages(void* ptr, size_t size)
+{
+#ifdef _WIN32
+    UNREFERENCED_PARAMETER(size);
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, size);
+#endif // _WIN32
+}
+
+// A file that is deleted once closed, in the temporary directory ($TMPDIR on Linux).
+inline FILE* CreateTemporaryFile()
+{
+#ifdef _WIN32
+    FILE* file = nullptr;
+    return (tmpfile_s(&file) == 0) ? file : nullptr;
+#else
+    const char* directory = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/PrimeNumbers-XXXXXX", ((directory != nullptr) && (*directory != '\0')) ? directory : "/tmp");
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        return nullptr;
+    }
+    unlink(path);
+    return fdopen(fd, "w+b");
+#endif // _WIN32
+}
+
+// Maps the first 'size' bytes of 'file', which is open for update, growing it to
+// that size. The mapping is shared with the file, so the OS can write pages back
+// and drop them rather than keep all of them in memory.
+inline void* MapFile(FILE* file, size_t size)
+{
+#ifdef _WIN32
+    HANDLE mapping = CreateFileMappingW((HANDLE)_get_osfhandle(_fileno(file)), nullptr, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, nullptr);
+    if (mapping == nullptr)
+    {
+        return nullptr;
+    }
+    void* result = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    // The view keeps the mapping alive.
+    CloseHandle(mapping);
+    return result;
+#else
+    int fd = fileno(file);
+    if (ftruncate(fd, (off_t)size) != 0)
+    {
+        return nullptr;
+    }
+    void* result = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return (result == MAP_FAILED) ? nullptr : result;
+#endif // _WIN32
+}
+
+inline void UnmapFile(void* ptr, size_t size)
+{
+#ifdef _WIN32
+    UNREFERENCED_PARAMETER(size);
+    UnmapViewOfFile(ptr);
+#else
+    munmap(ptr, size);
+#endif // _WIN32
+}
+
+// Mirrors the Interlocked helpers from the GC's environment. Unlike the raw
+// _InterlockedDecrement((long*)...) casts, these operate on the actual width
+// of the target, which matters on LP64 where 'long' is 8 bytes.
+class Interlocked
+{
+public:
+    template<typename T>
+    static __forceinline T Decrement(T volatile* addend)
+    {
+#ifdef _MSC_VER
+        static_assert(sizeof(T) == sizeof(long), "Interlocked::Decrement only supports 32-bit operands");
+        return (T)_InterlockedDecrement((long volatile*)addend);
+#else
+        return __sync_sub_and_fetch(addend, 1);
+#endif
+    }
+
+    template<typename T>
+    static __forceinline T Increment(T volatile* addend)
+    {
+#ifdef _MSC_VER
+        static_assert(sizeof(T) == sizeof(long), "Interlocked::Increment only supports 32-bit operands");
+        return (T)_InterlockedIncrement((long volatile*)addend);
+#else
+        return __sync_add_and_fetch(addend, 1);
+#endif
+    }
+
+    // Returns the value '*destination' had before.
+    template<typename T>
+    static __forceinline T CompareExchange(T volatile* destination, T exchange, T comparand)
+    {
+#ifdef _MSC_VER
+        static_assert(sizeof(T) == sizeof(long), "Interlocked::CompareExchange only supports 32-bit operands");
+        return (T)_InterlockedCompareExchange((long volatile*)destination, (long)exchange, (long)comparand);
+#else
+        return __sync_val_compare_and_swap(destination, comparand, exchange);
+#endif
+    }
+};
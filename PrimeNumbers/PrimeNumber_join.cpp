@@ -1,14 +1,23 @@
 
-#include <windows.h>
+#include "Platform.h"
 #include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdint.h>
-#include <intrin.h>
-#include <conio.h>
 #include <queue>
 #include <thread>
 #include <chrono>
+#include "CpuFeatures.h"
+#include "Histogram.h"
+#include "Imbalance.h"
+#include "JoinPolicies.h"
+#include "NativeBarriers.h"
+#include "PauseCalibration.h"
+#include "PerfCounters.h"
 #include "ProcessorInfo.h"
+#include "ThreadImpl.h"
+#include "Trace.h"
+#include "Workload.h"
 #include "common.h"
 #include "t_join.h"
 
@@ -17,20 +26,37 @@ t_join* joinData = nullptr;
 std::chrono::steady_clock::time_point beginTimer;
 unsigned __int64 start;
 
-class ThreadInput
+// Workers count themselves ready once their setup is done, then wait for the gate
+// to open, so allocating statistics and building workload heaps isn't measured.
+Volatile<int> readyThreadCount;
+EventImpl startGate;
+
+/// <summary>
+/// How the per-thread output of ThreadWorker is placed in memory.
+/// </summary>
+enum class stats_layout
+{
+    shared = 1,     // Allocated back to back by the main thread, so neighbouring threads share cache lines.
+    arena = 2,      // Allocated by each thread after it was affinitized, cache-line aligned and NUMA local.
+};
+
+const int STATS_LAYOUT_COUNT = 2;
+
+const char* GetStatsLayoutName(stats_layout layout)
+{
+    return (layout == stats_layout::shared) ? "shared" : "arena";
+}
+
+/// <summary>
+/// Output of a ThreadWorker, updated after every join.
+/// </summary>
+struct ThreadStats
 {
-public:
     // Just to keep track of answers so the compiler doesn't discard them
     // during optimization.
     int answer;
     int processed;
 
-    // Input to the Threadworker
-    int threadId;
-    ulong* input;
-    int count;
-
-    // Output from the processing
     ulong totalIterations;
     int hardWaitCount;
     int softWaitCount;
@@ -40,15 +66,118 @@ public:
     unsigned __int64 softWaitWakeupTimeTicks;
     unsigned __int64 hardWaitWakeupTimeTicks;
 
-    ThreadInput(int threadId, int numPrimeNumbers) :
-        threadId(threadId),
-        count(numPrimeNumbers),
+    // Hardware cache counters of this thread, see PerfCounters.
+    bool perfCountersValid;
+    uint64_t perfCounters[PerfCounters::CounterCount];
+
+    // Waits per phase of a trace with labeled rounds.
+    struct PhaseStats
+    {
+        int hardWaitCount;
+        int softWaitCount;
+        unsigned __int64 spinLoopTimeTicks;
+        unsigned __int64 wakeupTimeTicks;
+    } phases[MAX_TRACE_PHASES];
+
+    // How long the work of the rounds was meant to take and took, for the timed workloads.
+    unsigned __int64 workTicksRequested;
+    unsigned __int64 workTicksTaken;
+    unsigned __int64 workTicksAbsoluteError;
+
+    ThreadStats() :
         answer(0),
         processed(0),
-        input(nullptr),
         totalIterations(0),
         hardWaitCount(0),
-        softWaitCount(0) {}
+        softWaitCount(0),
+        spinLoopTimeTicksHardWait(0),
+        spinLoopTimeTicksSoftWait(0),
+        softWaitWakeupTimeTicks(0),
+        hardWaitWakeupTimeTicks(0),
+        perfCountersValid(false),
+        perfCounters(),
+        phases(),
+        workTicksRequested(0),
+        workTicksTaken(0),
+        workTicksAbsoluteError(0) {}
+};
+
+/// <summary>
+/// Distributions of the values summed in ThreadStats.
+/// </summary>
+struct ThreadHistograms
+{
+    LatencyHistogram spinLoopTimeHistogram;
+    LatencyHistogram softWaitWakeupHistogram;
+    LatencyHistogram hardWaitWakeupHistogram;
+    LatencyHistogram workErrorHistogram;
+};
+
+/// <summary>
+/// Per-thread arena holding a ThreadStats on cache lines of its own, followed by the
+/// ThreadHistograms. It is allocated from fresh pages and initialized by the owning
+/// thread once it is affinitized, so the pages are homed on that thread's NUMA node.
+/// </summary>
+class ThreadStatsArena
+{
+private:
+    static size_t GetStatsSize()
+    {
+        return (sizeof(ThreadStats) + HS_CACHE_LINE_SIZE - 1) & ~(HS_CACHE_LINE_SIZE - 1);
+    }
+
+public:
+    static size_t GetSize()
+    {
+        return GetStatsSize() + sizeof(ThreadHistograms);
+    }
+
+    static bool Allocate(ThreadStats** stats, ThreadHistograms** histograms)
+    {
+        char* memory = (char*)AllocatePages(GetSize());
+        if (memory == nullptr)
+        {
+            return false;
+        }
+        *stats = new (memory) ThreadStats();
+        *histograms = new (memory + GetStatsSize()) ThreadHistograms();
+        return true;
+    }
+
+    static void Free(ThreadStats* stats)
+    {
+        FreePages(stats, GetSize());
+    }
+};
+
+class ThreadInput
+{
+public:
+    // Input to the Threadworker
+    int threadId;
+    ulong* input;
+    int count;
+    stats_layout statsLayout;
+    workload_kind workloadKind;
+    size_t workloadHeapBytes;
+    double workloadTicksPerNanosecond;
+    const uint8_t* phases;  // Phase of each input, for traces with labeled rounds.
+
+    // Output from the processing. For stats_layout::arena, allocated by the thread itself.
+    ThreadStats* stats;
+    ThreadHistograms* histograms;
+
+    ThreadInput(int threadId, int numPrimeNumbers, stats_layout statsLayout, workload_kind workloadKind, size_t workloadHeapBytes, double workloadTicksPerNanosecond) :
+        threadId(threadId),
+        input(nullptr),
+        count(numPrimeNumbers),
+        statsLayout(statsLayout),
+        workloadKind(workloadKind),
+        workloadHeapBytes(workloadHeapBytes),
+        workloadTicksPerNanosecond(workloadTicksPerNanosecond),
+        phases(nullptr),
+        stats(nullptr),
+        histograms(nullptr) {}
 };
 
 const double _1Q = pow(10, 15);
@@ -91,111 +220,462 @@ const char* formatNumber(double input)
 }
 
 /// <summary>
-/// Given a number 'input', each thread finds smallest prime number greater than 'n'.
-/// If next prime number is beyond INT_MAX, it will return 0.
+/// Adds a join that this thread waited in to its statistics.
 /// </summary>
-/// <param name="n"></param>
-/// <returns></returns>
-ulong FindNextPrimeNumber(ulong input)
+__forceinline void RecordWait(ThreadStats* stats, ThreadHistograms* histograms, bool wasHardWait, unsigned __int64 spinWaitCpuCycles, unsigned __int64 wakeupLatency)
 {
-    // Start checking each number from input upto input * 2.
-    for (ulong i = input; i < input * 2; i++)
+    if (wasHardWait)
     {
-        bool found = true;
-        for (ulong j = 2; j < i / 2; j++)
-        {
-            if (i % j == 0)
-            {
-                found = false;
-                break;
-            }
-        }
-
-        if (found)
-        {
-            return i;
-        }
+        stats->hardWaitWakeupTimeTicks += wakeupLatency;
+        stats->spinLoopTimeTicksHardWait += spinWaitCpuCycles;
+        stats->hardWaitCount++;
+        histograms->hardWaitWakeupHistogram.Record(wakeupLatency);
     }
-    return 0;
+    else
+    {
+        stats->softWaitWakeupTimeTicks += wakeupLatency;
+        stats->spinLoopTimeTicksSoftWait += spinWaitCpuCycles;
+        stats->softWaitCount++;
+        histograms->softWaitWakeupHistogram.Record(wakeupLatency);
+    }
+    histograms->spinLoopTimeHistogram.Record(spinWaitCpuCycles);
 }
 
 /// <summary>
-/// Threads will fetch a number from the queue and start the work to find the prime number.
+/// Threads will fetch a number from the queue and run the workload on it.
 /// Once all threads are done with their respective input, it will proceed to fetch next number.
+///
+/// Instantiated for the class of joinData, so that calls to a final join class are not virtual.
 /// </summary>
 /// <param name="lpParam"></param>
 /// <returns>status</returns>
+template<typename Join>
 DWORD WINAPI ThreadWorker(LPVOID lpParam)
 {
     ThreadInput* tInput = (ThreadInput*)lpParam;
+    Join* join = static_cast<Join*>(joinData);
+
+    // The thread is already affinitized at this point, so the arena lands on its NUMA node.
+    if (tInput->statsLayout == stats_layout::arena)
+    {
+        if (!ThreadStatsArena::Allocate(&tInput->stats, &tInput->histograms))
+        {
+            printf("Failed to allocate the stats arena for thread %d.\n", tInput->threadId);
+            exit(1);
+        }
+    }
+    ThreadStats* stats = tInput->stats;
+    ThreadHistograms* histograms = tInput->histograms;
+    workload* work = create_workload(tInput->workloadKind, tInput->workloadHeapBytes, tInput->threadId, tInput->workloadTicksPerNanosecond);
+    assert(work != nullptr);
 
     // Make sure things are initialized correctly.
-    assert(tInput->hardWaitCount == 0);
-    assert(tInput->softWaitCount == 0);
-    assert(tInput->totalIterations == 0);
+    assert(stats->hardWaitCount == 0);
+    assert(stats->softWaitCount == 0);
+    assert(stats->totalIterations == 0);
     int threadId = tInput->threadId;
-    int processedCount = 0;
+
+    PerfCounters perfCounters;
+    stats->perfCountersValid = perfCounters.Open();
+
+    Interlocked::Increment(&readyThreadCount);
+    if (startGate.Wait(INFINITE, FALSE) != WAIT_OBJECT_0)
+    {
+        printf("Fatal error");
+        exit(1);
+    }
 
     for (int i = 0; i < tInput->count; i++)
     {
-        PRINT_PROGRESS("*** Processing: %u out of %u..", threadId, tInput->processed, tInput->count);
+        PRINT_PROGRESS("*** Processing: %u out of %u..", threadId, stats->processed, tInput->count);
         ulong input = tInput->input[i];
-        ulong answer = FindNextPrimeNumber(input);
-        tInput->processed++;
+        uint64_t requestedTicks = work->getRequestedTicks(input);
+        unsigned __int64 workStartTime = (requestedTicks != 0) ? GetCounter() : 0;
+        ulong answer = work->run(input);
+        if (requestedTicks != 0)
+        {
+            unsigned __int64 workTicks = GetCounter() - workStartTime;
+            stats->workTicksRequested += requestedTicks;
+            stats->workTicksTaken += workTicks;
+            unsigned __int64 workError = (workTicks > requestedTicks) ? (workTicks - requestedTicks) : (requestedTicks - workTicks);
+            stats->workTicksAbsoluteError += workError;
+            histograms->workErrorHistogram.Record(workError);
+        }
+        stats->processed++;
 
-        // So the compiler doesn't throw away answer and processedCount;
-        tInput->answer |= answer;
+        // So the compiler doesn't throw away answer;
+        stats->answer |= answer;
 
-        PRINT_ANSWER(" %u %llu= %llu", threadId, processedCount, input, answer);
+        PRINT_ANSWER(" %u %llu= %llu", threadId, stats->processed, input, answer);
 
         bool wasHardWait = false;
         unsigned __int64 spinLoopStopTime = 0;
         unsigned __int64 spinLoopStartTime = 0;
 
-        tInput->totalIterations += joinData->join(i, threadId, &wasHardWait, &spinLoopStartTime , &spinLoopStopTime);
+        stats->totalIterations += join->join(i, threadId, &wasHardWait, &spinLoopStartTime , &spinLoopStopTime);
 
         // The last thread to complete will return here and "restart()".
-        if (joinData->joined())
+        if (join->joined(threadId))
         {
-            joinData->restart(tInput->threadId, i, tInput->processed == tInput->count);
+            join->restart(tInput->threadId, i, stats->processed == tInput->count);
         }
         else
         {
             // Even though we hard-wait, we also did spin-loop. See how much time was spent in that.
             unsigned __int64 spinWaitCpuCycles = spinLoopStopTime - spinLoopStartTime;
-            
 
             // Other threads that were waiting so long, will record the latency for
             // wakeup time as soon as things are restarted.
-            if (wasHardWait)
+            unsigned __int64 wakeupLatency = join->getTicksSinceRestart(threadId);
+            RecordWait(stats, histograms, wasHardWait, spinWaitCpuCycles, wakeupLatency);
+            if (tInput->phases != nullptr)
             {
-                unsigned __int64 hardWaitWakeupLatency = joinData->getTicksSinceRestart();
-                tInput->hardWaitWakeupTimeTicks += hardWaitWakeupLatency;
-                tInput->spinLoopTimeTicksHardWait += spinWaitCpuCycles;
-                tInput->hardWaitCount++;
+                ThreadStats::PhaseStats& phase = stats->phases[tInput->phases[i]];
+                (wasHardWait ? phase.hardWaitCount : phase.softWaitCount)++;
+                phase.spinLoopTimeTicks += spinWaitCpuCycles;
+                phase.wakeupTimeTicks += wakeupLatency;
+            }
 
-                PRINT_HARD_WAIT_LATENCY("%d. %lld cycles, %llu total spin-loop cycles", threadId, i, hardWaitWakeupLatency, spinWaitCpuCycles);
+            if (wasHardWait)
+            {
+                PRINT_HARD_WAIT_LATENCY("%d. %lld cycles, %llu total spin-loop cycles", threadId, i, wakeupLatency, spinWaitCpuCycles);
             }
             else
             {
-                unsigned __int64 softWaitWakeupLatency = joinData->getTicksSinceRestart();
-                tInput->softWaitWakeupTimeTicks += softWaitWakeupLatency;
-                tInput->spinLoopTimeTicksSoftWait += spinWaitCpuCycles;
-                tInput->softWaitCount++;
-
-                PRINT_SOFT_WAIT_LATENCY("%d. %lld wake-up cycles, %llu total spin-loop cycles.", threadId, i, softWaitWakeupLatency, spinWaitCpuCycles);
+                PRINT_SOFT_WAIT_LATENCY("%d. %lld wake-up cycles, %llu total spin-loop cycles.", threadId, i, wakeupLatency, spinWaitCpuCycles);
             }
         }
     }
 
-    PRINT_PROGRESS("*** Total processed: %u out of %u..", threadId, processedCount, tInput->count);
+    join->finished(threadId);
+    perfCounters.Read(stats->perfCounters);
+    delete work;
+
+    PRINT_PROGRESS("*** Total processed: %u out of %u..", threadId, stats->processed, tInput->count);
+    return 0;
+}
+
+// Calls timed by --measure_overhead, per measurement.
+const int OVERHEAD_ITERATIONS = 100 * 1000;
+
+/// <summary>
+/// Prints what the instrumentation in ThreadWorker costs per call: reading the time
+/// stamp counter, and adding a wait to the statistics.
+/// </summary>
+void MeasureInstrumentationOverhead()
+{
+    volatile unsigned __int64 sink = 0;
+    unsigned __int64 begin = GetCounter();
+    for (int i = 0; i < OVERHEAD_ITERATIONS; i++)
+    {
+        sink = GetCounter();
+    }
+    double counterTicks = (double)(GetCounter() - begin) / OVERHEAD_ITERATIONS;
+
+    ThreadStats* stats = new ThreadStats();
+    ThreadHistograms* histograms = new ThreadHistograms();
+    begin = GetCounter();
+    for (int i = 0; i < OVERHEAD_ITERATIONS; i++)
+    {
+        // Spread over the buckets, the way real latencies are.
+        RecordWait(stats, histograms, (i & 1) != 0, (unsigned __int64)i * 7, (unsigned __int64)i * 13);
+    }
+    double recordTicks = (double)(GetCounter() - begin) / OVERHEAD_ITERATIONS;
+    delete histograms;
+    delete stats;
+    (void)sink;
+
+    PRINT_STATS("Instrumentation overhead    : GetCounter: %.1f ticks, RecordWait: %.1f ticks (per call)", counterTicks, recordTicks);
+}
+
+/// <summary>
+/// Prints what an uncontended join costs on 'probe', a join with a single thread,
+/// for which join() returns right away and restart() wakes nobody: once called
+/// through a t_join* like before, and once through the join class itself.
+/// </summary>
+template<typename Join>
+void MeasureJoinOverhead(Join* probe)
+{
+    // Read back on every iteration, so the compiler can't see through the virtual calls.
+    t_join* volatile virtualProbe = probe;
+    bool wasHardWait;
+    unsigned __int64 spinLoopStartTime, spinLoopStopTime;
+
+    unsigned __int64 begin = GetCounter();
+    for (int i = 0; i < OVERHEAD_ITERATIONS; i++)
+    {
+        t_join* join = virtualProbe;
+        join->join(i, 0, &wasHardWait, &spinLoopStartTime, &spinLoopStopTime);
+        if (join->joined(0))
+        {
+            join->restart(0, i, false);
+        }
+    }
+    double virtualTicks = (double)(GetCounter() - begin) / OVERHEAD_ITERATIONS;
+
+    begin = GetCounter();
+    for (int i = 0; i < OVERHEAD_ITERATIONS; i++)
+    {
+        probe->join(i, 0, &wasHardWait, &spinLoopStartTime, &spinLoopStopTime);
+        if (probe->joined(0))
+        {
+            probe->restart(0, i, false);
+        }
+    }
+    double directTicks = (double)(GetCounter() - begin) / OVERHEAD_ITERATIONS;
+
+    PRINT_STATS("Join overhead (uncontended) : Through t_join*: %.1f ticks, Through the join class: %.1f ticks (per join)", virtualTicks, directTicks);
+}
+
+/// <summary>
+/// Creates a 'Join' and picks the ThreadWorker instantiated for it.
+/// </summary>
+template<typename Join, typename... Args>
+t_join* CreateJoin(ThreadProc* worker, Args... args)
+{
+    *worker = ThreadWorker<Join>;
+    return new Join(args...);
+}
+
+/// <summary>
+/// Creates a t_join_composed 'Join', after timing a single-thread one for --measure_overhead.
+/// </summary>
+template<typename Join, typename... SpinArgs>
+t_join* CreateComposedJoinOn(ThreadProc* worker, bool measureOverhead, int numThreads, join_layout layout, hard_wait_kind hardWait, SpinArgs... spinArgs)
+{
+    if (measureOverhead)
+    {
+        Join probe(1, layout, hardWait, spinArgs...);
+        MeasureJoinOverhead(&probe);
+    }
+    return CreateJoin<Join>(worker, numThreads, layout, hardWait, spinArgs...);
+}
+
+/// <summary>
+/// Creates JoinType (one of the t_join_composed aliases) on the backend of 'hardWait'.
+/// Join types that never hard-wait only exist on hard_wait_backend.
+/// </summary>
+template<template<typename> class JoinType, typename... SpinArgs>
+t_join* CreateComposedJoin(ThreadProc* worker, bool measureOverhead, int numThreads, join_layout layout, hard_wait_kind hardWait, SpinArgs... spinArgs)
+{
+    if constexpr (!JoinType<hard_wait_backend>::uses_hard_wait)
+    {
+        return CreateComposedJoinOn<JoinType<hard_wait_backend>>(worker, measureOverhead, numThreads, layout, hardWait, spinArgs...);
+    }
+    else
+    {
+        switch (hardWait)
+        {
+        case hard_wait_kind::event:
+            return CreateComposedJoinOn<JoinType<hard_wait_event>>(worker, measureOverhead, numThreads, layout, hardWait, spinArgs...);
+        case hard_wait_kind::futex:
+            return CreateComposedJoinOn<JoinType<hard_wait_futex>>(worker, measureOverhead, numThreads, layout, hardWait, spinArgs...);
+#ifndef _WIN32
+        case hard_wait_kind::eventfd:
+            return CreateComposedJoinOn<JoinType<hard_wait_eventfd>>(worker, measureOverhead, numThreads, layout, hardWait, spinArgs...);
+#endif // !_WIN32
+        case hard_wait_kind::condvar:
+            return CreateComposedJoinOn<JoinType<hard_wait_condvar>>(worker, measureOverhead, numThreads, layout, hardWait, spinArgs...);
+        case hard_wait_kind::semaphore:
+            return CreateComposedJoinOn<JoinType<hard_wait_semaphore>>(worker, measureOverhead, numThreads, layout, hardWait, spinArgs...);
+        default:
+            return nullptr;
+        }
+    }
+}
+
+#ifdef _OPENMP
+/// <summary>
+/// What RunOpenMPTeam() runs.
+/// </summary>
+struct OpenMPTeam
+{
+    ThreadProc worker;
+    std::vector<ThreadInput*>* threadInputs;
+    const std::vector<int>* threadCpus;
+    bool isMultiCpuGroup;
+};
+
+/// <summary>
+/// Runs the worker on an OpenMP team with a thread per input, each pinned where the
+/// thread of the same index goes with the other join types. The team is started
+/// from a thread of its own, so the main thread's affinity is left alone.
+/// </summary>
+DWORD WINAPI RunOpenMPTeam(LPVOID lpParam)
+{
+    OpenMPTeam* team = (OpenMPTeam*)lpParam;
+    int threadCount = (int)team->threadInputs->size();
+    omp_set_dynamic(0);
+#pragma omp parallel num_threads(threadCount)
+    {
+        if (omp_get_num_threads() != threadCount)
+        {
+            printf("OpenMP started %d threads instead of %d.\n", omp_get_num_threads(), threadCount);
+            exit(1);
+        }
+        int i = omp_get_thread_num();
+        std::vector<int> cpus(1, (*team->threadCpus)[i]);
+        std::vector<ThreadHandle> handles(1, GetCurrentThreadHandle());
+        SetThreadAffinity(cpus, team->isMultiCpuGroup, handles);
+        team->worker((*team->threadInputs)[i]);
+    }
     return 0;
 }
+#endif // _OPENMP
+
+const int JOIN_TYPE_COUNT = 20;
+
+// Its workers run on an OpenMP team rather than on threads of their own.
+const int OPENMP_JOIN_TYPE = 20;
+
+// Exit code when the requested join type can't run on this processor, so scripts
+// sweeping over mixed hardware can tell it apart from a failure.
+const int EXIT_UNSUPPORTED = 2;
+
+/// <summary>
+/// Whether the processor has what 'joinType' needs; if not, 'missingFeature' is
+/// the first feature that is missing.
+/// </summary>
+bool IsJoinTypeSupported(const CpuFeatures& features, int joinType, CpuFeatures::Feature* missingFeature)
+{
+    // Every join type reads the time stamp counter with rdtscp.
+    *missingFeature = CpuFeatures::Rdtscp;
+    if (!features.Has(CpuFeatures::Rdtscp))
+    {
+        return false;
+    }
+
+    if ((joinType >= 3) && (joinType <= 6))
+    {
+        *missingFeature = CpuFeatures::MonitorX;
+    }
+    else if ((joinType >= 13) && (joinType <= 15))
+    {
+        *missingFeature = CpuFeatures::WaitPkg;
+    }
+    return features.Has(*missingFeature);
+}
+
+/// <summary>
+/// Whether 'joinType' is part of this build; if not, 'missingComponent' is what the
+/// compiler didn't provide.
+/// </summary>
+bool IsJoinTypeBuilt(int joinType, const char** missingComponent)
+{
+    *missingComponent = nullptr;
+#ifndef __cpp_lib_barrier
+    if (joinType == 18)
+    {
+        *missingComponent = "C++20 std::barrier";
+    }
+#endif // !__cpp_lib_barrier
+#ifndef _OPENMP
+    if (joinType == OPENMP_JOIN_TYPE)
+    {
+        *missingComponent = "OpenMP";
+    }
+#endif // !_OPENMP
+    return *missingComponent == nullptr;
+}
+
+/// <summary>
+/// Whether 'joinType' is a t_join_composed with a spin-loop, the join types that honor a spin budget.
+/// </summary>
+bool IsSpinLoopJoinType(int joinType)
+{
+    return ((joinType >= 1) && (joinType <= 4)) || (joinType == 13) || (joinType == 15) || (joinType == 16);
+}
+
+/// <summary>
+/// Whether 'joinType' can wake its hard-waiters before the join completes: the ones that
+/// arrive at join_lock, hard-wait through t_join::hardWait and have a soft-wait to go back to.
+/// </summary>
+bool IsEarlyWakeJoinType(int joinType)
+{
+    return (joinType == 1) || (joinType == 3) || (joinType == 5) || (joinType == 8) || ((joinType >= 13) && (joinType <= 17));
+}
+
+/// <summary>
+/// Whether 'joinType' blocks on the hard_wait backend. The others never hard-wait (2, 4, 6),
+/// hard-wait on per-thread events (10, 11), or block however their barrier does (18 to 20).
+/// </summary>
+bool UsesHardWaitBackend(int joinType)
+{
+    return (joinType != 2) && (joinType != 4) && (joinType != 6) && (joinType != 10) && (joinType != 11) && (joinType < 18);
+}
+
+/// <summary>
+/// The hard_wait a run of 'joinType' is labeled with, "n/a" if the join type doesn't use it.
+/// </summary>
+const char* GetHardWaitLabel(int joinType, hard_wait_kind hardWait)
+{
+    return UsesHardWaitBackend(joinType) ? get_hard_wait_name(hardWait) : "n/a";
+}
+
+/// <summary>
+/// Settings that differ between the runs of a comparison.
+/// </summary>
+struct RunConfig
+{
+    int joinType;
+    join_layout layout;
+    stats_layout statsLayout;
+    hard_wait_kind hardWait;
+    workload_kind workload;
+};
+
+/// <summary>
+/// Headline numbers of one run, used to compare runs that differ in a single setting.
+/// </summary>
+struct RunSummary
+{
+    ulong avgSoftWaitWakeupTime;
+    ulong avgHardWaitWakeupTime;
+    ulong p99SoftWaitWakeupTime;
+    ulong p99HardWaitWakeupTime;
+    int totalSoftWaits;
+    int totalHardWaits;
+    bool perfCountersValid;
+    double perfCountersPerJoin[PerfCounters::CounterCount];
+    long long elapsedMilliseconds;
+};
 
 class PrimeNumbers
 {
 private:
-    int PROCESSOR_COUNT = -1, PROCESSOR_GROUP_COUNT, MWAITX_CYCLES, INPUT_COUNT, COMPLEXITY, JOIN_TYPE;
+    int PROCESSOR_COUNT = -1, PROCESSOR_GROUP_COUNT, MWAITX_CYCLES = 0, INPUT_COUNT, COMPLEXITY, JOIN_TYPE;
+    bool SHOW_TOPOLOGY = false;
+    CpuTopology topology;
+    CpuFeatures cpuFeatures;
+    PauseCalibration pauseCalibration;
+    PlacementPolicy PLACEMENT = PlacementPolicy::OsOrder;
+    std::vector<int> placementCpuList;
+    std::vector<int> threadCpus;
+    int JOIN_LAYOUT = (int)join_layout::packed;
+    int STATS_LAYOUT = (int)stats_layout::arena;
+    int HARD_WAIT = (int)hard_wait_kind::event;
+    int TREE_FAN_IN = 4;
+    int RELEASE_ORDER = 1;
+    int JOIN_DOMAIN = 1;
+    int WAITPKG_CYCLES = 0;
+    int WAITPKG_STATE = 1;
+    bool MEASURE_OVERHEAD = false;
+    int BACKOFF_PAUSE_ROUNDS = 10;
+    int BACKOFF_YIELD_ROUNDS = 20;
+    int BACKOFF_SLEEP_ROUNDS = 5;
+    int BACKOFF_SLEEP_US = 50;
+    int SPIN_BUDGET_NS = 0;
+    unsigned __int64 SPIN_BUDGET_TICKS = 0;
+    int PREDICT_SPIN_NS = 20000;
+    int PREDICT_BLOCK_NS = 200000;
+    int EARLY_WAKE_THREADS = 0;
+    int EARLY_WAKE_NS = 0;
+    int WORKLOAD = (int)workload_kind::prime;
+    int WORKLOAD_HEAP_MB = 32;
+    int INPUT_MEAN = 0;
+    const char* TRACE_PATH = nullptr;
+    work_trace* trace = nullptr;
+    imbalance_config IMBALANCE = { imbalance_kind::uniform, 0.25, 1.0, 0.1, 4.0, 0.0 };
 
     void DiffWakeTime(ulong hardWaitWakeTime, ulong softWaitWakeTime, ulong* diff, char* diffCh)
     {
@@ -208,6 +688,44 @@ private:
         }
     }
 
+    void PrintPercentiles(const char* name, const LatencyHistogram* histogram)
+    {
+        PRINT_STATS("%s: p50: %s, p90: %s, p99: %s, p99.9: %s, Max: %s, Count: %s", name,
+            formatNumber((double)histogram->GetPercentile(50)), formatNumber((double)histogram->GetPercentile(90)),
+            formatNumber((double)histogram->GetPercentile(99)), formatNumber((double)histogram->GetPercentile(99.9)),
+            formatNumber((double)histogram->GetMax()), formatNumber((double)histogram->GetCount()));
+    }
+
+    /// <summary>
+    /// The waits of all threads, split by the phase of the trace their round belongs to.
+    /// </summary>
+    void PrintPhaseStats(const std::vector<ThreadInput*>& threadInputs)
+    {
+        std::vector<int> phaseRounds(trace->getPhaseCount());
+        const uint8_t* roundPhases = trace->getRoundPhases();
+        for (int round = 0; round < INPUT_COUNT; round++)
+        {
+            phaseRounds[roundPhases[round]]++;
+        }
+
+        for (int phase = 0; phase < trace->getPhaseCount(); phase++)
+        {
+            ThreadStats::PhaseStats total = {};
+            for (int i = 0; i < PROCESSOR_COUNT; i++)
+            {
+                const ThreadStats::PhaseStats& phaseStats = threadInputs[i]->stats->phases[phase];
+                total.hardWaitCount += phaseStats.hardWaitCount;
+                total.softWaitCount += phaseStats.softWaitCount;
+                total.spinLoopTimeTicks += phaseStats.spinLoopTimeTicks;
+                total.wakeupTimeTicks += phaseStats.wakeupTimeTicks;
+            }
+            int waits = total.hardWaitCount + total.softWaitCount;
+            PRINT_STATS("Phase %-22s: Rounds: %s, HardWait: %s, SoftWait: %s, AvgSpinWasteTime: %s, Avg Wakeup latency: %s", trace->getPhaseName(phase),
+                formatNumber(phaseRounds[phase]), formatNumber(total.hardWaitCount), formatNumber(total.softWaitCount),
+                formatNumber((waits == 0) ? 0 : (double)total.spinLoopTimeTicks / waits), formatNumber((waits == 0) ? 0 : (double)total.wakeupTimeTicks / waits));
+        }
+    }
+
     void parseArgs(int argc, char** argv)
     {
 #define ARGS(argumentName)                  \
@@ -219,7 +737,7 @@ private:
         {                                                           \
             if (paramName##_used)                                   \
             {                                                       \
-                printf("--" # paramName ## "already specified.\n"); \
+                printf("--" #paramName " already specified.\n");  \
                 PrintUsageAndExit();                                \
             }                                                       \
             paramName = atoi(parameterValue);                       \
@@ -227,11 +745,59 @@ private:
             continue;                                               \
         }
 
+#define ARGS_STRING(argumentName)           \
+    const char* argumentName = nullptr;     \
+    bool argumentName##_used = false;
+
+#define VALIDATE_AND_SET_STRING(paramName)                          \
+        if (_strcmpi(parameterName,"--" # paramName) == 0)          \
+        {                                                           \
+            if (paramName##_used)                                   \
+            {                                                       \
+                printf("--" #paramName " already specified.\n");    \
+                PrintUsageAndExit();                                \
+            }                                                       \
+            paramName = parameterValue;                             \
+            paramName##_used = true;                                \
+            continue;                                               \
+        }
+
         ARGS(input_count);
         ARGS(complexity);
         ARGS(thread_count);
         ARGS(mwaitx_cycle_count);
         ARGS(join_type);
+        ARGS(show_topology);
+        ARGS_STRING(placement);
+        ARGS_STRING(trace);
+        ARGS(join_layout);
+        ARGS(stats_layout);
+        ARGS(hard_wait);
+        ARGS(tree_fan_in);
+        ARGS(release_order);
+        ARGS(join_domain);
+        ARGS(waitpkg_cycle_count);
+        ARGS(waitpkg_state);
+        ARGS(measure_overhead);
+        ARGS(backoff_pause_rounds);
+        ARGS(backoff_yield_rounds);
+        ARGS(backoff_sleep_rounds);
+        ARGS(backoff_sleep_us);
+        ARGS(spin_budget_ns);
+        ARGS(spin_budget_ticks);
+        ARGS(predict_spin_ns);
+        ARGS(predict_block_ns);
+        ARGS(early_wake_threads);
+        ARGS(early_wake_ns);
+        ARGS(workload);
+        ARGS(workload_heap_mb);
+        ARGS(input_mean);
+        ARGS(imbalance);
+        ARGS(imbalance_cv_pct);
+        ARGS(zipf_exponent_pct);
+        ARGS(bimodal_slow_pct);
+        ARGS(straggler_factor);
+        ARGS(imbalance_correlation_pct);
 
         if (argc == 1)
         {
@@ -258,6 +824,37 @@ private:
             VALIDATE_AND_SET(thread_count);
             VALIDATE_AND_SET(join_type);
             VALIDATE_AND_SET(mwaitx_cycle_count);
+            VALIDATE_AND_SET(show_topology);
+            VALIDATE_AND_SET_STRING(placement);
+            VALIDATE_AND_SET_STRING(trace);
+            VALIDATE_AND_SET(join_layout);
+            VALIDATE_AND_SET(stats_layout);
+            VALIDATE_AND_SET(hard_wait);
+            VALIDATE_AND_SET(tree_fan_in);
+            VALIDATE_AND_SET(release_order);
+            VALIDATE_AND_SET(join_domain);
+            VALIDATE_AND_SET(waitpkg_cycle_count);
+            VALIDATE_AND_SET(waitpkg_state);
+            VALIDATE_AND_SET(measure_overhead);
+            VALIDATE_AND_SET(backoff_pause_rounds);
+            VALIDATE_AND_SET(backoff_yield_rounds);
+            VALIDATE_AND_SET(backoff_sleep_rounds);
+            VALIDATE_AND_SET(backoff_sleep_us);
+            VALIDATE_AND_SET(spin_budget_ns);
+            VALIDATE_AND_SET(spin_budget_ticks);
+            VALIDATE_AND_SET(predict_spin_ns);
+            VALIDATE_AND_SET(predict_block_ns);
+            VALIDATE_AND_SET(early_wake_threads);
+            VALIDATE_AND_SET(early_wake_ns);
+            VALIDATE_AND_SET(workload);
+            VALIDATE_AND_SET(workload_heap_mb);
+            VALIDATE_AND_SET(input_mean);
+            VALIDATE_AND_SET(imbalance);
+            VALIDATE_AND_SET(imbalance_cv_pct);
+            VALIDATE_AND_SET(zipf_exponent_pct);
+            VALIDATE_AND_SET(bimodal_slow_pct);
+            VALIDATE_AND_SET(straggler_factor);
+            VALIDATE_AND_SET(imbalance_correlation_pct);
 
             printf("Unknown parameter: '%s'\n", parameterName);
             PrintUsageAndExit();
@@ -266,7 +863,23 @@ private:
         complexity %= 32;
 
         // Verifications
-        if (!input_count_used || !complexity_used)
+        if (trace_used)
+        {
+            // The trace has the inputs, and how many there are.
+            if (input_count_used && (input_count <= 0))
+            {
+                printf("Invalid value '%d' for '--input_count'. Should be > 0.\n", input_count);
+                PrintUsageAndExit();
+            }
+            if (complexity_used || imbalance_used || input_mean_used)
+            {
+                printf("Warning: '--complexity', '--imbalance' and '--input_mean' are ignored with '--trace'.\n");
+            }
+            TRACE_PATH = trace;
+            INPUT_COUNT = input_count_used ? input_count : 0;
+            COMPLEXITY = 0;
+        }
+        else if (!input_count_used || !complexity_used)
         {
             printf("Missing mandatory arguments.\n");
             PrintUsageAndExit();
@@ -292,9 +905,9 @@ private:
 
         if (join_type_used)
         {
-            if ((join_type < 1) || (join_type > 7))
+            if ((join_type < 0) || (join_type > JOIN_TYPE_COUNT))
             {
-                printf("Invalid value '%d' for '--join_type'. Should be between 1 and 7.\n", join_type);
+                printf("Invalid value '%d' for '--join_type'. Should be between 0 and %d.\n", join_type, JOIN_TYPE_COUNT);
                 PrintUsageAndExit();
             }
             else
@@ -309,7 +922,7 @@ private:
 
         if (mwaitx_cycle_count_used)
         {
-            if ((join_type < 3) || (join_type > 6))
+            if ((JOIN_TYPE != 0) && ((JOIN_TYPE < 3) || (JOIN_TYPE > 6)))
             {
                 printf("Warning: '--mwaitx_cycle_count' is specified, but value will not be used for 'pause' wait type.\n");
             }
@@ -320,24 +933,378 @@ private:
         }
         else
         {
-            if ((join_type >= 3) && (join_type <= 6))
+            if ((JOIN_TYPE >= 3) && (JOIN_TYPE <= 6))
             {
                 printf("Warning: '--mwaitx_cycle_count' is needed when join_type is related to mwaitx.\n");
                 PrintUsageAndExit();
             }
         }
-    }
 
-    void PrintUsageAndExit()
-    {
-        printf("\nUsage: PrimeNumbers.exe --input_count <numPrimeNumbers> --complexity <complexity> [options]\n");
-        printf("<numPrimeNumbers>: Number of prime numbers per thread.\n");
-        printf("<complexity>: Number between 0~31.\n");
-        printf("\n");
-        printf("Options:\n");
-        printf("--thread_count <N>: Number of threads to use. By default it will use number of cores available in all groups.\n");
+        if (hard_wait_used)
+        {
+            if ((hard_wait < 0) || (hard_wait > HARD_WAIT_KIND_COUNT))
+            {
+                printf("Invalid value '%d' for '--hard_wait'. Should be between 0 and %d.\n", hard_wait, HARD_WAIT_KIND_COUNT);
+                PrintUsageAndExit();
+            }
+            if ((hard_wait != 0) && !is_hard_wait_supported((hard_wait_kind)hard_wait))
+            {
+                printf("'--hard_wait %d' (%s) is not supported on this platform.\n", hard_wait, get_hard_wait_name((hard_wait_kind)hard_wait));
+                exit(EXIT_UNSUPPORTED);
+            }
+            if (!UsesHardWaitBackend(JOIN_TYPE))
+            {
+                printf("Warning: '--hard_wait' is specified, but join_type %d does not use it.\n", JOIN_TYPE);
+            }
+            HARD_WAIT = hard_wait;
+        }
+
+        if (workload_used)
+        {
+            if ((workload < 0) || (workload > WORKLOAD_KIND_COUNT))
+            {
+                printf("Invalid value '%d' for '--workload'. Should be between 0 and %d.\n", workload, WORKLOAD_KIND_COUNT);
+                PrintUsageAndExit();
+            }
+            WORKLOAD = workload;
+            if (trace_used && (WORKLOAD != (int)workload_kind::busy_ns))
+            {
+                printf("Warning: the durations of '--trace' are nanoseconds, but workload %s reads them as its own unit.\n", get_workload_name((workload_kind)WORKLOAD));
+            }
+        }
+        else if (trace_used)
+        {
+            WORKLOAD = (int)workload_kind::busy_ns;
+        }
+
+        if (workload_heap_mb_used)
+        {
+            if (workload_heap_mb <= 0)
+            {
+                printf("Invalid value '%d' for '--workload_heap_mb'. Should be > 0.\n", workload_heap_mb);
+                PrintUsageAndExit();
+            }
+            if ((WORKLOAD == (int)workload_kind::prime) || (WORKLOAD == (int)workload_kind::busy_ns) || (WORKLOAD == (int)workload_kind::busy_ticks))
+            {
+                printf("Warning: '--workload_heap_mb' is specified, but the %s workload has no heap.\n", get_workload_name((workload_kind)WORKLOAD));
+            }
+            WORKLOAD_HEAP_MB = workload_heap_mb;
+        }
+
+        if (tree_fan_in_used)
+        {
+            if ((JOIN_TYPE != 0) && (JOIN_TYPE != 9))
+            {
+                printf("Warning: '--tree_fan_in' is specified, but value is only used by join_type 9.\n");
+            }
+            if (tree_fan_in < 2)
+            {
+                printf("Invalid value '%d' for '--tree_fan_in'. Should be >= 2.\n", tree_fan_in);
+                PrintUsageAndExit();
+            }
+            TREE_FAN_IN = tree_fan_in;
+        }
+
+        if (release_order_used)
+        {
+            if ((JOIN_TYPE != 0) && (JOIN_TYPE != 11))
+            {
+                printf("Warning: '--release_order' is specified, but value is only used by join_type 11.\n");
+            }
+            if ((release_order < 1) || (release_order > 2))
+            {
+                printf("Invalid value '%d' for '--release_order'. Should be 1 or 2.\n", release_order);
+                PrintUsageAndExit();
+            }
+            RELEASE_ORDER = release_order;
+        }
+
+        if (join_domain_used)
+        {
+            if ((JOIN_TYPE != 0) && (JOIN_TYPE != 12))
+            {
+                printf("Warning: '--join_domain' is specified, but value is only used by join_type 12.\n");
+            }
+            if ((join_domain < 1) || (join_domain > 2))
+            {
+                printf("Invalid value '%d' for '--join_domain'. Should be 1 or 2.\n", join_domain);
+                PrintUsageAndExit();
+            }
+            JOIN_DOMAIN = join_domain;
+        }
+
+        bool isWaitPkgJoin = (JOIN_TYPE >= 13) && (JOIN_TYPE <= 15);
+        if (waitpkg_cycle_count_used)
+        {
+            if (!isWaitPkgJoin && (JOIN_TYPE != 0))
+            {
+                printf("Warning: '--waitpkg_cycle_count' is specified, but value is only used by join_type 13 to 15.\n");
+            }
+            if (waitpkg_cycle_count <= 0)
+            {
+                printf("Invalid value '%d' for '--waitpkg_cycle_count'. Should be > 0.\n", waitpkg_cycle_count);
+                PrintUsageAndExit();
+            }
+            WAITPKG_CYCLES = waitpkg_cycle_count;
+        }
+        else if (isWaitPkgJoin)
+        {
+            printf("Warning: '--waitpkg_cycle_count' is needed when join_type is related to umwait/tpause.\n");
+            PrintUsageAndExit();
+        }
+
+        if (waitpkg_state_used)
+        {
+            if (!isWaitPkgJoin && (JOIN_TYPE != 0))
+            {
+                printf("Warning: '--waitpkg_state' is specified, but value is only used by join_type 13 to 15.\n");
+            }
+            if ((waitpkg_state < 1) || (waitpkg_state > 2))
+            {
+                printf("Invalid value '%d' for '--waitpkg_state'. Should be 1 or 2.\n", waitpkg_state);
+                PrintUsageAndExit();
+            }
+            WAITPKG_STATE = waitpkg_state;
+        }
+
+        // A round count of 0 skips that tier.
+        auto setBackoffArg = [this](const char* name, bool used, int value, int minValue, int* setting)
+        {
+            if (!used)
+            {
+                return;
+            }
+            if ((JOIN_TYPE != 0) && (JOIN_TYPE != 16))
+            {
+                printf("Warning: '--%s' is specified, but value is only used by join_type 16.\n", name);
+            }
+            if (value < minValue)
+            {
+                printf("Invalid value '%d' for '--%s'. Should be >= %d.\n", value, name, minValue);
+                PrintUsageAndExit();
+            }
+            *setting = value;
+        };
+        setBackoffArg("backoff_pause_rounds", backoff_pause_rounds_used, backoff_pause_rounds, 0, &BACKOFF_PAUSE_ROUNDS);
+        setBackoffArg("backoff_yield_rounds", backoff_yield_rounds_used, backoff_yield_rounds, 0, &BACKOFF_YIELD_ROUNDS);
+        setBackoffArg("backoff_sleep_rounds", backoff_sleep_rounds_used, backoff_sleep_rounds, 0, &BACKOFF_SLEEP_ROUNDS);
+        setBackoffArg("backoff_sleep_us", backoff_sleep_us_used, backoff_sleep_us, 1, &BACKOFF_SLEEP_US);
+
+        if (spin_budget_ns_used || spin_budget_ticks_used)
+        {
+            const char* name = spin_budget_ns_used ? "spin_budget_ns" : "spin_budget_ticks";
+            int value = spin_budget_ns_used ? spin_budget_ns : spin_budget_ticks;
+            if (spin_budget_ns_used && spin_budget_ticks_used)
+            {
+                printf("Only one of '--spin_budget_ns' and '--spin_budget_ticks' can be specified.\n");
+                PrintUsageAndExit();
+            }
+            if (value <= 0)
+            {
+                printf("Invalid value '%d' for '--%s'. Should be > 0.\n", value, name);
+                PrintUsageAndExit();
+            }
+            if ((JOIN_TYPE != 0) && !IsSpinLoopJoinType(JOIN_TYPE))
+            {
+                printf("Warning: '--%s' is specified, but join_type %d does not use it.\n", name, JOIN_TYPE);
+            }
+            SPIN_BUDGET_NS = spin_budget_ns_used ? spin_budget_ns : 0;
+            SPIN_BUDGET_TICKS = spin_budget_ticks_used ? (unsigned __int64)spin_budget_ticks : 0;
+        }
+
+        auto setPredictArg = [this](const char* name, bool used, int value, int* setting)
+        {
+            if (!used)
+            {
+                return;
+            }
+            if ((JOIN_TYPE != 0) && (JOIN_TYPE != 17))
+            {
+                printf("Warning: '--%s' is specified, but value is only used by join_type 17.\n", name);
+            }
+            if (value <= 0)
+            {
+                printf("Invalid value '%d' for '--%s'. Should be > 0.\n", value, name);
+                PrintUsageAndExit();
+            }
+            *setting = value;
+        };
+        setPredictArg("predict_spin_ns", predict_spin_ns_used, predict_spin_ns, &PREDICT_SPIN_NS);
+        setPredictArg("predict_block_ns", predict_block_ns_used, predict_block_ns, &PREDICT_BLOCK_NS);
+        setPredictArg("early_wake_ns", early_wake_ns_used, early_wake_ns, &EARLY_WAKE_NS);
+        if (PREDICT_SPIN_NS > PREDICT_BLOCK_NS)
+        {
+            printf("'--predict_spin_ns' (%d) can't be greater than '--predict_block_ns' (%d).\n", PREDICT_SPIN_NS, PREDICT_BLOCK_NS);
+            PrintUsageAndExit();
+        }
+
+        if (early_wake_threads_used)
+        {
+            if (early_wake_threads <= 0)
+            {
+                printf("Invalid value '%d' for '--early_wake_threads'. Should be > 0.\n", early_wake_threads);
+                PrintUsageAndExit();
+            }
+            if ((JOIN_TYPE != 0) && !IsEarlyWakeJoinType(JOIN_TYPE))
+            {
+                printf("Warning: '--early_wake_threads' is specified, but join_type %d does not use it.\n", JOIN_TYPE);
+            }
+            EARLY_WAKE_THREADS = early_wake_threads;
+        }
+
+        if (input_mean_used)
+        {
+            if (input_mean <= 0)
+            {
+                printf("Invalid value '%d' for '--input_mean'. Should be > 0.\n", input_mean);
+                PrintUsageAndExit();
+            }
+            if ((COMPLEXITY == 0) && !trace_used)
+            {
+                printf("Warning: '--input_mean' is specified, but complexity 0 generates identical inputs.\n");
+            }
+            INPUT_MEAN = input_mean;
+        }
+
+        if (imbalance_used)
+        {
+            if ((imbalance <= 0) || (imbalance > IMBALANCE_KIND_COUNT))
+            {
+                printf("Invalid value '%d' for '--imbalance'. Should be between 1 and %d.\n", imbalance, IMBALANCE_KIND_COUNT);
+                PrintUsageAndExit();
+            }
+            if ((COMPLEXITY == 0) && !trace_used)
+            {
+                printf("Warning: '--imbalance' is specified, but complexity 0 generates identical inputs.\n");
+            }
+            IMBALANCE.kind = (imbalance_kind)imbalance;
+        }
+
+        auto setImbalanceArg = [this](const char* name, bool used, int value, int minValue, int maxValue, bool isUsed, double scale, double* setting)
+        {
+            if (!used)
+            {
+                return;
+            }
+            if (!isUsed)
+            {
+                printf("Warning: '--%s' is specified, but imbalance %s does not use it.\n", name, get_imbalance_name(IMBALANCE.kind));
+            }
+            if ((value < minValue) || (value > maxValue))
+            {
+                printf("Invalid value '%d' for '--%s'. Should be between %d and %d.\n", value, name, minValue, maxValue);
+                PrintUsageAndExit();
+            }
+            *setting = value * scale;
+        };
+        imbalance_kind kind = IMBALANCE.kind;
+        setImbalanceArg("imbalance_cv_pct", imbalance_cv_pct_used, imbalance_cv_pct, 1, 1000,
+            (kind == imbalance_kind::normal) || (kind == imbalance_kind::lognormal), 0.01, &IMBALANCE.cv);
+        setImbalanceArg("zipf_exponent_pct", zipf_exponent_pct_used, zipf_exponent_pct, 1, 1000,
+            kind == imbalance_kind::zipf, 0.01, &IMBALANCE.zipfExponent);
+        setImbalanceArg("bimodal_slow_pct", bimodal_slow_pct_used, bimodal_slow_pct, 1, 99,
+            kind == imbalance_kind::bimodal, 0.01, &IMBALANCE.slowFraction);
+        setImbalanceArg("straggler_factor", straggler_factor_used, straggler_factor, 1, 1000,
+            (kind == imbalance_kind::bimodal) || (kind == imbalance_kind::straggler), 1, &IMBALANCE.stragglerFactor);
+        setImbalanceArg("imbalance_correlation_pct", imbalance_correlation_pct_used, imbalance_correlation_pct, 0, 100,
+            true, 0.01, &IMBALANCE.correlation);
+
+        SHOW_TOPOLOGY = show_topology_used && (show_topology != 0);
+        MEASURE_OVERHEAD = measure_overhead_used && (measure_overhead != 0);
+
+        if (join_layout_used)
+        {
+            if ((join_layout < 0) || (join_layout > JOIN_LAYOUT_COUNT))
+            {
+                printf("Invalid value '%d' for '--join_layout'. Should be between 0 and %d.\n", join_layout, JOIN_LAYOUT_COUNT);
+                PrintUsageAndExit();
+            }
+            JOIN_LAYOUT = join_layout;
+        }
+
+        if (stats_layout_used)
+        {
+            if ((stats_layout < 0) || (stats_layout > STATS_LAYOUT_COUNT))
+            {
+                printf("Invalid value '%d' for '--stats_layout'. Should be between 0 and %d.\n", stats_layout, STATS_LAYOUT_COUNT);
+                PrintUsageAndExit();
+            }
+            STATS_LAYOUT = stats_layout;
+        }
+
+        if (placement_used)
+        {
+            if (!ParsePlacementPolicy(placement, &PLACEMENT, placementCpuList))
+            {
+                printf("Invalid value '%s' for '--placement'.\n", placement);
+                PrintUsageAndExit();
+            }
+        }
+    }
+
+    void PrintUsageAndExit()
+    {
+        printf("\nUsage: PrimeNumbers.exe --input_count <numPrimeNumbers> --complexity <complexity> [options]\n");
+        printf("<numPrimeNumbers>: Number of prime numbers per thread.\n");
+        printf("<complexity>: Number between 0~31.\n");
+        printf("\n");
+        printf("Options:\n");
+        printf("--thread_count <N>: Number of threads to use. By default it will use number of cores available in all groups.\n");
         printf("--mwaitx_cycle_count <N>: If specified, the number of cycles to pass in mwaitx().\n");
+        printf("--show_topology <0|1>: If 1, print the package/NUMA node/L3/core tree that was discovered.\n");
+        printf("--placement <policy>: How threads are pinned to processors. By default thread 'i' goes to processor 'i'.\n");
+        printf("  os       = Processors in OS numbering (default)\n");
+        printf("  compact  = Fill SMT siblings of a core, then the next core in the same L3, node, package\n");
+        printf("  scatter  = Spread across packages, NUMA nodes, L3 domains and cores; SMT siblings last\n");
+        printf("  core     = One thread per physical core\n");
+        printf("  l3       = One thread per L3 (CCX) domain\n");
+        printf("  numa     = Round-robin across NUMA nodes\n");
+        printf("  cpulist:<list> = Explicit processors, e.g. 'cpulist:0-3,8'\n");
+        printf("  'core', 'l3' and 'cpulist' default --thread_count to the number of processors they select.\n");
+        printf("--join_layout <N>: How the join_structure fields are spread over cache lines.\n");
+        printf("  0= Run once with every layout below and print a comparison\n");
+        printf("  1= All fields on one line [packed] (default)\n");
+        printf("  2= join_lock on its own line [split_counter]\n");
+        printf("  3= lock_color and join_lock each alone on a line [isolated_color]\n");
+        printf("  4= Every field written during a join on its own line [padded]\n");
+        printf("--stats_layout <N>: Where each thread's statistics live.\n");
+        printf("  0= Run once with every layout below and print how wakeup latencies change\n");
+        printf("  1= Allocated back to back by the main thread, neighbouring threads share cache lines [shared]\n");
+        printf("  2= Per-thread arena, cache-line aligned and allocated on the thread's NUMA node [arena] (default)\n");
+        printf("--hard_wait <N>: What threads block on after they gave up spinning. Not used by join_type 2, 4, 6 (no hard-wait), 10 and 11 (per-thread events), 18 to 20 (native barriers).\n");
+        printf("  0= Run once with every kind below and print a comparison\n");
+        printf("  1= Manual-reset events, one per color [event] (default)\n");
+        printf("  2= futex (WaitOnAddress on Windows) on lock_color [futex]\n");
+        printf("  3= eventfd in semaphore mode, Linux only [eventfd]\n");
+        printf("  4= Condition variable [condvar]\n");
+        printf("  5= Counting semaphore [semaphore]\n");
+        printf("--workload <N>: What threads compute between two joins. The input of a round is the amount of work, in the unit below.\n");
+        printf("  0= Run once with every workload below and print a comparison\n");
+        printf("  1= Smallest prime greater than the input, by trial division: ALU bound [prime] (default)\n");
+        printf("  2= Mark that many 64-byte objects of a random object graph: pointer chasing, latency bound [graph_mark]\n");
+        printf("  3= Relocate that many live 256-byte objects with memcpy: read and write bandwidth bound [compact]\n");
+        printf("  4= Count the live bits of that many KB of a bitmap: streaming, read bandwidth bound [bitmap_sweep]\n");
+        printf("  5= Compute for that many nanoseconds, calibrated per core [busy_ns]\n");
+        printf("  6= Compute for that many TSC ticks, calibrated per core [busy_ticks]\n");
+        printf("--workload_heap_mb <N>: Heap per thread of workload 2 to 4, default 32. Caps the work of a round.\n");
+        printf("--trace <path>: Replay the per-round, per-thread durations in nanoseconds recorded in this file, with workload 5,\n");
+        printf("  instead of generating inputs. One round per line, optionally labeled 'phase:'. '--input_count' limits the rounds,\n");
+        printf("  '--complexity' is not needed. Thread i replays column i modulo the columns of the trace.\n");
+        printf("--input_mean <N>: Mean input, in the unit of the workload. Default (100 + 2^complexity) / 2.\n");
+        printf("--imbalance <N>: How the cost of a round is spread over the threads, around the mean input.\n");
+        printf("  1= Uniform between 0 and twice the mean [uniform] (default)\n");
+        printf("  2= Normal around the mean, cut off at 0 [normal]\n");
+        printf("  3= Log-normal with the same mean, heavy-tailed [lognormal]\n");
+        printf("  4= Every round, the threads get the ranks 1..N in random order and rank k costs k^-s [zipf]\n");
+        printf("  5= Threads cost the mean, or straggler_factor times as much [bimodal]\n");
+        printf("  6= Every round, one thread costs straggler_factor times as much as the others [straggler]\n");
+        printf("--imbalance_cv_pct <N>: Standard deviation of imbalance 2 and 3, in percent of the mean. Default 25.\n");
+        printf("--zipf_exponent_pct <N>: Exponent 's' of imbalance 4, in percent. Default 100.\n");
+        printf("--bimodal_slow_pct <N>: Percent of the threads that are slow with imbalance 5. Default 10.\n");
+        printf("--straggler_factor <N>: How many times slower the slow threads of imbalance 5 and 6 are. Default 4.\n");
+        printf("--imbalance_correlation_pct <N>: Chance, in percent, that a thread costs the same as in the previous round. For imbalance 4 and 6 the whole round repeats. Default 0.\n");
         printf("--join_type <N>\n");
+        printf("  0= Run every join type this processor supports and print a comparison\n");
         printf("  1= The current GC implementation [t_join_pause]\n");
         printf("  2= Use 'pause', only use in spin-loop, no hard-wait [t_join_pause_soft_wait_only]\n");
         printf("  3= Use 'mwaitx', use inside spin-loop [t_join_mwaitx_loop]\n");
@@ -345,6 +1312,47 @@ private:
         printf("  5= Use 'mwaitx', no spin-loop involved [t_join_mwaitx_noloop]\n");
         printf("  6= Use 'mwaitx', no spin-loop involved, no hard-wait [t_join_mwaitx_noloop_soft_wait_only]\n");
         printf("  7= Only hard-wait. [t_join_hard_wait_only]\n");
+        printf("  8= Use 'pause' with a per-thread spin count that adapts to recent joins [t_join_pause_adaptive]\n");
+        printf("  9= Use 'pause', arrive and release through a combining tree [t_join_combining_tree]\n");
+        printf(" 10= Use 'pause', dissemination barrier without a shared counter or a releasing thread [t_join_dissemination]\n");
+        printf(" 11= Use 'pause', every waiter spins on its own flag, written one by one on restart [t_join_local_spin]\n");
+        printf(" 12= Use 'pause', join within each L3/NUMA domain first, then one leader per domain joins globally [t_join_two_level]\n");
+        printf(" 13= Use 'umwait', use inside spin-loop [t_join_umwait_loop]\n");
+        printf(" 14= Use 'umwait', no spin-loop involved [t_join_umwait_noloop]\n");
+        printf(" 15= Use 'tpause' instead of 'pause' inside spin-loop [t_join_tpause_loop]\n");
+        printf(" 16= Back off from doubling 'pause' batches to yielding the processor to sleeping, then hard-wait [t_join_backoff]\n");
+        printf(" 17= Use 'pause', spin, spin briefly or hard-wait at once depending on how long the round's straggler is predicted to take [t_join_predictive]\n");
+        printf(" 18= C++20 std::barrier [t_join_std_barrier]\n");
+        printf(" 19= pthread_barrier_t, SYNCHRONIZATION_BARRIER on Windows [t_join_pthread_barrier]\n");
+        printf(" 20= '#pragma omp barrier', with the workers on an OpenMP team [t_join_omp_barrier]\n");
+        printf("  18 to 20 count a wait as hard-wait when the thread blocked (always soft-wait on Windows), and report no spin iterations.\n");
+        printf("--tree_fan_in <N>: Number of arrivals per node of the combining tree used by join_type 9 (default 4).\n");
+        printf("--release_order <N>: Order in which join_type 11 releases the waiters.\n");
+        printf("  1= Thread order (default)\n");
+        printf("  2= Nearest first: same core, same L3, same NUMA node, same package, then the rest\n");
+        printf("--join_domain <N>: Domains of the first level of join_type 12.\n");
+        printf("  1= L3 (default)\n");
+        printf("  2= NUMA node\n");
+        printf("--waitpkg_cycle_count <N>: TSC ticks each umwait/tpause waits at most. Needed by join_type 13 to 15.\n");
+        printf("--waitpkg_state <N>: Optimized state umwait/tpause wait in.\n");
+        printf("  1= C0.1, faster wakeup (default)\n");
+        printf("  2= C0.2, lower power\n");
+        printf("--backoff_pause_rounds <N>: Iterations of join_type 16 that pause 1, 2, 4... times (at most %d), default 10.\n", 1 << backoff_spin::MAX_PAUSE_SHIFT);
+        printf("--backoff_yield_rounds <N>: Iterations of join_type 16 that yield the processor after those, default 20.\n");
+        printf("--backoff_sleep_rounds <N>: Iterations of join_type 16 that sleep after those, default 5.\n");
+        printf("--backoff_sleep_us <N>: Microseconds each of those sleeps, default 50. Rounded up to milliseconds on Windows.\n");
+        printf("--spin_budget_ns <N>: Spin for N nanoseconds instead of SPIN_COUNT iterations before hard-wait, timed with the TSC.\n");
+        printf("  Used by join_type 1 to 4, 13, 15 and 16.\n");
+        printf("--spin_budget_ticks <N>: Same, in TSC ticks.\n");
+        printf("--predict_spin_ns <N>: Waits join_type 17 predicts to be at most N nanoseconds spin up to SPIN_COUNT iterations, default 20000.\n");
+        printf("  Longer ones spin this long, then hard-wait.\n");
+        printf("--predict_block_ns <N>: Waits join_type 17 predicts to be longer than N nanoseconds hard-wait at once, default 200000.\n");
+        printf("--early_wake_threads <N>: Wake the hard-waiters when only N threads are still running, so they spin again by the\n");
+        printf("  time the join completes. Used by join_type 1, 3, 5, 8 and 13 to 17. Never with N >= --thread_count.\n");
+        printf("--early_wake_ns <N>: Wake the hard-waiters of join_type 17 once a thread arrives that predicts the last one\n");
+        printf("  within N nanoseconds.\n");
+        printf("--measure_overhead <0|1>: If 1, print what the instrumentation costs per call, and for join_type 1 to 7 and 13 to 16\n");
+        printf("  what an uncontended join costs through a t_join* and through the join class, before every run.\n");
         exit(1);
     }
 
@@ -354,14 +1362,234 @@ public:
     {
         parseArgs(argc, argv);
 
+        cpuFeatures.Detect();
+        cpuFeatures.PrintSummary();
+        pauseCalibration.Calibrate(cpuFeatures);
+        pauseCalibration.PrintSummary(SPIN_COUNT);
+        if (SPIN_BUDGET_NS != 0)
+        {
+            SPIN_BUDGET_TICKS = pauseCalibration.NanosecondsToTicks((uint64_t)SPIN_BUDGET_NS);
+        }
+        if (SPIN_BUDGET_TICKS != 0)
+        {
+            printf("Spin budget: %llu ticks (%.1f us, about %.0f pauses).\n", (unsigned long long)SPIN_BUDGET_TICKS,
+                pauseCalibration.TicksToNanoseconds((double)SPIN_BUDGET_TICKS) / 1000, (double)SPIN_BUDGET_TICKS / pauseCalibration.GetPauseTicks());
+        }
+        CpuFeatures::Feature missingFeature;
+        if ((JOIN_TYPE != 0) && !IsJoinTypeSupported(cpuFeatures, JOIN_TYPE, &missingFeature))
+        {
+            printf("join_type %d needs %s, which this processor does not support.\n", JOIN_TYPE, CpuFeatures::GetName(missingFeature));
+            exit(EXIT_UNSUPPORTED);
+        }
+        const char* missingComponent;
+        if ((JOIN_TYPE != 0) && !IsJoinTypeBuilt(JOIN_TYPE, &missingComponent))
+        {
+            printf("join_type %d needs %s, which this build does not include.\n", JOIN_TYPE, missingComponent);
+            exit(EXIT_UNSUPPORTED);
+        }
+
         int userInput_processor_count = PROCESSOR_COUNT;
-        GetProcessorInfo(&PROCESSOR_COUNT, &PROCESSOR_GROUP_COUNT);
+        if (!topology.Discover())
+        {
+            printf("Warning: failed to discover the processor topology, assuming a single processor.\n");
+        }
+        PROCESSOR_GROUP_COUNT = topology.GetGroupCount();
+
+        if (SHOW_TOPOLOGY)
+        {
+            topology.Print();
+        }
+        else
+        {
+            topology.PrintSummary();
+        }
+
+        for (int cpu : placementCpuList)
+        {
+            if (topology.FindCpu(cpu) == nullptr)
+            {
+                printf("Processor %d in '--placement' is not available to this process.\n", cpu);
+                exit(1);
+            }
+        }
+
+        std::vector<int> placementCpus = GetPlacementCpus(topology, PLACEMENT, placementCpuList);
+        PROCESSOR_COUNT = (int)placementCpus.size();
         if (userInput_processor_count != -1)
         {
+            if ((userInput_processor_count > PROCESSOR_COUNT) && !PlacementAllowsOversubscription(PLACEMENT))
+            {
+                printf("'--placement %s' selects %d processor(s), but '--thread_count' is %d.\n", GetPlacementPolicyName(PLACEMENT), PROCESSOR_COUNT, userInput_processor_count);
+                exit(1);
+            }
             PROCESSOR_COUNT = userInput_processor_count;
         }
 
-        PRINT_STATS("Running: SPIN_COUNT= %d, numbers= %d, complexity= %d, JOIN_TYPE= %d, threads= %d", SPIN_COUNT, INPUT_COUNT, COMPLEXITY, JOIN_TYPE, PROCESSOR_COUNT);
+        // Thread 'i' goes to the 'i'th placement slot, wrapping around if there are more
+        // threads than processors.
+        threadCpus.resize(PROCESSOR_COUNT);
+        for (int i = 0; i < PROCESSOR_COUNT; i++)
+        {
+            threadCpus[i] = placementCpus[i % placementCpus.size()];
+        }
+        PrintPlacement(topology, PLACEMENT, threadCpus);
+
+        if (TRACE_PATH != nullptr)
+        {
+            trace = new work_trace();
+            trace->load(TRACE_PATH, INPUT_COUNT);
+            INPUT_COUNT = trace->getRoundCount();
+            printf("Trace: %s, %d rounds of %d threads, %d phases, slowest thread over average, per round: %.2f.\n", TRACE_PATH,
+                trace->getRoundCount(), trace->getColumnCount(), trace->getPhaseCount(),
+                imbalance_generator::getAverageMaxOverMean(trace->getColumnCount(), trace->getRoundCount(), trace->getAllDurations()));
+            if (trace->getColumnCount() != PROCESSOR_COUNT)
+            {
+                printf("Warning: the trace has %d threads, but %d threads run. Thread i replays thread i %% %d of the trace.\n",
+                    trace->getColumnCount(), PROCESSOR_COUNT, trace->getColumnCount());
+            }
+        }
+    }
+
+    ~PrimeNumbers()
+    {
+        delete trace;
+    }
+
+    /// <summary>
+    /// Runs the test once, or once per combination of layouts when '--join_layout 0'
+    /// and/or '--stats_layout 0' was given, followed by a comparison of the runs.
+    /// </summary>
+    void Run()
+    {
+        std::vector<RunConfig> configs;
+        for (int joinType = 1; joinType <= JOIN_TYPE_COUNT; joinType++)
+        {
+            if ((JOIN_TYPE != 0) && (JOIN_TYPE != joinType))
+            {
+                continue;
+            }
+
+            // A sweep skips what this processor can't run and what is missing a parameter.
+            CpuFeatures::Feature missingFeature;
+            if (!IsJoinTypeSupported(cpuFeatures, joinType, &missingFeature))
+            {
+                printf("Skipping join_type %d: needs %s, which this processor does not support.\n", joinType, CpuFeatures::GetName(missingFeature));
+                continue;
+            }
+            const char* missingComponent;
+            if (!IsJoinTypeBuilt(joinType, &missingComponent))
+            {
+                printf("Skipping join_type %d: needs %s, which this build does not include.\n", joinType, missingComponent);
+                continue;
+            }
+            if ((joinType >= 3) && (joinType <= 6) && (MWAITX_CYCLES == 0))
+            {
+                printf("Skipping join_type %d: needs '--mwaitx_cycle_count'.\n", joinType);
+                continue;
+            }
+            if ((joinType >= 13) && (joinType <= 15) && (WAITPKG_CYCLES == 0))
+            {
+                printf("Skipping join_type %d: needs '--waitpkg_cycle_count'.\n", joinType);
+                continue;
+            }
+
+            for (int layout = 1; layout <= JOIN_LAYOUT_COUNT; layout++)
+            {
+                if ((JOIN_LAYOUT != 0) && (JOIN_LAYOUT != layout))
+                {
+                    continue;
+                }
+                for (int statsLayout = 1; statsLayout <= STATS_LAYOUT_COUNT; statsLayout++)
+                {
+                    if ((STATS_LAYOUT != 0) && (STATS_LAYOUT != statsLayout))
+                    {
+                        continue;
+                    }
+                    for (int hardWait = 1; hardWait <= HARD_WAIT_KIND_COUNT; hardWait++)
+                    {
+                        // A join type that doesn't use the backend would only repeat the same run, so it runs once.
+                        if (!UsesHardWaitBackend(joinType))
+                        {
+                            if (hardWait != (int)hard_wait_kind::event)
+                            {
+                                continue;
+                            }
+                        }
+                        else if (((HARD_WAIT != 0) && (HARD_WAIT != hardWait)) || !is_hard_wait_supported((hard_wait_kind)hardWait))
+                        {
+                            continue;
+                        }
+                        for (int workload = 1; workload <= WORKLOAD_KIND_COUNT; workload++)
+                        {
+                            if ((WORKLOAD != 0) && (WORKLOAD != workload))
+                            {
+                                continue;
+                            }
+                            configs.push_back({ joinType, (join_layout)layout, (stats_layout)statsLayout, (hard_wait_kind)hardWait, (workload_kind)workload });
+                        }
+                    }
+                }
+            }
+        }
+
+        if (MEASURE_OVERHEAD)
+        {
+            MeasureInstrumentationOverhead();
+        }
+
+        std::vector<RunSummary> summaries(configs.size());
+        for (size_t i = 0; i < configs.size(); i++)
+        {
+            PrimeNumbersTest(configs[i], &summaries[i]);
+        }
+
+        if (configs.size() > 1)
+        {
+            PrintComparison(configs, summaries);
+        }
+    }
+
+    /// <summary>
+    /// One line per run; wakeup latency changes are relative to the first run.
+    /// </summary>
+    void PrintComparison(const std::vector<RunConfig>& configs, const std::vector<RunSummary>& summaries)
+    {
+        auto change = [](ulong value, ulong baseline, char* buffer, size_t size)
+        {
+            if (baseline == 0)
+            {
+                snprintf(buffer, size, "n/a");
+            }
+            else
+            {
+                snprintf(buffer, size, "%+.1f%%", ((double)value - (double)baseline) * 100.0 / (double)baseline);
+            }
+            return buffer;
+        };
+
+        const RunSummary& baseline = summaries[0];
+        PRINT_STATS("===========================================================");
+        PRINT_STATS("Comparison (wakeup latencies in ticks, change vs. the first run, cache misses per join per thread)");
+        PRINT_STATS("%-59s| SoftWait avg (chg)     | SoftWait p99 | HardWait avg (chg)     | HardWait p99 | %-15s | %-15s | Time (ms)", "join_type/join_layout/stats_layout/hard_wait/workload",
+            PerfCounters::GetName(PerfCounters::L1DReadMisses), PerfCounters::GetName(PerfCounters::LLCMisses));
+        for (size_t i = 0; i < configs.size(); i++)
+        {
+            const RunSummary& summary = summaries[i];
+            char name[96], softChange[16], hardChange[16], l1d[32] = "n/a", llc[32] = "n/a";
+            snprintf(name, sizeof(name), "%d/%s/%s/%s/%s", configs[i].joinType, get_join_layout_name(configs[i].layout), GetStatsLayoutName(configs[i].statsLayout),
+                GetHardWaitLabel(configs[i].joinType, configs[i].hardWait), get_workload_name(configs[i].workload));
+            if (summary.perfCountersValid)
+            {
+                snprintf(l1d, sizeof(l1d), "%.1f", summary.perfCountersPerJoin[PerfCounters::L1DReadMisses]);
+                snprintf(llc, sizeof(llc), "%.1f", summary.perfCountersPerJoin[PerfCounters::LLCMisses]);
+            }
+            PRINT_STATS("%-59s| %12s (%7s) | %12s | %12s (%7s) | %12s | %15s | %15s | %lld", name,
+                formatNumber(summary.avgSoftWaitWakeupTime), change(summary.avgSoftWaitWakeupTime, baseline.avgSoftWaitWakeupTime, softChange, sizeof(softChange)),
+                formatNumber(summary.p99SoftWaitWakeupTime),
+                formatNumber(summary.avgHardWaitWakeupTime), change(summary.avgHardWaitWakeupTime, baseline.avgHardWaitWakeupTime, hardChange, sizeof(hardChange)),
+                formatNumber(summary.p99HardWaitWakeupTime),
+                l1d, llc, summary.elapsedMilliseconds);
+        }
     }
 
     /// <summary>
@@ -372,101 +1600,230 @@ public:
     /// </summary>
     /// <param name="args"></param>
     /// <returns></returns>
-    bool PrimeNumbersTest()
+    bool PrimeNumbersTest(const RunConfig& config, RunSummary* summary)
     {
-        std::vector<HANDLE> threadHandles(PROCESSOR_COUNT);
-        std::vector<DWORD> threadIds(PROCESSOR_COUNT);
+        join_layout layout = config.layout;
+        PRINT_STATS("Running: SPIN_COUNT= %d, spin_budget_ticks= %llu, numbers= %d, complexity= %d, JOIN_TYPE= %d, threads= %d, join_layout= %s, stats_layout= %s, hard_wait= %s, workload= %s", SPIN_COUNT, (unsigned long long)SPIN_BUDGET_TICKS, INPUT_COUNT, COMPLEXITY, config.joinType, PROCESSOR_COUNT, get_join_layout_name(layout), GetStatsLayoutName(config.statsLayout), GetHardWaitLabel(config.joinType, config.hardWait), get_workload_name(config.workload));
+
+        // Every run sees the same inputs, so runs that only differ in one setting are comparable.
+        srand(1);
+        std::vector<ulong> inputs((trace != nullptr) ? 0 : (size_t)PROCESSOR_COUNT * INPUT_COUNT);
+        if (trace != nullptr)
+        {
+            // The inputs come from the trace.
+        }
+        else if (COMPLEXITY == 0)
+        {
+            for (int i = 0; i < PROCESSOR_COUNT; i++)
+            {
+                for (int j = 0; j < INPUT_COUNT; j++)
+                {
+                    inputs[i * INPUT_COUNT + j] = j;
+                }
+            }
+        }
+        else
+        {
+            double meanInput = (INPUT_MEAN != 0) ? INPUT_MEAN : (100 + pow(2, COMPLEXITY)) / 2;
+            imbalance_generator(IMBALANCE, meanInput).generate(PROCESSOR_COUNT, INPUT_COUNT, inputs.data());
+        }
+        if (trace == nullptr)
+        {
+            PRINT_STATS("Imbalance: %s, correlation= %.2f, slowest thread over average, per round: %.2f", get_imbalance_name(IMBALANCE.kind), IMBALANCE.correlation,
+                imbalance_generator::getAverageMaxOverMean(PROCESSOR_COUNT, INPUT_COUNT, inputs.data()));
+        }
+
+        std::vector<ThreadImpl> threads(PROCESSOR_COUNT);
+        std::vector<ThreadHandle> threadHandles(PROCESSOR_COUNT);
         std::vector<ThreadInput*> threadInputs(PROCESSOR_COUNT);
+        const bool onOpenMPTeam = (config.joinType == OPENMP_JOIN_TYPE);
 
-        switch (JOIN_TYPE)
+        ThreadProc worker = nullptr;
+        switch (config.joinType)
         {
         case 1:
-            joinData = new t_join_pause(PROCESSOR_COUNT);
+            joinData = CreateComposedJoin<t_join_pause>(&worker, MEASURE_OVERHEAD, PROCESSOR_COUNT, layout, config.hardWait);
             break;
         case 2:
-            joinData = new t_join_pause_soft_wait_only(PROCESSOR_COUNT);
+            joinData = CreateComposedJoin<t_join_pause_soft_wait_only>(&worker, MEASURE_OVERHEAD, PROCESSOR_COUNT, layout, config.hardWait);
             break;
         case 3:
-            joinData = new t_join_mwaitx_loop(PROCESSOR_COUNT, MWAITX_CYCLES);
+            joinData = CreateComposedJoin<t_join_mwaitx_loop>(&worker, MEASURE_OVERHEAD, PROCESSOR_COUNT, layout, config.hardWait, MWAITX_CYCLES);
             break;
         case 4:
-            joinData = new t_join_mwaitx_loop_soft_wait_only(PROCESSOR_COUNT, MWAITX_CYCLES);
+            joinData = CreateComposedJoin<t_join_mwaitx_loop_soft_wait_only>(&worker, MEASURE_OVERHEAD, PROCESSOR_COUNT, layout, config.hardWait, MWAITX_CYCLES);
             break;
         case 5:
-            joinData = new t_join_mwaitx_noloop(PROCESSOR_COUNT, MWAITX_CYCLES);
+            joinData = CreateComposedJoin<t_join_mwaitx_noloop>(&worker, MEASURE_OVERHEAD, PROCESSOR_COUNT, layout, config.hardWait, MWAITX_CYCLES);
             break;
         case 6:
-            joinData = new t_join_mwaitx_noloop_soft_wait_only(PROCESSOR_COUNT, MWAITX_CYCLES);
+            joinData = CreateComposedJoin<t_join_mwaitx_noloop_soft_wait_only>(&worker, MEASURE_OVERHEAD, PROCESSOR_COUNT, layout, config.hardWait, MWAITX_CYCLES);
             break;
         case 7:
-            joinData = new t_join_hard_wait_only(PROCESSOR_COUNT);
+            joinData = CreateComposedJoin<t_join_hard_wait_only>(&worker, MEASURE_OVERHEAD, PROCESSOR_COUNT, layout, config.hardWait);
+            break;
+        case 8:
+            joinData = CreateJoin<t_join_pause_adaptive>(&worker, PROCESSOR_COUNT, layout, config.hardWait);
+            break;
+        case 9:
+            joinData = CreateJoin<t_join_combining_tree>(&worker, PROCESSOR_COUNT, TREE_FAN_IN, layout, config.hardWait);
+            break;
+        case 10:
+            joinData = CreateJoin<t_join_dissemination>(&worker, PROCESSOR_COUNT, layout, config.hardWait);
+            break;
+        case 11:
+            joinData = CreateJoin<t_join_local_spin>(&worker, PROCESSOR_COUNT,
+                (RELEASE_ORDER == 2) ? GetNearestFirstOrders(topology, threadCpus) : std::vector<std::vector<int>>(),
+                layout, config.hardWait);
+            break;
+        case 12:
+            joinData = CreateJoin<t_join_two_level>(&worker, PROCESSOR_COUNT, GetThreadDomains(topology, threadCpus, JOIN_DOMAIN == 2), layout, config.hardWait);
+            break;
+        case 13:
+            joinData = CreateComposedJoin<t_join_umwait_loop>(&worker, MEASURE_OVERHEAD, PROCESSOR_COUNT, layout, config.hardWait, WAITPKG_STATE == 2, WAITPKG_CYCLES);
+            break;
+        case 14:
+            joinData = CreateComposedJoin<t_join_umwait_noloop>(&worker, MEASURE_OVERHEAD, PROCESSOR_COUNT, layout, config.hardWait, WAITPKG_STATE == 2, WAITPKG_CYCLES);
             break;
+        case 15:
+            joinData = CreateComposedJoin<t_join_tpause_loop>(&worker, MEASURE_OVERHEAD, PROCESSOR_COUNT, layout, config.hardWait, WAITPKG_STATE == 2, WAITPKG_CYCLES);
+            break;
+        case 16:
+            joinData = CreateComposedJoin<t_join_backoff>(&worker, MEASURE_OVERHEAD, PROCESSOR_COUNT, layout, config.hardWait,
+                BACKOFF_PAUSE_ROUNDS, BACKOFF_YIELD_ROUNDS, BACKOFF_SLEEP_ROUNDS, BACKOFF_SLEEP_US);
+            break;
+        case 17:
+            joinData = CreateJoin<t_join_predictive>(&worker, PROCESSOR_COUNT,
+                pauseCalibration.NanosecondsToTicks((uint64_t)PREDICT_SPIN_NS), pauseCalibration.NanosecondsToTicks((uint64_t)PREDICT_BLOCK_NS),
+                pauseCalibration.NanosecondsToTicks((uint64_t)EARLY_WAKE_NS), layout, config.hardWait);
+            break;
+#ifdef __cpp_lib_barrier
+        case 18:
+            joinData = CreateJoin<t_join_std_barrier>(&worker, PROCESSOR_COUNT, layout);
+            break;
+#endif // __cpp_lib_barrier
+        case 19:
+            joinData = CreateJoin<t_join_pthread_barrier>(&worker, PROCESSOR_COUNT, layout);
+            break;
+#ifdef _OPENMP
+        case OPENMP_JOIN_TYPE:
+            joinData = CreateJoin<t_join_omp_barrier>(&worker, PROCESSOR_COUNT, layout);
+            break;
+#endif // _OPENMP
         default:
-            printf("");
             break;
         }
 
+        joinData->setSpinBudget(SPIN_BUDGET_TICKS);
+        joinData->setEarlyWake(EARLY_WAKE_THREADS);
+
+        // With stats_layout::shared, all ThreadStats are allocated here back to back, the
+        // way the per-thread output used to be allocated with plain 'new'. With
+        // stats_layout::arena, each thread allocates its own.
+        ThreadStats* sharedStats = nullptr;
+        if (config.statsLayout == stats_layout::shared)
+        {
+            sharedStats = new ThreadStats[PROCESSOR_COUNT];
+        }
+
         // Create all the threads
         for (int i = 0; i < PROCESSOR_COUNT; i++)
         {
-            ThreadInput* tInput = new ThreadInput(i, INPUT_COUNT);
-            if (tInput != NULL)
+            ThreadInput* tInput = new ThreadInput(i, INPUT_COUNT, config.statsLayout, config.workload, (size_t)WORKLOAD_HEAP_MB << 20,
+                (double)pauseCalibration.GetTscFrequency() / 1e9);
+            if ((tInput != NULL) && (sharedStats != nullptr))
+            {
+                tInput->stats = &sharedStats[i];
+                tInput->histograms = new ThreadHistograms();
+            }
+            if ((tInput != NULL) && (trace != nullptr))
+            {
+                tInput->input = trace->getDurations(i % trace->getColumnCount());
+                tInput->phases = trace->getRoundPhases();
+            }
+            else if (tInput != NULL)
             {
-                float n;
                 tInput->input = (ulong*)malloc((sizeof(ulong) * INPUT_COUNT));
-                for (int i = 0; i < INPUT_COUNT; i++)
-                {
-                    if (COMPLEXITY == 0)
-                    {
-                        tInput->input[i] = i;
-                    }
-                    else
-                    {
-                        n = (float)rand() / RAND_MAX;
-                        tInput->input[i] = (ulong)(n * (100 + pow(2, COMPLEXITY)));
-                    }
-                }
+                memcpy(tInput->input, &inputs[i * INPUT_COUNT], sizeof(ulong) * INPUT_COUNT);
             }
             else {
                 assert(!"Failed to allocate tInput");
             }
 
-            DWORD tid;
-            threadHandles[i] = CreateThread(
-                NULL,                           // default security attributes
-                0,                              // use default stack size
-                ThreadWorker,                   // thread function name
-                (LPVOID)tInput,                 // argument to thread function
-                CREATE_SUSPENDED,
-                &tid);                          // returns the thread identifier
-
-            threadIds[i] = tid;
             threadInputs[i] = tInput;
+            if (onOpenMPTeam)
+            {
+                continue;
+            }
 
-            wchar_t buffer[15];
-            wsprintf(buffer, L"Thread# %d", i);
+            if (!threads[i].CreateSuspended(worker, (LPVOID)tInput, i))
+            {
+                printf("Failed to create thread %d. GetLastError() = %u\n", i, GetLastError());
+                exit(1);
+            }
 
-            SetThreadDescription(threadHandles[i], buffer);
+            threadHandles[i] = threads[i].GetHandle();
         }
 
-        // Hard affinitize the threads to cores.
-        SetThreadAffinity(PROCESSOR_COUNT, PROCESSOR_GROUP_COUNT > 1, threadHandles);
+#ifdef _OPENMP
+        // The team's threads affinitize themselves.
+        OpenMPTeam team = { worker, &threadInputs, &threadCpus, PROCESSOR_GROUP_COUNT > 1 };
+        if (onOpenMPTeam)
+        {
+            threads.resize(1);
+            if (!threads[0].CreateSuspended(RunOpenMPTeam, (LPVOID)&team, 0))
+            {
+                printf("Failed to create the OpenMP team's thread. GetLastError() = %u\n", GetLastError());
+                exit(1);
+            }
+        }
+        else
+#endif // _OPENMP
+        {
+            // Hard affinitize the threads to cores.
+            SetThreadAffinity(threadCpus, PROCESSOR_GROUP_COUNT > 1, threadHandles);
+        }
 
-        // https://stackoverflow.com/a/27739925
-        beginTimer = std::chrono::steady_clock::now();
-        start = __rdtsc();
+        readyThreadCount = 0;
+        if (!startGate.IsValid())
+        {
+            if (!startGate.CreateManualEvent(false))
+            {
+                printf("Failed to create the start gate.\n");
+                exit(1);
+            }
+        }
+        startGate.Reset();
 
         // Start all the threads
-        for (int i = 0; i < PROCESSOR_COUNT; i++)
+        for (int i = 0; i < (int)threads.size(); i++)
+        {
+            threads[i].Resume();
+        }
+
+        // Let them go once every one of them is set up.
+        while (readyThreadCount.LoadWithoutBarrier() != PROCESSOR_COUNT)
         {
-            ResumeThread(threadHandles[i]);
+            SleepMicroseconds(100);
         }
 
+        // https://stackoverflow.com/a/27739925
+        beginTimer = std::chrono::steady_clock::now();
+        start = __rdtsc();
+        startGate.Set();
+
         // Wait till last thread would signal that it is done
         joinData->waitForThreads();
 
         unsigned __int64 elapsed_ticks = __rdtsc() - start;
-        auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - beginTimer).count();
+        long long elapsed_time = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - beginTimer).count();
+
+        // The last thread signals completion before the others have recorded the stats
+        // of their final join, so wait for all of them to exit before reading them.
+        for (int i = 0; i < (int)threads.size(); i++)
+        {
+            threads[i].Join();
+        }
 
         int totalHardWaits = 0, totalSoftWaits = 0;
         ulong totalIterations = 0;
@@ -475,11 +1832,19 @@ public:
         unsigned __int64 totalSpinLoopTime = 0;
         unsigned __int64 totalSpinLoopTimeSoftWait = 0;
         unsigned __int64 totalSpinLoopTimeHardWait = 0;
+        LatencyHistogram* spinLoopTimeHistogram = new LatencyHistogram();
+        LatencyHistogram* softWaitWakeupHistogram = new LatencyHistogram();
+        LatencyHistogram* hardWaitWakeupHistogram = new LatencyHistogram();
+        LatencyHistogram* workErrorHistogram = new LatencyHistogram();
+        bool perfCountersValid = true;
+        uint64_t totalPerfCounters[PerfCounters::CounterCount] = {};
+        unsigned __int64 totalWorkTicksRequested = 0, totalWorkTicksTaken = 0, totalWorkTicksAbsoluteError = 0;
         for (int i = 0; i < PROCESSOR_COUNT; i++)
         {
             char diffCh;
             ulong diff;
-            ThreadInput* outputData = threadInputs[i];
+            ThreadStats* outputData = threadInputs[i]->stats;
+            ThreadHistograms* outputHistograms = threadInputs[i]->histograms;
             assert(outputData->hardWaitCount <= INPUT_COUNT);
             assert(outputData->softWaitCount <= INPUT_COUNT);
             totalHardWaits += outputData->hardWaitCount;
@@ -489,6 +1854,18 @@ public:
             totalHardWaitWakeupTimeTicks += outputData->hardWaitWakeupTimeTicks;
             totalSpinLoopTimeSoftWait += outputData->spinLoopTimeTicksSoftWait;
             totalSpinLoopTimeHardWait += outputData->spinLoopTimeTicksHardWait;
+            spinLoopTimeHistogram->Merge(outputHistograms->spinLoopTimeHistogram);
+            softWaitWakeupHistogram->Merge(outputHistograms->softWaitWakeupHistogram);
+            hardWaitWakeupHistogram->Merge(outputHistograms->hardWaitWakeupHistogram);
+            workErrorHistogram->Merge(outputHistograms->workErrorHistogram);
+            perfCountersValid &= outputData->perfCountersValid;
+            totalWorkTicksRequested += outputData->workTicksRequested;
+            totalWorkTicksTaken += outputData->workTicksTaken;
+            totalWorkTicksAbsoluteError += outputData->workTicksAbsoluteError;
+            for (int counter = 0; counter < PerfCounters::CounterCount; counter++)
+            {
+                totalPerfCounters[counter] += outputData->perfCounters[counter];
+            }
             DiffWakeTime(outputData->hardWaitWakeupTimeTicks, outputData->softWaitWakeupTimeTicks, &diff, &diffCh);
             PRINT_THEAD_STATS("[Thread #%d] Iterations: %llu, HardWait: %d, SoftWait: %d, SpinLoop cycles: %llu, HardWaitWakeupTime: %llu, SoftWaitWakeupTime: %llu, Diff: %c%llu", i, outputData->totalIterations, outputData->hardWaitCount, outputData->softWaitCount, outputData->spinLoopTimeTicksSoftWait, outputData->hardWaitWakeupTimeTicks, outputData->softWaitWakeupTimeTicks, diffCh, diff);
         }
@@ -523,6 +1900,30 @@ public:
         PRINT_STATS("AvgSpinWasteTime (per wait) : HardWait: %s, SoftWait: %s, PerWait: %s, Total: %s", formatNumber(avgSpinLoopTimePerHardWait), formatNumber(avgSpinLoopTimePerSoftWait), formatNumber(avgSpinLoopTimePerWait), formatNumber(totalSpinLoopTime));
         PRINT_STATS("Avg Wakeup latency          : HardWait: %s, SoftWait: %s, Diff: %c%s", formatNumber(avgHardWaitWakeupTime), formatNumber(avgSoftWaitWakeupTime), avgDiffChar, formatNumber(avgDiff));
         PRINT_STATS("Cost                        : HardWait: %s, SoftWait: %s, Grand: %s", formatNumber(totalHardWaitCost), formatNumber(totalSoftWaitCost), formatNumber(grandCost));
+        PrintPercentiles("SpinWaste Time percentiles  ", spinLoopTimeHistogram);
+        PrintPercentiles("SoftWait Wakeup percentiles ", softWaitWakeupHistogram);
+        PrintPercentiles("HardWait Wakeup percentiles ", hardWaitWakeupHistogram);
+        if (perfCountersValid)
+        {
+            PRINT_STATS("Cache misses (per join)     : %s: %s, %s: %s", PerfCounters::GetName(PerfCounters::L1DReadMisses), formatNumber(AVG(totalPerfCounters[PerfCounters::L1DReadMisses])),
+                PerfCounters::GetName(PerfCounters::LLCMisses), formatNumber(AVG(totalPerfCounters[PerfCounters::LLCMisses])));
+        }
+        else
+        {
+            PRINT_STATS("Cache misses (per join)     : not available (perf_event_open failed or unsupported)");
+        }
+        if (totalWorkTicksRequested != 0)
+        {
+            PRINT_STATS("Work duration (ticks)       : Requested: %s, Took: %s (%+.3f%%), Mean absolute error: %.3f%%", formatNumber((double)totalWorkTicksRequested), formatNumber((double)totalWorkTicksTaken),
+                ((double)totalWorkTicksTaken - (double)totalWorkTicksRequested) * 100 / (double)totalWorkTicksRequested, (double)totalWorkTicksAbsoluteError * 100 / (double)totalWorkTicksRequested);
+            PrintPercentiles("Work error percentiles      ", workErrorHistogram);
+        }
+        if ((trace != nullptr) && (trace->getRoundPhases() != nullptr))
+        {
+            PrintPhaseStats(threadInputs);
+        }
+        joinData->printHardWaitStats();
+        joinData->printStats();
         PRINT_STATS("...........................................................");
         PRINT_STATS("Average per input_number: Iterations: %s, HardWait: %s, SoftWait: %s", formatNumber(AVG(totalIterations)), formatNumber(AVG(totalHardWaits)), formatNumber(AVG(totalSoftWaits)));
         PRINT_STATS("Average per input_number (all threads): Iterations: %s, HardWait: %s, SoftWait: %s", formatNumber(AVG_NUMBER(totalIterations)), formatNumber(AVG_NUMBER(totalHardWaits)), formatNumber(AVG_NUMBER(totalSoftWaits)));
@@ -530,13 +1931,50 @@ public:
         PRINT_STATS("Time taken: %llu ticks", elapsed_ticks);
         PRINT_STATS("Time difference = %lld milliseconds", elapsed_time);
 
-        PRINT_ONELINE_STATS("OUT] %d|%d|%d|%llu|%d|%d|%llu|%llu|%llu|%llu|%d|%d|%llu|%llu|%llu|%llu|%d|%d|%llu|%llu|%llu|%llu|%llu",
+        PRINT_ONELINE_STATS("OUT] %d|%d|%d|%llu|%d|%d|%llu|%llu|%llu|%llu|%d|%d|%llu|%llu|%llu|%llu|%d|%d|%llu|%llu|%llu|%llu|%lld",
             numPrimeNumbers, complexity, PROCESSOR_COUNT,
             AVG(totalIterations), AVG(totalHardWaits), AVG(totalSoftWaits), avgSpinLoopTimePerWait, avgHardWaitWakeupTime, avgSoftWaitWakeupTime,
             AVG_NUMBER(totalIterations), AVG_NUMBER(totalHardWaits), AVG_NUMBER(totalSoftWaits), avgSpinLoopTime_Number, avgHardWaitWakeupTime_Number, avgSoftWaitWakeupTime_Number,
             AVG_THREAD(totalIterations), AVG_THREAD(totalHardWaits), AVG_THREAD(totalSoftWaits), avgSpinLoopTime_Thread, avgHardWaitWakeupTime_Thread, avgSoftWaitWakeupTime_Thread,
             elapsed_ticks, elapsed_time);
 
+        summary->avgSoftWaitWakeupTime = avgSoftWaitWakeupTime;
+        summary->avgHardWaitWakeupTime = avgHardWaitWakeupTime;
+        summary->p99SoftWaitWakeupTime = softWaitWakeupHistogram->GetPercentile(99);
+        summary->p99HardWaitWakeupTime = hardWaitWakeupHistogram->GetPercentile(99);
+        summary->totalSoftWaits = totalSoftWaits;
+        summary->totalHardWaits = totalHardWaits;
+        summary->perfCountersValid = perfCountersValid;
+        for (int counter = 0; counter < PerfCounters::CounterCount; counter++)
+        {
+            summary->perfCountersPerJoin[counter] = (double)totalPerfCounters[counter] / ((double)INPUT_COUNT * PROCESSOR_COUNT);
+        }
+        summary->elapsedMilliseconds = elapsed_time;
+
+        for (int i = 0; i < PROCESSOR_COUNT; i++)
+        {
+            if (trace == nullptr)
+            {
+                free(threadInputs[i]->input);
+            }
+            if (config.statsLayout == stats_layout::arena)
+            {
+                ThreadStatsArena::Free(threadInputs[i]->stats);
+            }
+            else
+            {
+                delete threadInputs[i]->histograms;
+            }
+            delete threadInputs[i];
+        }
+        delete[] sharedStats;
+        delete spinLoopTimeHistogram;
+        delete softWaitWakeupHistogram;
+        delete hardWaitWakeupHistogram;
+        delete workErrorHistogram;
+        delete joinData;
+        joinData = nullptr;
+
         return true;
     }
 };
@@ -544,7 +1982,7 @@ public:
 int main(int argc, char** argv)
 {
     PrimeNumbers p(argc, argv);
-    p.PrimeNumbersTest();
+    p.Run();
 
     fflush(stdout);
     return 0;
@@ -1,5 +1,7 @@
-// Adopted from https://github.com/umezawatakeshi/GetLogicalProcessorInformationEx/blob/master/GetLogicalProcessorInformationEx.cc
-#include <Windows.h>
+#pragma once
+#include "Platform.h"
+#include "Topology.h"
+#include <vector>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,74 +33,347 @@ public:
 };
 
 
-void GetProcessorInfo(int* processorCount, int* processorGroupCount)
+enum class PlacementPolicy
 {
-	*processorGroupCount = 1;
-	*processorCount = 1;
-	SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX* pBuffer;
-	DWORD cbBuffer;
-	char dummy[256] = {};
+	OsOrder,        // thread i -> i'th processor in OS numbering (the original behavior)
+	Compact,        // fill SMT siblings of a core, then the next core of the same L3, node, package
+	Scatter,        // spread across packages, then nodes, then L3s, then cores; SMT siblings last
+	PhysicalCore,   // one thread per physical core, SMT siblings are left idle
+	L3,             // one thread per L3 (CCX) domain
+	Numa,           // round-robin across NUMA nodes, distinct cores before SMT siblings
+	CpuList,        // explicit list of processors
+};
 
-	pBuffer = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)dummy;
-	cbBuffer = 1;
-	if (GetLogicalProcessorInformationEx(RelationAll, pBuffer, &cbBuffer))
+const char* GetPlacementPolicyName(PlacementPolicy policy)
+{
+	switch (policy)
 	{
-		//printf("GetLogicalProcessorInformationEx returned nothing successfully.\n");
-		*processorCount = 0;
-		return;
+	case PlacementPolicy::OsOrder: return "os";
+	case PlacementPolicy::Compact: return "compact";
+	case PlacementPolicy::Scatter: return "scatter";
+	case PlacementPolicy::PhysicalCore: return "core";
+	case PlacementPolicy::L3: return "l3";
+	case PlacementPolicy::Numa: return "numa";
+	case PlacementPolicy::CpuList: return "cpulist";
 	}
-	if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+	return "unknown";
+}
+
+/// <summary>
+/// Parses the value of '--placement'. An explicit list is given as "cpulist:0-3,8".
+/// </summary>
+bool ParsePlacementPolicy(const char* value, PlacementPolicy* policy, std::vector<int>& cpuList)
+{
+	const PlacementPolicy policies[] = { PlacementPolicy::OsOrder, PlacementPolicy::Compact, PlacementPolicy::Scatter,
+		PlacementPolicy::PhysicalCore, PlacementPolicy::L3, PlacementPolicy::Numa };
+	for (PlacementPolicy candidate : policies)
 	{
-		printf("GetLogicalProcessorInformationEx returned error (1). GetLastError() = %u\n", GetLastError());
-		*processorCount = 1;
-		return;
+		if (_strcmpi(value, GetPlacementPolicyName(candidate)) == 0)
+		{
+			*policy = candidate;
+			return true;
+		}
 	}
 
-	pBuffer = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)malloc(cbBuffer);
-	if (!GetLogicalProcessorInformationEx(RelationAll, pBuffer, &cbBuffer))
+	const char* prefix = "cpulist:";
+	if (strncmp(value, prefix, strlen(prefix)) == 0)
 	{
-		printf("GetLogicalProcessorInformationEx returned error (2). GetLastError() = %u\n", GetLastError());
-		*processorCount = 2;
-		return;
+		*policy = PlacementPolicy::CpuList;
+		return ParseCpuList(value + strlen(prefix), cpuList) && !cpuList.empty();
 	}
+	return false;
+}
 
-	//printf("GetLogicalProcessorInformationEx returned %u byte data.\n", cbBuffer);
+/// <returns>true if more threads than placement slots may share processors, wrapping around.</returns>
+bool PlacementAllowsOversubscription(PlacementPolicy policy)
+{
+	return (policy == PlacementPolicy::OsOrder) || (policy == PlacementPolicy::Compact) ||
+		(policy == PlacementPolicy::Scatter) || (policy == PlacementPolicy::Numa);
+}
 
-	char* pCur = (char*)pBuffer;
-	char* pEnd = pCur + cbBuffer;
-	for (int idx = 0; pCur < pEnd; pCur += ((SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)pCur)->Size, ++idx)
+// Round-robin merge: first element of every list, then the second of every list, ...
+std::vector<int> InterleaveCpus(const std::vector<std::vector<int>>& lists)
+{
+	std::vector<int> result;
+	for (size_t i = 0; ; i++)
 	{
-		pBuffer = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)pCur;
-		if (pBuffer->Relationship == RelationGroup)
+		bool any = false;
+		for (const std::vector<int>& list : lists)
 		{
-			GROUP_RELATIONSHIP& info = pBuffer->Group;
-			int activeGroupCount = info.ActiveGroupCount;
-			*processorGroupCount = activeGroupCount;
-			int activeProcessorCount = 0;
-			for (int i = 0; i < activeGroupCount; i++)
+			if (i < list.size())
 			{
-				PROCESSOR_GROUP_INFO& ginfo = info.GroupInfo[i];
-				activeProcessorCount += ginfo.ActiveProcessorCount;
+				result.push_back(list[i]);
+				any = true;
 			}
-			*processorCount = activeProcessorCount;
-			return;
+		}
+		if (!any)
+		{
+			return result;
 		}
 	}
 }
 
+// Processors of the given cores, taking SMT thread 0 of every core before any thread 1.
+std::vector<int> CoreFirstCpus(const std::vector<const TopologyCore*>& cores)
+{
+	std::vector<std::vector<int>> perCore;
+	for (const TopologyCore* core : cores)
+	{
+		perCore.push_back(core->cpus);
+	}
+	return InterleaveCpus(perCore);
+}
+
+/// <summary>
+/// Ordered processor slots for a placement policy; thread i runs on slot i.
+/// </summary>
+std::vector<int> GetPlacementCpus(const CpuTopology& topology, PlacementPolicy policy, const std::vector<int>& cpuList)
+{
+	std::vector<int> result;
+	const std::vector<TopologyPackage>& packages = topology.GetPackages();
+
+	switch (policy)
+	{
+	case PlacementPolicy::OsOrder:
+		for (const LogicalCpu& cpu : topology.GetCpus())
+		{
+			result.push_back(cpu.cpu);
+		}
+		std::sort(result.begin(), result.end());
+		break;
+
+	case PlacementPolicy::Compact:
+		for (const LogicalCpu& cpu : topology.GetCpus())
+		{
+			result.push_back(cpu.cpu);
+		}
+		break;
+
+	case PlacementPolicy::Scatter:
+	{
+		// Build, bottom up, a list per tree level where consecutive entries land in
+		// different subtrees as far up the tree as possible.
+		int maxSmt = 0;
+		for (const LogicalCpu& cpu : topology.GetCpus())
+		{
+			maxSmt = std::max(maxSmt, cpu.smt + 1);
+		}
+		for (int smt = 0; smt < maxSmt; smt++)
+		{
+			std::vector<std::vector<int>> perPackage;
+			for (const TopologyPackage& package : packages)
+			{
+				std::vector<std::vector<int>> perNode;
+				for (const TopologyNode& node : package.nodes)
+				{
+					std::vector<std::vector<int>> perL3;
+					for (const TopologyL3& l3 : node.l3s)
+					{
+						std::vector<int> cores;
+						for (const TopologyCore& core : l3.cores)
+						{
+							if (smt < (int)core.cpus.size())
+							{
+								cores.push_back(core.cpus[smt]);
+							}
+						}
+						perL3.push_back(cores);
+					}
+					perNode.push_back(InterleaveCpus(perL3));
+				}
+				perPackage.push_back(InterleaveCpus(perNode));
+			}
+			std::vector<int> level = InterleaveCpus(perPackage);
+			result.insert(result.end(), level.begin(), level.end());
+		}
+		break;
+	}
+
+	case PlacementPolicy::PhysicalCore:
+	case PlacementPolicy::L3:
+		for (const TopologyPackage& package : packages)
+		{
+			for (const TopologyNode& node : package.nodes)
+			{
+				for (const TopologyL3& l3 : node.l3s)
+				{
+					for (const TopologyCore& core : l3.cores)
+					{
+						result.push_back(core.cpus[0]);
+						if (policy == PlacementPolicy::L3)
+						{
+							break;
+						}
+					}
+				}
+			}
+		}
+		break;
+
+	case PlacementPolicy::Numa:
+	{
+		// A node may be listed under several packages; gather its cores across all of them.
+		std::vector<int> nodeIds;
+		std::vector<std::vector<const TopologyCore*>> nodeCores;
+		for (const TopologyPackage& package : packages)
+		{
+			for (const TopologyNode& node : package.nodes)
+			{
+				size_t index = std::find(nodeIds.begin(), nodeIds.end(), node.id) - nodeIds.begin();
+				if (index == nodeIds.size())
+				{
+					nodeIds.push_back(node.id);
+					nodeCores.emplace_back();
+				}
+				for (const TopologyL3& l3 : node.l3s)
+				{
+					for (const TopologyCore& core : l3.cores)
+					{
+						nodeCores[index].push_back(&core);
+					}
+				}
+			}
+		}
+		std::vector<std::vector<int>> perNode;
+		for (const std::vector<const TopologyCore*>& cores : nodeCores)
+		{
+			perNode.push_back(CoreFirstCpus(cores));
+		}
+		result = InterleaveCpus(perNode);
+		break;
+	}
+
+	case PlacementPolicy::CpuList:
+		result = cpuList;
+		break;
+	}
+
+	return result;
+}
+
+/// <summary>
+/// Prints which processor every thread was placed on, and how many distinct
+/// cores, L3 domains, NUMA nodes and packages that covers.
+/// </summary>
+void PrintPlacement(const CpuTopology& topology, PlacementPolicy policy, const std::vector<int>& threadCpus)
+{
+	std::vector<int> cpus, cores, l3s, nodes, packages;
+	std::string mapping;
+	char buffer[32];
+	for (size_t i = 0; i < threadCpus.size(); i++)
+	{
+		snprintf(buffer, sizeof(buffer), "%s%d", (i == 0) ? "" : ",", threadCpus[i]);
+		mapping += buffer;
+
+		const LogicalCpu* cpu = topology.FindCpu(threadCpus[i]);
+		if (cpu != nullptr)
+		{
+			cpus.push_back(cpu->cpu);
+			cores.push_back(cpu->core);
+			l3s.push_back(cpu->l3);
+			nodes.push_back(cpu->node);
+			packages.push_back(cpu->package);
+		}
+	}
+
+	auto distinct = [](std::vector<int>& values)
+	{
+		std::sort(values.begin(), values.end());
+		return (int)(std::unique(values.begin(), values.end()) - values.begin());
+	};
+
+	printf("Placement: %s. Spans %d CPU(s), %d core(s), %d L3 domain(s), %d NUMA node(s), %d package(s).\n",
+		GetPlacementPolicyName(policy), distinct(cpus), distinct(cores), distinct(l3s), distinct(nodes), distinct(packages));
+	printf("Placement CPUs by thread: %s.\n", mapping.c_str());
+}
+
+// How far apart two processors are: 0 = same core, 1 = same L3, 2 = same NUMA node,
+// 3 = same package, 4 = different packages (or unknown).
+int GetCpuDistance(const LogicalCpu* first, const LogicalCpu* second)
+{
+	if ((first == nullptr) || (second == nullptr))
+	{
+		return 4;
+	}
+	if (first->core == second->core)
+	{
+		return 0;
+	}
+	if (first->l3 == second->l3)
+	{
+		return 1;
+	}
+	if (first->node == second->node)
+	{
+		return 2;
+	}
+	return (first->package == second->package) ? 3 : 4;
+}
+
+// For every thread, all the other threads ordered from the nearest to the farthest,
+// by thread index within the same distance.
+std::vector<std::vector<int>> GetNearestFirstOrders(const CpuTopology& topology, const std::vector<int>& threadCpus)
+{
+	int threadCount = (int)threadCpus.size();
+	std::vector<const LogicalCpu*> cpus(threadCount);
+	for (int i = 0; i < threadCount; i++)
+	{
+		cpus[i] = topology.FindCpu(threadCpus[i]);
+	}
+
+	std::vector<std::vector<int>> orders(threadCount);
+	for (int i = 0; i < threadCount; i++)
+	{
+		for (int j = 0; j < threadCount; j++)
+		{
+			if (j != i)
+			{
+				orders[i].push_back(j);
+			}
+		}
+		std::stable_sort(orders[i].begin(), orders[i].end(), [&](int first, int second)
+		{
+			return GetCpuDistance(cpus[i], cpus[first]) < GetCpuDistance(cpus[i], cpus[second]);
+		});
+	}
+	return orders;
+}
+
+// Dense index of the L3 domain (or NUMA node, if 'byNode') of every thread, numbered in
+// order of first appearance. Threads whose processor is unknown share one domain.
+std::vector<int> GetThreadDomains(const CpuTopology& topology, const std::vector<int>& threadCpus, bool byNode)
+{
+	std::vector<int> keys;
+	std::vector<int> domains(threadCpus.size());
+	for (size_t i = 0; i < threadCpus.size(); i++)
+	{
+		const LogicalCpu* cpu = topology.FindCpu(threadCpus[i]);
+		int key = (cpu == nullptr) ? -1 : (byNode ? cpu->node : cpu->l3);
+		auto found = std::find(keys.begin(), keys.end(), key);
+		domains[i] = (int)(found - keys.begin());
+		if (found == keys.end())
+		{
+			keys.push_back(key);
+		}
+	}
+	return domains;
+}
+
+#ifdef _WIN32
+
 /// <summary>
 /// Hard affinitize the threads to the processors.
 /// </summary>
-/// <param name="processorCount"></param>
+/// <param name="threadCpus">Processor (combined GroupProcNo value) for each thread.</param>
 /// <param name="isMultiCpuGroup"></param>
 /// <param name="threadHandles"></param>
-void SetThreadAffinity(int processorCount, bool isMultiCpuGroup, std::vector<HANDLE>& threadHandles)
+void SetThreadAffinity(const std::vector<int>& threadCpus, bool isMultiCpuGroup, std::vector<ThreadHandle>& threadHandles)
 {
-	assert(threadHandles.size() == processorCount);
+	assert(threadHandles.size() == threadCpus.size());
 
-	for (int procNo = 0; procNo < processorCount; procNo++)
+	for (int procNo = 0; procNo < (int)threadCpus.size(); procNo++)
 	{
-		GroupProcNo groupProcNo(procNo);
+		GroupProcNo groupProcNo((uint16_t)threadCpus[procNo]);
 
 		if (isMultiCpuGroup)
 		{
@@ -125,4 +400,34 @@ void SetThreadAffinity(int processorCount, bool isMultiCpuGroup, std::vector<HAN
 			}
 		}
 	}
-}
\ No newline at end of file
+}
+
+#else // _WIN32
+
+/// <summary>
+/// Hard affinitize the threads to the processors.
+/// </summary>
+/// <param name="threadCpus">OS processor number for each thread.</param>
+/// <param name="isMultiCpuGroup">Unused on Linux.</param>
+/// <param name="threadHandles"></param>
+void SetThreadAffinity(const std::vector<int>& threadCpus, bool isMultiCpuGroup, std::vector<ThreadHandle>& threadHandles)
+{
+	assert(threadHandles.size() == threadCpus.size());
+	UNREFERENCED_PARAMETER(isMultiCpuGroup);
+
+	int maxCpu = threadCpus.empty() ? 0 : *std::max_element(threadCpus.begin(), threadCpus.end());
+	for (int procNo = 0; procNo < (int)threadCpus.size(); procNo++)
+	{
+		CpuSet cpuSet(maxCpu + 1);
+		cpuSet.Set(threadCpus[procNo]);
+
+		int result = cpuSet.ApplyToThread(threadHandles[procNo]);
+		if (result != 0)
+		{
+			printf("pthread_setaffinity_np returned %d for processor %d.\n", result, threadCpus[procNo]);
+			return;
+		}
+	}
+}
+
+#endif // _WIN32
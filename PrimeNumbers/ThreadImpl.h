@@ -0,0 +1,104 @@
+#pragma once
+#include "Platform.h"
+#include "EventImpl.h"
+
+// Thin wrapper over the OS thread APIs. Threads are always created suspended
+// so that they can be affinitized before they start running; on Linux, where
+// pthreads cannot be created suspended, the thread parks on a start event
+// until Resume() is called.
+class ThreadImpl
+{
+private:
+    ThreadHandle m_handle;
+    bool m_valid;
+
+#ifndef _WIN32
+    EventImpl m_startEvent;
+    ThreadProc m_proc;
+    LPVOID m_param;
+
+    static void* StartRoutine(void* arg)
+    {
+        ThreadImpl* thread = (ThreadImpl*)arg;
+        thread->m_startEvent.Wait(INFINITE, FALSE);
+        return (void*)(uintptr_t)thread->m_proc(thread->m_param);
+    }
+#endif // !_WIN32
+
+public:
+    ThreadImpl() : m_valid(false) {}
+
+    bool IsValid() const
+    {
+        return m_valid;
+    }
+
+    ThreadHandle GetHandle() const
+    {
+        assert(IsValid());
+        return m_handle;
+    }
+
+    bool CreateSuspended(ThreadProc proc, LPVOID param, int index)
+    {
+#ifdef _WIN32
+        DWORD tid;
+        m_handle = CreateThread(
+            NULL,                           // default security attributes
+            0,                              // use default stack size
+            proc,                           // thread function name
+            param,                          // argument to thread function
+            CREATE_SUSPENDED,
+            &tid);                          // returns the thread identifier
+        m_valid = (m_handle != NULL);
+
+        if (m_valid)
+        {
+            wchar_t buffer[15];
+            wsprintf(buffer, L"Thread# %d", index);
+            SetThreadDescription(m_handle, buffer);
+        }
+#else
+        m_proc = proc;
+        m_param = param;
+        m_startEvent.CreateManualEvent(false);
+        m_valid = (pthread_create(&m_handle, nullptr, StartRoutine, this) == 0);
+
+        if (m_valid)
+        {
+            // Thread names are limited to 16 bytes including the terminator,
+            // so the prefix is short enough for any index.
+            char buffer[16];
+            snprintf(buffer, sizeof(buffer), "T# %d", index);
+            pthread_setname_np(m_handle, buffer);
+        }
+#endif // _WIN32
+        return m_valid;
+    }
+
+    void Resume()
+    {
+        assert(IsValid());
+#ifdef _WIN32
+        ResumeThread(m_handle);
+#else
+        m_startEvent.Set();
+#endif // _WIN32
+    }
+
+    /// <summary>
+    /// Waits for the thread to exit and releases it.
+    /// </summary>
+    void Join()
+    {
+        assert(IsValid());
+#ifdef _WIN32
+        WaitForSingleObject(m_handle, INFINITE);
+        CloseHandle(m_handle);
+#else
+        pthread_join(m_handle, nullptr);
+        m_startEvent.CloseEvent();
+#endif // _WIN32
+        m_valid = false;
+    }
+};
@@ -0,0 +1,537 @@
+#pragma once
+#include "Platform.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+/// <summary>
+/// Parses a Linux style cpulist ("0-3,8,10-11") into individual CPU numbers.
+/// </summary>
+/// <returns>false if the list is malformed.</returns>
+inline bool ParseCpuList(const char* cpuList, std::vector<int>& cpus)
+{
+    const char* cur = cpuList;
+    while (*cur != '\0' && *cur != '\n')
+    {
+        char* end;
+        long first = strtol(cur, &end, 10);
+        if (end == cur || first < 0)
+        {
+            return false;
+        }
+        long last = first;
+        cur = end;
+        if (*cur == '-')
+        {
+            cur++;
+            last = strtol(cur, &end, 10);
+            if (end == cur || last < first)
+            {
+                return false;
+            }
+            cur = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            cpus.push_back((int)cpu);
+        }
+        if (*cur == ',')
+        {
+            cur++;
+        }
+        else if (*cur != '\0' && *cur != '\n')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// <summary>
+/// Formats CPU numbers back into a compact cpulist, collapsing consecutive runs.
+/// </summary>
+inline std::string FormatCpuList(std::vector<int> cpus)
+{
+    std::sort(cpus.begin(), cpus.end());
+    std::string result;
+    char buffer[32];
+    for (size_t i = 0; i < cpus.size();)
+    {
+        size_t j = i;
+        while ((j + 1 < cpus.size()) && (cpus[j + 1] == cpus[j] + 1))
+        {
+            j++;
+        }
+        if (j == i)
+        {
+            snprintf(buffer, sizeof(buffer), "%s%d", result.empty() ? "" : ",", cpus[i]);
+        }
+        else
+        {
+            snprintf(buffer, sizeof(buffer), "%s%d-%d", result.empty() ? "" : ",", cpus[i], cpus[j]);
+        }
+        result += buffer;
+        i = j + 1;
+    }
+    return result;
+}
+
+#ifndef _WIN32
+
+/// <summary>
+/// Dynamically sized cpu_set_t, so machines with more than CPU_SETSIZE (1024)
+/// logical processors can still be addressed.
+/// </summary>
+class CpuSet
+{
+private:
+    cpu_set_t* m_set;
+    int m_maxCpus;
+    size_t m_size;
+
+    void Allocate(int maxCpus)
+    {
+        m_maxCpus = maxCpus;
+        m_set = CPU_ALLOC(maxCpus);
+        m_size = CPU_ALLOC_SIZE(maxCpus);
+        CPU_ZERO_S(m_size, m_set);
+    }
+
+public:
+    CpuSet(int maxCpus)
+    {
+        Allocate(maxCpus);
+    }
+
+    ~CpuSet()
+    {
+        CPU_FREE(m_set);
+    }
+
+    CpuSet(const CpuSet&) = delete;
+    CpuSet& operator=(const CpuSet&) = delete;
+
+    int GetMaxCpus() const { return m_maxCpus; }
+
+    void Set(int cpu)
+    {
+        assert(cpu < m_maxCpus);
+        CPU_SET_S(cpu, m_size, m_set);
+    }
+
+    bool IsSet(int cpu) const
+    {
+        return (cpu < m_maxCpus) && CPU_ISSET_S(cpu, m_size, m_set);
+    }
+
+    int Count() const
+    {
+        return CPU_COUNT_S(m_size, m_set);
+    }
+
+    /// <summary>
+    /// Reads the affinity mask of the calling process, growing the set until it
+    /// is large enough for the kernel's nr_cpu_ids.
+    /// </summary>
+    bool GetProcessAffinity()
+    {
+        while (sched_getaffinity(0, m_size, m_set) != 0)
+        {
+            if ((errno != EINVAL) || (m_maxCpus >= (1 << 20)))
+            {
+                return false;
+            }
+            CPU_FREE(m_set);
+            Allocate(m_maxCpus * 2);
+        }
+        return true;
+    }
+
+    /// <returns>0 on success, otherwise the pthread error code.</returns>
+    int ApplyToThread(pthread_t thread) const
+    {
+        return pthread_setaffinity_np(thread, m_size, m_set);
+    }
+};
+
+#endif // !_WIN32
+
+// A logical processor and its position in the topology tree. Package and node
+// are the ids reported by the OS; the L3 and core indices are dense indices
+// assigned while building the tree.
+struct LogicalCpu
+{
+    int cpu;        // OS processor number. On Windows, this is the combined GroupProcNo value.
+    int package;
+    int node;
+    int l3;
+    int core;
+    int smt;        // index of this thread among its SMT siblings
+};
+
+struct TopologyCore
+{
+    int index;
+    std::vector<int> cpus;
+};
+
+struct TopologyL3
+{
+    int index;
+    std::vector<TopologyCore> cores;
+};
+
+struct TopologyNode
+{
+    int id;
+    std::vector<TopologyL3> l3s;
+};
+
+struct TopologyPackage
+{
+    int id;
+    std::vector<TopologyNode> nodes;
+};
+
+/// <summary>
+/// package -> NUMA node -> L3 (CCX) -> core -> SMT thread tree of the processors this
+/// process is allowed to run on.
+///
+/// On Linux this is read from /sys/devices/system/cpu and /sys/devices/system/node.
+/// A level that does not nest strictly in its parent (e.g. an L3 shared by two
+/// sub-NUMA clusters) shows up once under every parent that owns some of its CPUs.
+/// On Windows the tree is flat: one package, node and L3, and a core per processor.
+/// </summary>
+class CpuTopology
+{
+private:
+    std::vector<LogicalCpu> m_cpus;
+    std::vector<TopologyPackage> m_packages;
+    int m_groupCount;
+    int m_nodeCount;
+    int m_l3Count;
+    int m_coreCount;
+
+    // Raw identity of a processor as discovered from the OS; used only while building the tree.
+    struct CpuKey
+    {
+        int cpu;
+        int package;
+        int node;
+        int l3Key;      // lowest CPU sharing the L3, or -1 if there is no L3
+        int coreKey;    // lowest CPU among the SMT siblings
+
+        bool operator<(const CpuKey& other) const
+        {
+            if (package != other.package) return package < other.package;
+            if (node != other.node) return node < other.node;
+            if (l3Key != other.l3Key) return l3Key < other.l3Key;
+            if (coreKey != other.coreKey) return coreKey < other.coreKey;
+            return cpu < other.cpu;
+        }
+    };
+
+    void Build(std::vector<CpuKey>& keys)
+    {
+        std::sort(keys.begin(), keys.end());
+
+        m_cpus.clear();
+        m_packages.clear();
+        m_nodeCount = 0;
+        m_l3Count = 0;
+        m_coreCount = 0;
+
+        const CpuKey* prev = nullptr;
+        for (const CpuKey& key : keys)
+        {
+            bool newPackage = (prev == nullptr) || (prev->package != key.package);
+            bool newNode = newPackage || (prev->node != key.node);
+            bool newL3 = newNode || (prev->l3Key != key.l3Key);
+            bool newCore = newL3 || (prev->coreKey != key.coreKey);
+
+            if (newPackage)
+            {
+                m_packages.push_back({ key.package, {} });
+            }
+            TopologyPackage& package = m_packages.back();
+            if (newNode)
+            {
+                package.nodes.push_back({ key.node, {} });
+            }
+            TopologyNode& node = package.nodes.back();
+            if (newL3)
+            {
+                node.l3s.push_back({ m_l3Count++, {} });
+            }
+            TopologyL3& l3 = node.l3s.back();
+            if (newCore)
+            {
+                l3.cores.push_back({ m_coreCount++, {} });
+            }
+            TopologyCore& core = l3.cores.back();
+
+            LogicalCpu cpu;
+            cpu.cpu = key.cpu;
+            cpu.package = key.package;
+            cpu.node = key.node;
+            cpu.l3 = l3.index;
+            cpu.core = core.index;
+            cpu.smt = (int)core.cpus.size();
+            core.cpus.push_back(key.cpu);
+            m_cpus.push_back(cpu);
+
+            prev = &key;
+        }
+
+        // The same NUMA node may appear under several packages; count distinct ids.
+        std::vector<int> nodeIds;
+        for (const LogicalCpu& cpu : m_cpus)
+        {
+            nodeIds.push_back(cpu.node);
+        }
+        std::sort(nodeIds.begin(), nodeIds.end());
+        m_nodeCount = (int)(std::unique(nodeIds.begin(), nodeIds.end()) - nodeIds.begin());
+    }
+
+#ifndef _WIN32
+    static bool ReadSysfsString(const char* path, char* buffer, size_t size)
+    {
+        FILE* file = fopen(path, "r");
+        if (file == nullptr)
+        {
+            return false;
+        }
+        bool result = (fgets(buffer, (int)size, file) != nullptr);
+        fclose(file);
+        return result;
+    }
+
+    static bool ReadSysfsInt(const char* path, int* value)
+    {
+        char buffer[64];
+        if (!ReadSysfsString(path, buffer, sizeof(buffer)))
+        {
+            return false;
+        }
+        *value = atoi(buffer);
+        return true;
+    }
+
+    // Returns the lowest CPU in a sysfs cpulist file, or -1 if it cannot be read.
+    static int ReadLowestCpu(const char* path)
+    {
+        // A cpulist for a 4096-CPU machine can be long when sparsely populated.
+        static char buffer[64 * 1024];
+        std::vector<int> cpus;
+        if (!ReadSysfsString(path, buffer, sizeof(buffer)) || !ParseCpuList(buffer, cpus) || cpus.empty())
+        {
+            return -1;
+        }
+        return *std::min_element(cpus.begin(), cpus.end());
+    }
+
+    static int ReadL3Key(int cpu)
+    {
+        char path[256];
+        for (int index = 0; ; index++)
+        {
+            int level;
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+            if (!ReadSysfsInt(path, &level))
+            {
+                return -1;
+            }
+            if (level == 3)
+            {
+                snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+                return ReadLowestCpu(path);
+            }
+        }
+    }
+
+    static void ReadNodes(std::vector<int>& cpuToNode)
+    {
+        static char buffer[64 * 1024];
+        DIR* dir = opendir("/sys/devices/system/node");
+        if (dir == nullptr)
+        {
+            return;
+        }
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr)
+        {
+            int node;
+            if ((strncmp(entry->d_name, "node", 4) != 0) || (sscanf(entry->d_name + 4, "%d", &node) != 1))
+            {
+                continue;
+            }
+            char path[256];
+            std::vector<int> cpus;
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+            if (!ReadSysfsString(path, buffer, sizeof(buffer)) || !ParseCpuList(buffer, cpus))
+            {
+                continue;
+            }
+            for (int cpu : cpus)
+            {
+                if (cpu < (int)cpuToNode.size())
+                {
+                    cpuToNode[cpu] = node;
+                }
+            }
+        }
+        closedir(dir);
+    }
+#endif // !_WIN32
+
+public:
+    CpuTopology() : m_groupCount(1), m_nodeCount(0), m_l3Count(0), m_coreCount(0) {}
+
+    /// <summary>
+    /// Discovers the processors available to this process.
+    /// </summary>
+    /// <returns>false if nothing could be discovered, in which case a single CPU is assumed.</returns>
+    bool Discover()
+    {
+        std::vector<CpuKey> keys;
+        bool result = true;
+
+#ifdef _WIN32
+        m_groupCount = GetActiveProcessorGroupCount();
+        for (WORD group = 0; group < m_groupCount; group++)
+        {
+            DWORD count = GetActiveProcessorCount(group);
+            for (DWORD procIndex = 0; procIndex < count; procIndex++)
+            {
+                int cpu = (int)((group << 6) | procIndex);
+                keys.push_back({ cpu, 0, 0, 0, cpu });
+            }
+        }
+#else
+        m_groupCount = 1;
+
+        static char buffer[64 * 1024];
+        std::vector<int> online;
+        if (!ReadSysfsString("/sys/devices/system/cpu/online", buffer, sizeof(buffer)) || !ParseCpuList(buffer, online))
+        {
+            online.clear();
+            for (int cpu = 0; cpu < (int)sysconf(_SC_NPROCESSORS_ONLN); cpu++)
+            {
+                online.push_back(cpu);
+            }
+        }
+
+        int maxCpu = online.empty() ? 0 : *std::max_element(online.begin(), online.end());
+        CpuSet allowed(std::max(maxCpu + 1, (int)sysconf(_SC_NPROCESSORS_CONF)));
+        bool hasAffinity = allowed.GetProcessAffinity();
+
+        std::vector<int> cpuToNode(maxCpu + 1, 0);
+        ReadNodes(cpuToNode);
+
+        for (int cpu : online)
+        {
+            if (hasAffinity && !allowed.IsSet(cpu))
+            {
+                continue;
+            }
+
+            char path[256];
+            CpuKey key;
+            key.cpu = cpu;
+            key.node = cpuToNode[cpu];
+
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+            if (!ReadSysfsInt(path, &key.package) || (key.package < 0))
+            {
+                key.package = 0;
+            }
+
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+            key.coreKey = ReadLowestCpu(path);
+            if (key.coreKey < 0)
+            {
+                key.coreKey = cpu;
+            }
+
+            key.l3Key = ReadL3Key(cpu);
+            keys.push_back(key);
+        }
+#endif // _WIN32
+
+        if (keys.empty())
+        {
+            keys.push_back({ 0, 0, 0, 0, 0 });
+            result = false;
+        }
+
+        Build(keys);
+        return result;
+    }
+
+    int GetCpuCount() const { return (int)m_cpus.size(); }
+    int GetGroupCount() const { return m_groupCount; }
+    int GetPackageCount() const { return (int)m_packages.size(); }
+    int GetNodeCount() const { return m_nodeCount; }
+    int GetL3Count() const { return m_l3Count; }
+    int GetCoreCount() const { return m_coreCount; }
+
+    /// <summary>
+    /// Logical processors in tree order: siblings of a core are adjacent, cores of
+    /// an L3 are adjacent, and so on.
+    /// </summary>
+    const std::vector<LogicalCpu>& GetCpus() const { return m_cpus; }
+    const std::vector<TopologyPackage>& GetPackages() const { return m_packages; }
+
+    /// <returns>The entry for OS processor 'cpu', or nullptr if it's not available to this process.</returns>
+    const LogicalCpu* FindCpu(int cpu) const
+    {
+        for (const LogicalCpu& logicalCpu : m_cpus)
+        {
+            if (logicalCpu.cpu == cpu)
+            {
+                return &logicalCpu;
+            }
+        }
+        return nullptr;
+    }
+
+    void PrintSummary() const
+    {
+        printf("Topology: %d package(s), %d NUMA node(s), %d L3 domain(s), %d core(s), %d logical CPU(s).\n",
+            GetPackageCount(), GetNodeCount(), GetL3Count(), GetCoreCount(), GetCpuCount());
+    }
+
+    void Print() const
+    {
+        PrintSummary();
+        for (const TopologyPackage& package : m_packages)
+        {
+            printf("  Package %d\n", package.id);
+            for (const TopologyNode& node : package.nodes)
+            {
+                printf("    Node %d\n", node.id);
+                for (const TopologyL3& l3 : node.l3s)
+                {
+                    std::vector<int> l3Cpus;
+                    for (const TopologyCore& core : l3.cores)
+                    {
+                        l3Cpus.insert(l3Cpus.end(), core.cpus.begin(), core.cpus.end());
+                    }
+                    printf("      L3 #%d: CPUs %s\n", l3.index, FormatCpuList(l3Cpus).c_str());
+                    for (const TopologyCore& core : l3.cores)
+                    {
+                        printf("        Core #%d: CPUs %s\n", core.index, FormatCpuList(core.cpus).c_str());
+                    }
+                }
+            }
+        }
+    }
+};
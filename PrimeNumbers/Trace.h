@@ -0,0 +1,309 @@
+#pragma once
+#include "Platform.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "common.h"
+
+// Phases a trace can label its rounds with; a round's phase is kept in a byte.
+const int MAX_TRACE_PHASES = 16;
+
+/// <summary>
+/// Per-round, per-thread work durations recorded from a real workload, replayed in
+/// place of the generated inputs. The file is text, one round per line:
+///
+///     # Comments and empty lines are skipped.
+///     mark: 120500 98000 143250 101000
+///     relocate: 40100 39800 52000 38750
+///     150000 149000 151000 152000
+///
+/// Each round lists one duration in nanoseconds per thread, and may start with a
+/// phase label ending in ':'. Every round has to list as many threads as the first.
+///
+/// The file is read twice, a line at a time: once to count the rounds, and once to
+/// write the durations, per thread, into a temporary file that is mapped. Each
+/// ThreadInput's input then points into the mapping, so the workers read it like
+/// the generated inputs, while only the pages in use need to be in memory.
+/// </summary>
+class work_trace
+{
+private:
+    FILE* backingFile;
+    void* mapping;
+    size_t mappingBytes;
+    ulong* durations;       // [column * roundCount + round]
+    uint8_t* roundPhases;   // [round], nullptr if no round is labeled.
+    int columnCount;
+    int roundCount;
+    std::vector<std::string> phaseNames;
+
+    // Reads the next line, of any length, without its line break. False at the end of the file.
+    static bool readLine(FILE* file, std::string* line)
+    {
+        char buffer[4096];
+        line->clear();
+        while (fgets(buffer, sizeof(buffer), file) != nullptr)
+        {
+            size_t length = strlen(buffer);
+            bool endOfLine = (length > 0) && (buffer[length - 1] == '\n');
+            line->append(buffer, endOfLine ? length - 1 : length);
+            if (endOfLine)
+            {
+                break;
+            }
+        }
+        if (!line->empty() && (line->back() == '\r'))
+        {
+            line->pop_back();
+        }
+        return !line->empty() || !feof(file);
+    }
+
+    /// <summary>
+    /// Splits a round into its label and durations. Returns false for lines that aren't
+    /// a round. With 'columnDurations' == nullptr, only counts the columns.
+    /// </summary>
+    static bool parseRound(const char* path, long lineNumber, const std::string& line, std::string* label, int* columns, ulong* columnDurations, int columnStride)
+    {
+        const char* position = line.c_str();
+        while ((*position == ' ') || (*position == '\t'))
+        {
+            position++;
+        }
+        if ((*position == '\0') || (*position == '#'))
+        {
+            return false;
+        }
+
+        label->clear();
+        const char* tokenEnd = position + strcspn(position, " \t");
+        if ((tokenEnd > position) && (tokenEnd[-1] == ':'))
+        {
+            label->assign(position, tokenEnd - 1);
+            position = tokenEnd;
+        }
+
+        *columns = 0;
+        for (;;)
+        {
+            while ((*position == ' ') || (*position == '\t') || (*position == ','))
+            {
+                position++;
+            }
+            if (*position == '\0')
+            {
+                break;
+            }
+            char* numberEnd;
+            unsigned long long duration = strtoull(position, &numberEnd, 10);
+            if ((numberEnd == position) || ((*numberEnd != '\0') && (strchr(" \t,", *numberEnd) == nullptr)))
+            {
+                printf("%s:%ld: '%.*s' is not a duration in nanoseconds.\n", path, lineNumber, (int)strcspn(position, " \t,"), position);
+                exit(1);
+            }
+            if (columnDurations != nullptr)
+            {
+                columnDurations[(size_t)*columns * columnStride] = (ulong)duration;
+            }
+            (*columns)++;
+            position = numberEnd;
+        }
+        if (*columns == 0)
+        {
+            printf("%s:%ld: round has no durations.\n", path, lineNumber);
+            exit(1);
+        }
+        return true;
+    }
+
+    int findPhase(const std::string& label)
+    {
+        for (size_t i = 0; i < phaseNames.size(); i++)
+        {
+            if (phaseNames[i] == label)
+            {
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+
+public:
+    work_trace() :
+        backingFile(nullptr),
+        mapping(nullptr),
+        mappingBytes(0),
+        durations(nullptr),
+        roundPhases(nullptr),
+        columnCount(0),
+        roundCount(0)
+    {
+    }
+
+    /// <summary>
+    /// Loads the first 'maxRounds' rounds of the trace at 'path', or all of them if
+    /// 'maxRounds' is 0. Exits on errors, like the argument parsing does.
+    /// </summary>
+    void load(const char* path, int maxRounds)
+    {
+        FILE* file = nullptr;
+#ifdef _WIN32
+        fopen_s(&file, path, "r");
+#else
+        file = fopen(path, "r");
+#endif // _WIN32
+        if (file == nullptr)
+        {
+            printf("Failed to open the trace '%s'. errno = %d\n", path, errno);
+            exit(1);
+        }
+
+        // First pass: the shape of the trace, and the phases.
+        std::string line, label;
+        bool anyLabel = false;
+        long lineNumber = 0;
+        while (((maxRounds == 0) || (roundCount < maxRounds)) && readLine(file, &line))
+        {
+            lineNumber++;
+            int columns;
+            if (!parseRound(path, lineNumber, line, &label, &columns, nullptr, 0))
+            {
+                continue;
+            }
+            if (roundCount == 0)
+            {
+                columnCount = columns;
+            }
+            else if (columns != columnCount)
+            {
+                printf("%s:%ld: round has %d durations, but the first round has %d.\n", path, lineNumber, columns, columnCount);
+                exit(1);
+            }
+            if (roundCount == INT_MAX)
+            {
+                printf("%s: more than %d rounds.\n", path, INT_MAX);
+                exit(1);
+            }
+            roundCount++;
+
+            anyLabel |= !label.empty();
+            if (findPhase(label) == -1)
+            {
+                if ((int)phaseNames.size() == MAX_TRACE_PHASES)
+                {
+                    printf("%s:%ld: more than %d phases.\n", path, lineNumber, MAX_TRACE_PHASES);
+                    exit(1);
+                }
+                phaseNames.push_back(label);
+            }
+        }
+        if (roundCount == 0)
+        {
+            printf("The trace '%s' has no rounds.\n", path);
+            exit(1);
+        }
+        if (!anyLabel)
+        {
+            phaseNames.clear();
+        }
+
+        size_t durationBytes = sizeof(ulong) * (size_t)columnCount * (size_t)roundCount;
+        mappingBytes = durationBytes + (anyLabel ? (size_t)roundCount : 0);
+        backingFile = CreateTemporaryFile();
+        mapping = (backingFile == nullptr) ? nullptr : MapFile(backingFile, mappingBytes);
+        if (mapping == nullptr)
+        {
+            printf("Failed to map %llu MB for the trace '%s'. GetLastError() = %u\n", (unsigned long long)(mappingBytes >> 20), path, GetLastError());
+            exit(1);
+        }
+        durations = (ulong*)mapping;
+        roundPhases = anyLabel ? (uint8_t*)mapping + durationBytes : nullptr;
+
+        // Second pass: the durations, column after column. Pipes can't be read twice.
+        if (fseek(file, 0, SEEK_SET) != 0)
+        {
+            printf("Failed to read the trace '%s' a second time, it has to be a regular file, not a pipe. errno = %d\n", path, errno);
+            exit(1);
+        }
+        lineNumber = 0;
+        for (int round = 0; round < roundCount; )
+        {
+            if (!readLine(file, &line))
+            {
+                printf("%s: ended after %d of %d rounds on the second read. Did it change?\n", path, round, roundCount);
+                exit(1);
+            }
+            lineNumber++;
+            int columns;
+            if (!parseRound(path, lineNumber, line, &label, &columns, &durations[round], roundCount))
+            {
+                continue;
+            }
+            if (roundPhases != nullptr)
+            {
+                roundPhases[round] = (uint8_t)findPhase(label);
+            }
+            round++;
+        }
+        fclose(file);
+    }
+
+    int getColumnCount() const
+    {
+        return columnCount;
+    }
+
+    int getRoundCount() const
+    {
+        return roundCount;
+    }
+
+    /// <summary>
+    /// The durations of all rounds of one column, in nanoseconds.
+    /// </summary>
+    ulong* getDurations(int column) const
+    {
+        return &durations[(size_t)column * roundCount];
+    }
+
+    const ulong* getAllDurations() const
+    {
+        return durations;
+    }
+
+    /// <summary>
+    /// The phase of every round, as an index into the names, or nullptr if the trace has no labels.
+    /// </summary>
+    const uint8_t* getRoundPhases() const
+    {
+        return roundPhases;
+    }
+
+    int getPhaseCount() const
+    {
+        return (int)phaseNames.size();
+    }
+
+    /// <returns>The label, or "(none)" for the rounds without one.</returns>
+    const char* getPhaseName(int phase) const
+    {
+        return phaseNames[phase].empty() ? "(none)" : phaseNames[phase].c_str();
+    }
+
+    ~work_trace()
+    {
+        if (mapping != nullptr)
+        {
+            UnmapFile(mapping, mappingBytes);
+        }
+        if (backingFile != nullptr)
+        {
+            fclose(backingFile);
+        }
+    }
+};
@@ -1,3 +1,4 @@
+#pragma once
 //
 // VolatileStore stores a T into the target of a pointer to T.  It is guaranteed that this store will
 // not be optimized away by the compiler, and that any operation that occurs before this store, in program
@@ -0,0 +1,445 @@
+#pragma once
+#include "Platform.h"
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "common.h"
+
+/// <summary>
+/// What ThreadWorker computes between two joins. Every kernel takes the input of a
+/// round as its amount of work, in its own unit, capped at what its heap holds.
+/// </summary>
+enum class workload_kind
+{
+    prime = 1,          // Smallest prime greater than the input, by trial division. ALU bound, no working set.
+    graph_mark = 2,     // Marks 'input' 64-byte objects of a random object graph. Latency bound, chases pointers.
+    compact = 3,        // Relocates 'input' live 256-byte objects into to-space with memcpy. Bandwidth bound, reads and writes.
+    bitmap_sweep = 4,   // Counts the live bits of 'input' KB of a mark bitmap. Bandwidth bound, streams reads.
+    busy_ns = 5,        // Computes for 'input' nanoseconds, calibrated. No working set.
+    busy_ticks = 6,     // Computes for 'input' TSC ticks, calibrated. No working set.
+};
+
+const int WORKLOAD_KIND_COUNT = 6;
+
+inline const char* get_workload_name(workload_kind kind)
+{
+    switch (kind)
+    {
+    case workload_kind::prime: return "prime";
+    case workload_kind::graph_mark: return "graph_mark";
+    case workload_kind::compact: return "compact";
+    case workload_kind::bitmap_sweep: return "bitmap_sweep";
+    case workload_kind::busy_ns: return "busy_ns";
+    case workload_kind::busy_ticks: return "busy_ticks";
+    }
+    return "unknown";
+}
+
+/// <summary>
+/// Given a number 'input', each thread finds smallest prime number greater than 'n'.
+/// If next prime number is beyond INT_MAX, it will return 0.
+/// </summary>
+/// <param name="n"></param>
+/// <returns></returns>
+inline ulong FindNextPrimeNumber(ulong input)
+{
+    // Start checking each number from input upto input * 2.
+    for (ulong i = input; i < input * 2; i++)
+    {
+        bool found = true;
+        for (ulong j = 2; j < i / 2; j++)
+        {
+            if (i % j == 0)
+            {
+                found = false;
+                break;
+            }
+        }
+
+        if (found)
+        {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/// <summary>
+/// One thread's instance of a workload kind. Created by the thread that runs it, once
+/// it is affinitized, so its heap is first touched, and therefore homed, on that
+/// thread's NUMA node.
+/// </summary>
+class workload
+{
+protected:
+    char* heap;
+    size_t heapBytes;
+
+    // xorshift64: cheap, and the same graph and bitmap for the same thread on every run.
+    static uint64_t nextRandom(uint64_t* state)
+    {
+        uint64_t x = *state;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        *state = x;
+        return x;
+    }
+
+    workload(size_t heapBytes) : heap(nullptr), heapBytes(heapBytes)
+    {
+        if (heapBytes != 0)
+        {
+            heap = (char*)AllocatePages(heapBytes);
+            if (heap == nullptr)
+            {
+                printf("Failed to allocate a %llu MB workload heap.\n", (unsigned long long)(heapBytes >> 20));
+                exit(1);
+            }
+        }
+    }
+
+public:
+    virtual ~workload()
+    {
+        if (heap != nullptr)
+        {
+            FreePages(heap, heapBytes);
+        }
+    }
+
+    /// <summary>
+    /// Does the work of one round. The result only keeps the compiler from discarding it.
+    /// </summary>
+    virtual ulong run(ulong input) = 0;
+
+    /// <summary>
+    /// How many TSC ticks run(input) is meant to take, so ThreadWorker can measure how
+    /// far off it was. 0 for the kernels whose duration only follows from their work.
+    /// </summary>
+    virtual uint64_t getRequestedTicks(ulong input)
+    {
+        UNREFERENCED_PARAMETER(input);
+        return 0;
+    }
+};
+
+class prime_workload final : public workload
+{
+public:
+    prime_workload() : workload(0)
+    {
+    }
+
+    virtual ulong run(ulong input)
+    {
+        return FindNextPrimeNumber(input);
+    }
+};
+
+/// <summary>
+/// Every object references two random others, as the objects the GC marks do, so
+/// the next address is only known once the current object was loaded. A round
+/// marks depth-first from the next unmarked root until 'input' objects are marked;
+/// marks are the round number, so nothing has to be cleared between rounds.
+/// </summary>
+class graph_mark_workload final : public workload
+{
+private:
+    struct heap_object
+    {
+        heap_object* refs[2];
+        uint64_t markEpoch;
+        uint64_t payload[5];
+    };
+
+    heap_object* objects;
+    size_t objectCount;
+    size_t nextRoot;
+    uint64_t epoch;
+    std::vector<heap_object*> markStack;
+
+public:
+    graph_mark_workload(size_t heapBytes, int threadId) : workload(heapBytes), nextRoot(0), epoch(0)
+    {
+        objects = (heap_object*)heap;
+        objectCount = heapBytes / sizeof(heap_object);
+        uint64_t random = 0x9E3779B97F4A7C15ull * (uint64_t)(threadId + 1);
+        for (size_t i = 0; i < objectCount; i++)
+        {
+            objects[i].refs[0] = &objects[nextRandom(&random) % objectCount];
+            objects[i].refs[1] = &objects[nextRandom(&random) % objectCount];
+            objects[i].markEpoch = 0;
+            objects[i].payload[0] = i;
+        }
+        markStack.reserve(1024);
+    }
+
+    virtual ulong run(ulong input)
+    {
+        size_t target = (input < objectCount) ? (size_t)input : objectCount;
+        size_t marked = 0;
+        ulong result = 0;
+        epoch++;
+        while (marked < target)
+        {
+            if (markStack.empty())
+            {
+                markStack.push_back(&objects[nextRoot]);
+                nextRoot = (nextRoot + 1) % objectCount;
+            }
+            heap_object* object = markStack.back();
+            markStack.pop_back();
+            if (object->markEpoch == epoch)
+            {
+                continue;
+            }
+            object->markEpoch = epoch;
+            marked++;
+            result += object->payload[0];
+            markStack.push_back(object->refs[0]);
+            markStack.push_back(object->refs[1]);
+        }
+        markStack.clear();
+        return result;
+    }
+};
+
+/// <summary>
+/// The heap is split into from-space and to-space. A round walks from-space, where
+/// every fourth object is dead, and copies the live ones next to each other into
+/// to-space; once from-space was walked through, the two swap.
+/// </summary>
+class compact_workload final : public workload
+{
+private:
+    static const size_t OBJECT_SIZE = 256;
+    static const size_t DEAD_EVERY = 4;
+
+    char* spaces[2];
+    size_t spaceObjects;
+    int fromSpace;
+    size_t source;
+    size_t destination;
+
+public:
+    compact_workload(size_t heapBytes) : workload(heapBytes), fromSpace(0), source(0), destination(0)
+    {
+        spaceObjects = heapBytes / 2 / OBJECT_SIZE;
+        spaces[0] = heap;
+        spaces[1] = heap + spaceObjects * OBJECT_SIZE;
+        memset(heap, 1, heapBytes);
+    }
+
+    virtual ulong run(ulong input)
+    {
+        size_t target = (input < spaceObjects) ? (size_t)input : spaceObjects;
+        ulong result = 0;
+        for (size_t moved = 0; moved < target; source++)
+        {
+            if (source == spaceObjects)
+            {
+                fromSpace = !fromSpace;
+                source = 0;
+                destination = 0;
+            }
+            if ((source % DEAD_EVERY) == (DEAD_EVERY - 1))
+            {
+                continue;
+            }
+
+            char* to = spaces[!fromSpace] + destination * OBJECT_SIZE;
+            memcpy(to, spaces[fromSpace] + source * OBJECT_SIZE, OBJECT_SIZE);
+            result += (unsigned char)to[0];
+            destination++;
+            moved++;
+        }
+        return result;
+    }
+};
+
+/// <summary>
+/// A round counts the set bits of the next 'input' KB of the bitmap, wrapping around
+/// at its end, the way the sweep finds the live objects of a region.
+/// </summary>
+class bitmap_sweep_workload final : public workload
+{
+private:
+    static const size_t WORDS_PER_KB = 1024 / sizeof(uint64_t);
+
+    uint64_t* bitmap;
+    size_t wordCount;
+    size_t cursor;
+
+    static __forceinline ulong popCount(uint64_t word)
+    {
+#ifdef _MSC_VER
+        return (ulong)__popcnt64(word);
+#else
+        return (ulong)__builtin_popcountll(word);
+#endif // _MSC_VER
+    }
+
+public:
+    bitmap_sweep_workload(size_t heapBytes, int threadId) : workload(heapBytes), cursor(0)
+    {
+        bitmap = (uint64_t*)heap;
+        wordCount = heapBytes / sizeof(uint64_t);
+        uint64_t random = 0xD1B54A32D192ED03ull * (uint64_t)(threadId + 1);
+        for (size_t i = 0; i < wordCount; i++)
+        {
+            bitmap[i] = nextRandom(&random);
+        }
+    }
+
+    virtual ulong run(ulong input)
+    {
+        size_t target = (input < wordCount / WORDS_PER_KB) ? (size_t)input * WORDS_PER_KB : wordCount;
+        ulong result = 0;
+        for (size_t i = 0; i < target; i++)
+        {
+            result += popCount(bitmap[cursor]);
+            if (++cursor == wordCount)
+            {
+                cursor = 0;
+            }
+        }
+        return result;
+    }
+};
+
+/// <summary>
+/// Computes until 'input' nanoseconds or ticks have passed. Finding a prime takes as
+/// long as the gap to the next one, which varies wildly between inputs of the same
+/// size; this one takes as long as it is asked to. It computes chunks of a dependent
+/// multiply-add chain and reads the TSC between them, and does the last partial
+/// chunk as the number of iterations that fit into what is left. How long an
+/// iteration takes is measured by the thread that runs it, once it is pinned, so it
+/// is calibrated for the core it runs on.
+/// </summary>
+class busy_workload final : public workload
+{
+private:
+    static const int CALIBRATION_TRIALS = 100;
+    static const int CALIBRATION_ITERATIONS = 1000;
+
+    // Ticks between two reads of the TSC. Long enough that reading it is a small part
+    // of a chunk, short enough that a chunk slower than calibrated (the core clocked
+    // down since) is far below 1% of a round of a few tens of microseconds.
+    static const uint64_t CHUNK_TICKS = 512;
+
+    double ticksPerUnit;
+    double ticksPerIteration;
+    uint64_t chunkIterations;
+    uint64_t overheadTicks;
+    uint64_t state;
+
+    __forceinline void compute(uint64_t iterations)
+    {
+        uint64_t x = state;
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            x = x * 6364136223846793005ull + 1442695040888963407ull;
+#ifndef _MSC_VER
+            // Keeps the compiler from folding the iterations together.
+            __asm__ volatile("" : "+r"(x));
+#endif // !_MSC_VER
+        }
+        state = x;
+    }
+
+    // rdtsc doesn't wait for the instructions before it, and a whole chunk of the chain
+    // fits into the reorder buffer, so without the fence it reads the time a chunk was
+    // issued rather than when it was done, and every round runs a chunk too long.
+    static __forceinline uint64_t readCounterAfterWork()
+    {
+        _mm_lfence();
+        return __rdtsc();
+    }
+
+    // Computes until 'ticks' passed, checking the TSC once a chunk.
+    void runTicks(uint64_t ticks)
+    {
+        uint64_t deadline = readCounterAfterWork() + ticks;
+        for (;;)
+        {
+            uint64_t now = readCounterAfterWork();
+            if (now >= deadline)
+            {
+                break;
+            }
+            uint64_t remaining = deadline - now;
+            if (remaining <= CHUNK_TICKS)
+            {
+                compute((uint64_t)(remaining / ticksPerIteration));
+                break;
+            }
+            compute(chunkIterations);
+        }
+    }
+
+public:
+    /// <param name="ticksPerUnit">TSC ticks per unit of the input.</param>
+    busy_workload(double ticksPerUnit) : workload(0), ticksPerUnit(ticksPerUnit), overheadTicks(0), state(1)
+    {
+        // The fastest trial is the one that was neither interrupted nor descheduled.
+        uint64_t fastestTrial = UINT64_MAX;
+        for (int trial = 0; trial < CALIBRATION_TRIALS; trial++)
+        {
+            uint64_t begin = readCounterAfterWork();
+            compute(CALIBRATION_ITERATIONS);
+            uint64_t ticks = readCounterAfterWork() - begin;
+            if (ticks < fastestTrial)
+            {
+                fastestTrial = ticks;
+            }
+        }
+        ticksPerIteration = (double)(fastestTrial == 0 ? 1 : fastestTrial) / CALIBRATION_ITERATIONS;
+        chunkIterations = (uint64_t)(CHUNK_TICKS / ticksPerIteration) + 1;
+
+        // What a round takes beyond the requested ticks no matter how long it is: the
+        // reads of the TSC and the fences, and the call, which the caller sees too.
+        uint64_t leastOvershoot = UINT64_MAX;
+        for (int trial = 0; trial < CALIBRATION_TRIALS; trial++)
+        {
+            uint64_t begin = readCounterAfterWork();
+            runTicks(4 * CHUNK_TICKS);
+            uint64_t ticks = readCounterAfterWork() - begin;
+            uint64_t overshoot = (ticks > 4 * CHUNK_TICKS) ? (ticks - 4 * CHUNK_TICKS) : 0;
+            if (overshoot < leastOvershoot)
+            {
+                leastOvershoot = overshoot;
+            }
+        }
+        overheadTicks = leastOvershoot;
+    }
+
+    virtual ulong run(ulong input)
+    {
+        uint64_t requestedTicks = getRequestedTicks(input);
+        runTicks((requestedTicks > overheadTicks) ? (requestedTicks - overheadTicks) : 0);
+        return (ulong)state;
+    }
+
+    virtual uint64_t getRequestedTicks(ulong input)
+    {
+        return (uint64_t)((double)input * ticksPerUnit);
+    }
+};
+
+/// <param name="heapBytes">Heap of the kernels that have one.</param>
+/// <param name="threadId">Seeds the random graph and bitmap, so every thread has its own.</param>
+/// <param name="ticksPerNanosecond">TSC frequency, for busy_ns.</param>
+inline workload* create_workload(workload_kind kind, size_t heapBytes, int threadId, double ticksPerNanosecond)
+{
+    switch (kind)
+    {
+    case workload_kind::prime: return new prime_workload();
+    case workload_kind::graph_mark: return new graph_mark_workload(heapBytes, threadId);
+    case workload_kind::compact: return new compact_workload(heapBytes);
+    case workload_kind::bitmap_sweep: return new bitmap_sweep_workload(heapBytes, threadId);
+    case workload_kind::busy_ns: return new busy_workload(ticksPerNanosecond);
+    case workload_kind::busy_ticks: return new busy_workload(1);
+    default: return nullptr;
+    }
+}
@@ -1,7 +1,7 @@
 #pragma once
 #include "EventImpl.h"
 
-#define PRINT_STATS(msg, ...) printf(msg ".\n", __VA_ARGS__);
+#define PRINT_STATS(msg, ...) printf(msg ".\n", ##__VA_ARGS__);
 //#define PRINT_THEAD_STATS(msg, ...) printf(msg ".\n", __VA_ARGS__);
 //#define PRINT_ONELINE_STATS(msg, ...) printf(msg "\n", __VA_ARGS__);
 
@@ -56,6 +56,16 @@
 #define PRINT_ONELINE_STATS(msg, ...)
 #endif // !PRINT_ONELINE_STATS
 
+#ifdef _WIN32
 typedef unsigned long long ulong;
+#else
+// glibc's <sys/types.h> already declares 'ulong' as 'unsigned long', which is
+// 64-bit on LP64 and therefore equivalent to the Windows definition above.
+#include <sys/types.h>
+static_assert(sizeof(ulong) == 8, "ulong is expected to be 64-bit");
+#endif // _WIN32
 
-const int SPIN_COUNT = 128 * 1000;
\ No newline at end of file
+const int SPIN_COUNT = 128 * 1000;
+
+// Matches the GC's HS_CACHE_LINE_SIZE; two lines to also defeat the adjacent-line prefetcher.
+const size_t HS_CACHE_LINE_SIZE = 128;
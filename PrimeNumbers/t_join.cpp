@@ -1,20 +1,27 @@
-#include <intrin.h>
+#include "Platform.h"
+#include <algorithm>
+#include <limits.h>
+#include <vector>
 #include "common.h"
 #include "t_join.h"
 
-ulong t_join_pause::join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime)
+ulong t_join_pause_adaptive::join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime)
 {
     ulong totalIterations = 0;
     *wasHardWait = false;
     int color = join_struct.lock_color.LoadWithoutBarrier();
-    if (_InterlockedDecrement((long*)&join_struct.join_lock) != 0)
+    int stillRunning = Interlocked::Decrement(&join_struct.join_lock);
+    if (stillRunning != 0)
     {
+        anticipateRelease(color, stillRunning);
         if (color == join_struct.lock_color.LoadWithoutBarrier())
         {
+            adaptive_spin_state& state = spinStates[threadId];
+            const int spinCount = state.spinCount;
             *spinLoopStartTime = GetCounter();
 respin:
             int j = 0;
-            for (; j < SPIN_COUNT; j++)
+            for (; j < spinCount; j++)
             {
                 if (color != join_struct.lock_color.LoadWithoutBarrier())
                 {
@@ -26,12 +33,14 @@ respin:
                 YieldProcessor();
             }
 
-            if (j == SPIN_COUNT)
+            if (j == spinCount)
             {
-                totalIterations += SPIN_COUNT;
+                totalIterations += spinCount;
             }
 
             HARD_WAIT();
+
+            adaptSpinCount(state, totalIterations, *wasHardWait, *spinLoopStartTime, *spinLoopStopTime);
         }
     }
     else
@@ -41,54 +50,153 @@ respin:
     return totalIterations;
 }
 
-ulong t_join_mwaitx_noloop::join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime)
+void t_join_pause_adaptive::adaptSpinCount(adaptive_spin_state& state, ulong iterations, bool wasHardWait, unsigned __int64 spinLoopStartTime, unsigned __int64 spinLoopStopTime)
 {
-    ulong totalIterations = 0;
-    *wasHardWait = false;
-    int color = join_struct.lock_color.LoadWithoutBarrier();
-    if (_InterlockedDecrement((long*)&join_struct.join_lock) != 0)
+    if ((iterations > 0) && (spinLoopStopTime > spinLoopStartTime))
     {
-        if (color == join_struct.lock_color.LoadWithoutBarrier())
+        double ticksPerIteration = (double)(spinLoopStopTime - spinLoopStartTime) / iterations;
+        state.ticksPerIteration = (state.ticksPerIteration == 0) ? ticksPerIteration : ((state.ticksPerIteration * 7 + ticksPerIteration) / 8);
+    }
+
+    int spinCount = state.spinCount;
+    if (!wasHardWait)
+    {
+        // The color flipped while spinning. Keep 2x headroom over what this join
+        // needed, and move there slowly so one quick join doesn't collapse the budget.
+        ulong target = std::min((ulong)MAX_SPIN_COUNT, iterations * 2);
+        spinCount = (int)((spinCount * 7 + target) / 8);
+    }
+    else if (state.ticksPerIteration > 0)
+    {
+        // The color flipped at restartStartTime, after we gave up spinning at spinLoopStopTime.
+        // If spinning at most twice as long would have caught it, we barely missed: grow.
+        // Otherwise the spin was wasted: shrink.
+        unsigned __int64 restartTime = join_struct.restartStartTime;
+        unsigned __int64 missTicks = (restartTime > spinLoopStopTime) ? (restartTime - spinLoopStopTime) : 0;
+        double missIterations = missTicks / state.ticksPerIteration;
+        if (missIterations <= spinCount)
         {
-            *spinLoopStartTime = GetCounter();
-respin:
-            _mm_monitorx((const void*)&join_struct.lock_color, 0, 0);
-            _mm_mwaitx(2, 0, mwaitx_cycles);
-            totalIterations += 1;
+            spinCount *= 2;
+            state.growCount++;
+        }
+        else
+        {
+            spinCount /= 2;
+            state.shrinkCount++;
+        }
+    }
 
-            HARD_WAIT();
+    state.spinCount = std::max(MIN_SPIN_COUNT, std::min(MAX_SPIN_COUNT, spinCount));
+}
+
+void t_join_pause_adaptive::printStats()
+{
+    int minSpinCount = INT_MAX, maxSpinCount = 0, totalGrows = 0, totalShrinks = 0;
+    ulong totalSpinCount = 0;
+    for (int i = 0; i < threadCount; i++)
+    {
+        minSpinCount = std::min(minSpinCount, spinStates[i].spinCount);
+        maxSpinCount = std::max(maxSpinCount, spinStates[i].spinCount);
+        totalSpinCount += spinStates[i].spinCount;
+        totalGrows += spinStates[i].growCount;
+        totalShrinks += spinStates[i].shrinkCount;
+    }
+    PRINT_STATS("Adaptive spin count         : Min: %d, Avg: %llu, Max: %d, Grown: %d, Shrunk: %d (initial %d)", minSpinCount, (unsigned long long)(totalSpinCount / threadCount), maxSpinCount, totalGrows, totalShrinks, SPIN_COUNT);
+}
+
+t_join_combining_tree::t_join_combining_tree(int numThreads, int fan_in, join_layout layout, hard_wait_kind hardWaitKind) : t_join(numThreads, layout, hardWaitKind), fanIn(fan_in)
+{
+    assert(fanIn >= 2);
+
+    // Build the tree level by level: level 0 has one leaf per group of fanIn threads,
+    // every following level one node per group of fanIn nodes of the level below.
+    std::vector<int> levelStart;
+    std::vector<int> arrivals;
+    int levelSize = (numThreads + fanIn - 1) / fanIn;
+    for (int i = 0; i < levelSize; i++)
+    {
+        arrivals.push_back(std::min(fanIn, numThreads - i * fanIn));
+    }
+    levelStart.push_back(0);
+    while (levelSize > 1)
+    {
+        int childCount = levelSize;
+        levelSize = (childCount + fanIn - 1) / fanIn;
+        levelStart.push_back((int)arrivals.size());
+        for (int i = 0; i < levelSize; i++)
+        {
+            arrivals.push_back(std::min(fanIn, childCount - i * fanIn));
         }
     }
-    else
+    assert(levelStart.size() <= MAX_TREE_DEPTH);
+
+    nodeCount = (int)arrivals.size();
+    nodes = new tree_node[nodeCount];
+    for (int level = 0; level < (int)levelStart.size(); level++)
     {
-        RESET_HARD_WAIT();
+        int levelEnd = (level + 1 < (int)levelStart.size()) ? levelStart[level + 1] : nodeCount;
+        for (int i = levelStart[level]; i < levelEnd; i++)
+        {
+            nodes[i].arrivals = arrivals[i];
+            nodes[i].count = arrivals[i];
+            nodes[i].released = 0;
+            nodes[i].parent = (levelEnd == nodeCount) ? -1 : (levelEnd + (i - levelStart[level]) / fanIn);
+        }
+    }
+
+    paths = new tree_path[numThreads];
+    for (int i = 0; i < numThreads; i++)
+    {
+        paths[i].depth = 0;
+        paths[i].wonLevels = 0;
+        paths[i].joinCount = 0;
+        for (int node = i / fanIn; node != -1; node = nodes[node].parent)
+        {
+            paths[i].nodes[paths[i].depth++] = node;
+        }
     }
-    return totalIterations;
 }
 
-ulong t_join_mwaitx_loop::join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime)
+ulong t_join_combining_tree::join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime)
 {
     ulong totalIterations = 0;
     *wasHardWait = false;
     int color = join_struct.lock_color.LoadWithoutBarrier();
-    if (_InterlockedDecrement((long*)&join_struct.join_lock) != 0)
+    tree_path& path = paths[threadId];
+    LONGLONG joinCount = ++path.joinCount;
+
+    int level = 0;
+    for (; level < path.depth; level++)
     {
-        if (color == join_struct.lock_color.LoadWithoutBarrier())
+        tree_node& node = nodes[path.nodes[level]];
+        if (Interlocked::Decrement(&node.count) != 0)
+        {
+            break;
+        }
+
+        // Everyone arrived here, and nobody arrives again before the join completes.
+        node.count = node.arrivals;
+    }
+    path.wonLevels = level;
+
+    if (level < path.depth)
+    {
+        tree_node& node = nodes[path.nodes[level]];
+        if (node.released.LoadWithoutBarrier() < joinCount)
         {
             *spinLoopStartTime = GetCounter();
 respin:
             int j = 0;
             for (; j < SPIN_COUNT; j++)
             {
-                _mm_monitorx((const void*)&join_struct.lock_color, 0, 0);
-                if (color != join_struct.lock_color.LoadWithoutBarrier())
+                if (node.released.LoadWithoutBarrier() >= joinCount)
                 {
                     totalIterations += j;
 
                     PRINT_SOFT_WAIT("%d. %llu iterations.", threadId, inputIndex, totalIterations);
                     break;
                 }
-                _mm_mwaitx(2, 0, mwaitx_cycles);
+                YieldProcessor();
             }
 
             if (j == SPIN_COUNT)
@@ -96,71 +204,215 @@ respin:
                 totalIterations += SPIN_COUNT;
             }
 
+            // Nodes are only released after the color changed, so checking the color
+            // here also covers a thread that was released through its node.
             HARD_WAIT();
         }
+
+        releasePath(path);
     }
     else
     {
+        // Our nodes are released by restart(), once the color changed.
         RESET_HARD_WAIT();
     }
     return totalIterations;
 }
 
-ulong t_join_hard_wait_only::join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime)
+void t_join_combining_tree::printStats()
+{
+    PRINT_STATS("Combining tree              : Fan-in: %d, Nodes: %d, Depth: %d", fanIn, nodeCount, paths[0].depth);
+}
+
+t_join_dissemination::t_join_dissemination(int numThreads, join_layout layout, hard_wait_kind hardWaitKind) : t_join(numThreads, layout, hardWaitKind), threadCount(numThreads)
+{
+    roundCount = 0;
+    while ((1 << roundCount) < numThreads)
+    {
+        roundCount++;
+    }
+    assert(roundCount <= MAX_ROUNDS);
+
+    states = new dissemination_state[numThreads];
+    for (int i = 0; i < numThreads; i++)
+    {
+        for (int parity = 0; parity < 2; parity++)
+        {
+            for (int round = 0; round < MAX_ROUNDS; round++)
+            {
+                states[i].flags[parity][round].joinCount = 0;
+                states[i].flags[parity][round].arrivalTime = 0;
+            }
+        }
+        states[i].sleeping = 0;
+        states[i].wakeEvent.CreateAutoEvent(false);
+        states[i].joinCount = 0;
+        states[i].restartStartTime = 0;
+    }
+}
+
+void t_join_dissemination::signal(dissemination_state& partner, int parity, int round, LONGLONG joinCount, unsigned __int64 arrivalTime)
+{
+    round_flag& flag = partner.flags[parity][round];
+    flag.arrivalTime = arrivalTime;
+    flag.joinCount = joinCount;
+
+    // Pairs with the barrier in join() between announcing that we sleep and checking
+    // the flag one last time: either the partner sees the flag or we see it sleeping.
+    MemoryBarrier();
+    if (partner.sleeping.LoadWithoutBarrier() != 0)
+    {
+        partner.wakeEvent.Set();
+    }
+}
+
+ulong t_join_dissemination::join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime)
 {
     ulong totalIterations = 0;
     *wasHardWait = false;
-    int color = join_struct.lock_color.LoadWithoutBarrier();
-    if (_InterlockedDecrement((long*)&join_struct.join_lock) != 0)
+    dissemination_state& state = states[threadId];
+    LONGLONG joinCount = ++state.joinCount;
+    int parity = (int)(joinCount & 1);
+    unsigned __int64 lastArrivalTime = GetCounter();
+    bool spinning = false;
+
+    for (int round = 0; round < roundCount; round++)
     {
-        if (color == join_struct.lock_color.LoadWithoutBarrier())
+        signal(states[(threadId + (1 << round)) % threadCount], parity, round, joinCount, lastArrivalTime);
+
+        round_flag& flag = state.flags[parity][round];
+        if (flag.joinCount.LoadWithoutBarrier() < joinCount)
         {
-            *spinLoopStartTime = GetCounter();
-respin:
+            if (!spinning && !*wasHardWait)
+            {
+                *spinLoopStartTime = GetCounter();
+                spinning = true;
+            }
 
-            HARD_WAIT();
+            for (; totalIterations < SPIN_COUNT; totalIterations++)
+            {
+                if (flag.joinCount.LoadWithoutBarrier() >= joinCount)
+                {
+                    break;
+                }
+                YieldProcessor();
+            }
+
+            if (flag.joinCount.LoadWithoutBarrier() < joinCount)
+            {
+                if (!*wasHardWait)
+                {
+                    *spinLoopStopTime = GetCounter();
+                    spinning = false;
+                    PRINT_HARD_WAIT("%d. %llu iterations.", threadId, inputIndex, totalIterations);
+                    *wasHardWait = true;
+                }
+
+                state.sleeping = 1;
+                MemoryBarrier();
+                while (flag.joinCount.LoadWithoutBarrier() < joinCount)
+                {
+                    uint32_t dwJoinWait = state.wakeEvent.Wait(INFINITE, FALSE);
+                    if (dwJoinWait != WAIT_OBJECT_0)
+                    {
+                        printf("Fatal error");
+                        exit(1);
+                    }
+                }
+                state.sleeping = 0;
+            }
         }
+
+        lastArrivalTime = std::max(lastArrivalTime, flag.arrivalTime);
     }
-    else
+
+    if (spinning)
     {
-        RESET_HARD_WAIT();
+        *spinLoopStopTime = GetCounter();
+        PRINT_SOFT_WAIT("%d. %llu iterations.", threadId, inputIndex, totalIterations);
     }
+    state.restartStartTime = lastArrivalTime;
     return totalIterations;
 }
 
-ulong t_join_pause_soft_wait_only::join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime)
+void t_join_dissemination::printStats()
+{
+    PRINT_STATS("Dissemination barrier       : Rounds: %d", roundCount);
+}
+
+t_join_local_spin::t_join_local_spin(int numThreads, const std::vector<std::vector<int>>& releaseOrders, join_layout layout, hard_wait_kind hardWaitKind) :
+    t_join(numThreads, layout, hardWaitKind),
+    releaseOrders(releaseOrders),
+    threadCount(numThreads)
+{
+    if (this->releaseOrders.empty())
+    {
+        this->releaseOrders.resize(numThreads);
+        for (int i = 0; i < numThreads; i++)
+        {
+            for (int j = 0; j < numThreads; j++)
+            {
+                if (j != i)
+                {
+                    this->releaseOrders[i].push_back(j);
+                }
+            }
+        }
+    }
+    assert((int)this->releaseOrders.size() == numThreads);
+
+    flags = new local_flag[numThreads];
+    for (int i = 0; i < numThreads; i++)
+    {
+        flags[i].color = 0;
+        flags[i].sleeping = 0;
+        flags[i].wakeEvent.CreateAutoEvent(false);
+    }
+}
+
+ulong t_join_local_spin::join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime)
 {
     ulong totalIterations = 0;
     *wasHardWait = false;
     int color = join_struct.lock_color.LoadWithoutBarrier();
-    if (_InterlockedDecrement((long*)&join_struct.join_lock) != 0)
+    if (Interlocked::Decrement(&join_struct.join_lock) != 0)
     {
-        if (color == join_struct.lock_color.LoadWithoutBarrier())
+        local_flag& flag = flags[threadId];
+        if (color == flag.color.LoadWithoutBarrier())
         {
             *spinLoopStartTime = GetCounter();
-respin:
             int j = 0;
             for (; j < SPIN_COUNT; j++)
             {
-                if (color != join_struct.lock_color.LoadWithoutBarrier())
+                if (color != flag.color.LoadWithoutBarrier())
                 {
-                    totalIterations += j;
-
-                    PRINT_SOFT_WAIT("%d. %llu iterations.", threadId, inputIndex, totalIterations);
+                    PRINT_SOFT_WAIT("%d. %llu iterations.", threadId, inputIndex, (ulong)j);
                     break;
                 }
-                YieldProcessor();           // indicate to the processor that we are spinning
+                YieldProcessor();
             }
+            totalIterations += j;
+            *spinLoopStopTime = GetCounter();
 
-            if (j == SPIN_COUNT)
+            if (color == flag.color.LoadWithoutBarrier())
             {
-                totalIterations += SPIN_COUNT;
-            }
+                PRINT_HARD_WAIT("%d. %llu iterations.", threadId, inputIndex, totalIterations);
+                *wasHardWait = true;
 
-            // avoid race due to the thread about to reset the event (occasionally) being preempted before ResetEvent()
-            if (color == join_struct.lock_color.LoadWithoutBarrier())
-            {
-                goto respin;
+                // Pairs with the barrier in restart() between writing the flags and
+                // checking who sleeps: either it sees us asleep or we see our flag.
+                flag.sleeping = 1;
+                MemoryBarrier();
+                while (color == flag.color.LoadWithoutBarrier())
+                {
+                    uint32_t dwJoinWait = flag.wakeEvent.Wait(INFINITE, FALSE);
+                    if (dwJoinWait != WAIT_OBJECT_0)
+                    {
+                        printf("Fatal error");
+                        exit(1);
+                    }
+                }
+                flag.sleeping = 0;
             }
         }
     }
@@ -173,29 +425,99 @@ respin:
     return totalIterations;
 }
 
-ulong t_join_mwaitx_loop_soft_wait_only::join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime)
+void t_join_local_spin::restart(int threadId, int numberIndex, bool isLastIteration)
+{
+    UNREFERENCED_PARAMETER(numberIndex);
+    join_struct.joined_p = false;
+    join_struct.join_lock = join_struct.n_threads;
+    int color = join_struct.lock_color.LoadWithoutBarrier();
+
+    recordRestartStartTime();
+    join_struct.lock_color = !color;
+
+    // Spinning waiters first, then the syscalls for the ones that went to sleep.
+    const std::vector<int>& order = releaseOrders[threadId];
+    for (int i : order)
+    {
+        flags[i].color = !color;
+    }
+    // Our own flag too, so it is current when we wait in a later join.
+    flags[threadId].color = !color;
+
+    MemoryBarrier();
+    for (int i : order)
+    {
+        if (flags[i].sleeping.LoadWithoutBarrier() != 0)
+        {
+            flags[i].wakeEvent.Set();
+        }
+    }
+
+    if (isLastIteration)
+    {
+        signalCompletion();
+    }
+}
+
+t_join_two_level::t_join_two_level(int numThreads, const std::vector<int>& threadDomains, join_layout layout, hard_wait_kind hardWaitKind) :
+    t_join(numThreads, layout, hardWaitKind),
+    threadDomains(threadDomains)
+{
+    assert((int)threadDomains.size() == numThreads);
+    domainCount = *std::max_element(threadDomains.begin(), threadDomains.end()) + 1;
+
+    domains = new join_domain[domainCount];
+    for (int i = 0; i < domainCount; i++)
+    {
+        domains[i].arrivals = 0;
+        domains[i].color = 0;
+    }
+    for (int domain : threadDomains)
+    {
+        domains[domain].arrivals++;
+    }
+    for (int i = 0; i < domainCount; i++)
+    {
+        assert(domains[i].arrivals > 0);
+        domains[i].count = domains[i].arrivals;
+    }
+
+    // Only the domain leaders arrive at join_lock.
+    join_struct.n_threads = domainCount;
+    join_struct.join_lock = domainCount;
+}
+
+ulong t_join_two_level::join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime)
 {
     ulong totalIterations = 0;
     *wasHardWait = false;
-    int color = join_struct.lock_color.LoadWithoutBarrier();
-    if (_InterlockedDecrement((long*)&join_struct.join_lock) != 0)
+    join_domain& domain = domains[threadDomains[threadId]];
+    int color = domain.color.LoadWithoutBarrier();
+
+    bool isLeader = (Interlocked::Decrement(&domain.count) == 0);
+    if (isLeader)
     {
-        if (color == join_struct.lock_color.LoadWithoutBarrier())
+        // Everyone in the domain arrived, and nobody arrives again before the join completes.
+        domain.count = domain.arrivals;
+    }
+
+    if (!isLeader || (Interlocked::Decrement(&join_struct.join_lock) != 0))
+    {
+        if (color == domain.color.LoadWithoutBarrier())
         {
             *spinLoopStartTime = GetCounter();
 respin:
             int j = 0;
             for (; j < SPIN_COUNT; j++)
             {
-                _mm_monitorx((const void*)&join_struct.lock_color, 0, 0);
-                if (color != join_struct.lock_color.LoadWithoutBarrier())
+                if (color != domain.color.LoadWithoutBarrier())
                 {
                     totalIterations += j;
 
                     PRINT_SOFT_WAIT("%d. %llu iterations.", threadId, inputIndex, totalIterations);
                     break;
                 }
-                _mm_mwaitx(2, 0, mwaitx_cycles);
+                YieldProcessor();
             }
 
             if (j == SPIN_COUNT)
@@ -203,48 +525,223 @@ respin:
                 totalIterations += SPIN_COUNT;
             }
 
-            // avoid race due to the thread about to reset the event (occasionally) being preempted before ResetEvent()
-            if (color == join_struct.lock_color.LoadWithoutBarrier())
+            // Unlike HARD_WAIT(), only leave once our replica changed, even if lock_color
+            // already did: the next join starts from the replica, so it has to be current.
+            *spinLoopStopTime = GetCounter();
+            if (color == domain.color.LoadWithoutBarrier())
             {
+                if (color == join_struct.lock_color.LoadWithoutBarrier())
+                {
+                    PRINT_HARD_WAIT("%d. %llu iterations.", threadId, inputIndex, totalIterations);
+                    *wasHardWait = true;
+                    uint32_t dwJoinWait = hardWait->wait(color);
+
+                    if (dwJoinWait != WAIT_OBJECT_0)
+                    {
+                        printf("Fatal error");
+                        exit(1);
+                    }
+                }
                 goto respin;
             }
         }
     }
     else
     {
-        PRINT_RELEASE("%d", threadId, inputIndex);
-        PRINT_RELEASE("---------------\n", threadId);
-        join_struct.joined_p = true;
+        RESET_HARD_WAIT();
     }
     return totalIterations;
 }
 
-ulong t_join_mwaitx_noloop_soft_wait_only::join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime)
+void t_join_two_level::restart(int threadId, int numberIndex, bool isLastIteration)
+{
+    UNREFERENCED_PARAMETER(numberIndex);
+    join_struct.joined_p = false;
+    join_struct.join_lock = join_struct.n_threads;
+    int color = join_struct.lock_color.LoadWithoutBarrier();
+
+    recordRestartStartTime();
+    join_struct.lock_color = !color;
+
+    // Our own domain first, it is the cheapest to reach.
+    int ownDomain = threadDomains[threadId];
+    domains[ownDomain].color = !color;
+    for (int i = 0; i < domainCount; i++)
+    {
+        if (i != ownDomain)
+        {
+            domains[i].color = !color;
+        }
+    }
+    hardWait->wake(color);
+
+    if (isLastIteration)
+    {
+        signalCompletion();
+    }
+}
+
+void t_join_two_level::printStats()
+{
+    int minArrivals = INT_MAX, maxArrivals = 0;
+    for (int i = 0; i < domainCount; i++)
+    {
+        minArrivals = std::min(minArrivals, domains[i].arrivals);
+        maxArrivals = std::max(maxArrivals, domains[i].arrivals);
+    }
+    PRINT_STATS("Two-level join              : Domains: %d, Threads per domain: Min: %d, Max: %d", domainCount, minArrivals, maxArrivals);
+}
+
+t_join_predictive::t_join_predictive(int numThreads, unsigned __int64 spinThresholdTicks, unsigned __int64 blockThresholdTicks, unsigned __int64 earlyWakeTicks, join_layout layout, hard_wait_kind hardWaitKind) :
+    t_join(numThreads, layout, hardWaitKind),
+    threadCount(numThreads),
+    spinThresholdTicks(spinThresholdTicks),
+    blockThresholdTicks(blockThresholdTicks),
+    earlyWakeTicks(earlyWakeTicks)
+{
+    assert(spinThresholdTicks <= blockThresholdTicks);
+    estimate.predictedRoundTicks = 0;
+    estimate.rounds = 0;
+
+    states = new predictive_state[numThreads];
+    for (int i = 0; i < numThreads; i++)
+    {
+        for (int decision = 0; decision < decision_count; decision++)
+        {
+            states[i].decisions[decision] = 0;
+        }
+        states[i].spunInVain = 0;
+        states[i].blockedNeedlessly = 0;
+    }
+}
+
+bool t_join_predictive::predictWait(unsigned __int64 arrivalTime, unsigned __int64* predictedWait)
+{
+    // Until the first restart there is neither a round to predict from nor a start to measure from.
+    unsigned __int64 roundStartTime = join_struct.restartStartTime;
+    if ((roundStartTime == 0) || (estimate.rounds == 0) || (arrivalTime <= roundStartTime))
+    {
+        return false;
+    }
+
+    // The time our own input took counts against the round: the cheaper it was, the longer we wait.
+    unsigned __int64 elapsed = arrivalTime - roundStartTime;
+    unsigned __int64 predictedRoundTicks = estimate.predictedRoundTicks;
+    *predictedWait = (predictedRoundTicks > elapsed) ? (predictedRoundTicks - elapsed) : 0;
+    return true;
+}
+
+t_join_predictive::wait_decision t_join_predictive::decide(unsigned __int64 predictedWait)
+{
+    if (predictedWait <= spinThresholdTicks)
+    {
+        return spin_full;
+    }
+    return (predictedWait <= blockThresholdTicks) ? spin_briefly : block_now;
+}
+
+void t_join_predictive::recordRound(unsigned __int64 arrivalTime)
+{
+    unsigned __int64 roundStartTime = join_struct.restartStartTime;
+    if ((roundStartTime == 0) || (arrivalTime <= roundStartTime))
+    {
+        return;
+    }
+
+    // Weighted 1/4 so one odd round doesn't flip every waiter of the next one.
+    unsigned __int64 roundTicks = arrivalTime - roundStartTime;
+    unsigned __int64 predictedRoundTicks = estimate.predictedRoundTicks;
+    estimate.predictedRoundTicks = (estimate.rounds == 0) ? roundTicks : ((predictedRoundTicks * 3 + roundTicks) / 4);
+    estimate.rounds++;
+}
+
+ulong t_join_predictive::join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime)
 {
     ulong totalIterations = 0;
     *wasHardWait = false;
     int color = join_struct.lock_color.LoadWithoutBarrier();
-    if (_InterlockedDecrement((long*)&join_struct.join_lock) != 0)
+    int stillRunning = Interlocked::Decrement(&join_struct.join_lock);
+    if (stillRunning != 0)
     {
+        anticipateRelease(color, stillRunning);
         if (color == join_struct.lock_color.LoadWithoutBarrier())
         {
+            predictive_state& state = states[threadId];
             *spinLoopStartTime = GetCounter();
+            unsigned __int64 predictedWait = 0;
+            bool predicted = predictWait(*spinLoopStartTime, &predictedWait);
+            if (predicted && (earlyWakeTicks != 0) && (predictedWait <= earlyWakeTicks))
+            {
+                hardWait->wakeEarly(color);
+            }
+            wait_decision decision = predicted ? decide(predictedWait) : spin_full;
+            state.decisions[decision]++;
+
+            int spinCount = (decision == block_now) ? 0 : SPIN_COUNT;
+            unsigned __int64 deadline = (decision == spin_briefly) ? (*spinLoopStartTime + spinThresholdTicks) : ULLONG_MAX;
 respin:
-            _mm_monitorx((const void*)&join_struct.lock_color, 0, 0);
-            _mm_mwaitx(2, 0, mwaitx_cycles);
+            if (*wasHardWait)
+            {
+                // Woken while the color didn't change, most likely early: spin until it does.
+                spinCount = SPIN_COUNT;
+                deadline = ULLONG_MAX;
+            }
+            int j = 0;
+            for (; j < spinCount; j++)
+            {
+                if (color != join_struct.lock_color.LoadWithoutBarrier())
+                {
+                    PRINT_SOFT_WAIT("%d. %llu iterations.", threadId, inputIndex, totalIterations + j);
+                    break;
+                }
+                if (__rdtsc() >= deadline)
+                {
+                    break;
+                }
+                YieldProcessor();
+            }
+            totalIterations += j;
 
-            // avoid race due to the thread about to reset the event (occasionally) being preempted before ResetEvent()
-            if (color == join_struct.lock_color.LoadWithoutBarrier())
+            HARD_WAIT();
+
+            if (*wasHardWait)
             {
-                goto respin;
+                unsigned __int64 restartTime = join_struct.restartStartTime;
+                if (decision == spin_full)
+                {
+                    state.spunInVain++;
+                }
+                else if ((decision == block_now) && (restartTime <= *spinLoopStartTime + spinThresholdTicks))
+                {
+                    state.blockedNeedlessly++;
+                }
             }
         }
     }
     else
     {
-        PRINT_RELEASE("%d", threadId, inputIndex);
-        PRINT_RELEASE("---------------\n", threadId);
-        join_struct.joined_p = true;
+        // Before restart() moves restartStartTime on, which is what the round is measured from.
+        recordRound(GetCounter());
+        RESET_HARD_WAIT();
     }
     return totalIterations;
-}
\ No newline at end of file
+}
+
+void t_join_predictive::printStats()
+{
+    ulong decisions[decision_count] = {}, spunInVain = 0, blockedNeedlessly = 0;
+    for (int i = 0; i < threadCount; i++)
+    {
+        for (int decision = 0; decision < decision_count; decision++)
+        {
+            decisions[decision] += states[i].decisions[decision];
+        }
+        spunInVain += states[i].spunInVain;
+        blockedNeedlessly += states[i].blockedNeedlessly;
+    }
+    PRINT_STATS("Straggler prediction        : Thresholds: spin <= %llu ticks, block > %llu ticks, Predicted round: %llu ticks (%llu rounds)",
+        (unsigned long long)spinThresholdTicks, (unsigned long long)blockThresholdTicks, (unsigned long long)estimate.predictedRoundTicks, (unsigned long long)estimate.rounds);
+    PRINT_STATS("Straggler prediction        : Spin: %llu (%llu still hard-waited), Spin briefly: %llu, Block at once: %llu (%llu released within the spin threshold)",
+        (unsigned long long)decisions[spin_full], (unsigned long long)spunInVain, (unsigned long long)decisions[spin_briefly],
+        (unsigned long long)decisions[block_now], (unsigned long long)blockedNeedlessly);
+}
@@ -1,19 +1,148 @@
 #pragma once
-#include <windows.h>
+#include "Platform.h"
 #include <chrono>
+#include <new>
+#include <vector>
 #include "common.h"
+#include "HardWait.h"
 #include "Volatile.h"
 
+/// <summary>
+/// How the fields of join_structure are spread over cache lines.
+/// </summary>
+enum class join_layout
+{
+    packed = 1,             // Every field on one line, which is where they end up without padding.
+    split_counter = 2,      // join_lock on its own line, so arrivals don't invalidate the line waiters spin on.
+    isolated_color = 3,     // lock_color alone on one line, join_lock alone on another, the rest on a third.
+    padded = 4,             // Every field that is written during a join on its own line.
+};
+
+const int JOIN_LAYOUT_COUNT = 4;
+
+inline const char* get_join_layout_name(join_layout layout)
+{
+    switch (layout)
+    {
+    case join_layout::packed: return "packed";
+    case join_layout::split_counter: return "split_counter";
+    case join_layout::isolated_color: return "isolated_color";
+    case join_layout::padded: return "padded";
+    }
+    return "unknown";
+}
+
 struct join_structure
 {
-    // Shared non volatile keep on separate line to prevent eviction
+private:
+    static const int MAX_LINES = 5;
+
+    struct field_pointers
+    {
+        char* storage;
+        EventImpl* joined_event;
+        Volatile<int>* lock_color;
+        Volatile<bool>* wait_done;
+        Volatile<bool>* joined_p;
+        Volatile<int>* join_lock;
+        unsigned __int64* restartStartTime;
+    };
+
+    // Bump allocator over MAX_LINES cache lines of a single aligned block.
+    struct line_allocator
+    {
+        char* storage;
+        size_t used[MAX_LINES];
+
+        template<typename T>
+        T* place(int line, int count = 1)
+        {
+            assert(line < MAX_LINES);
+            size_t offset = (used[line] + alignof(T) - 1) & ~(alignof(T) - 1);
+            used[line] = offset + sizeof(T) * count;
+            assert(used[line] <= HS_CACHE_LINE_SIZE);
+            T* result = (T*)(storage + line * HS_CACHE_LINE_SIZE + offset);
+            for (int i = 0; i < count; i++)
+            {
+                new ((void*)(result + i)) T();
+            }
+            return result;
+        }
+    };
+
+    static field_pointers place_fields(join_layout layout)
+    {
+        // Line of each field: lock_color, join_lock, restartStartTime, joined_p. The events and
+        // wait_done are only touched on the hard-wait path and always stay on line 0.
+        int colorLine = 0, lockLine = 0, restartLine = 0, joinedLine = 0;
+        switch (layout)
+        {
+        case join_layout::packed:
+            break;
+        case join_layout::split_counter:
+            lockLine = 1;
+            break;
+        case join_layout::isolated_color:
+            colorLine = 1;
+            lockLine = 2;
+            break;
+        case join_layout::padded:
+            colorLine = 1;
+            lockLine = 2;
+            restartLine = 3;
+            joinedLine = 4;
+            break;
+        }
+
+        line_allocator allocator = {};
+        allocator.storage = (char*)AlignedAlloc(HS_CACHE_LINE_SIZE, MAX_LINES * HS_CACHE_LINE_SIZE);
+        assert(allocator.storage != nullptr);
+
+        field_pointers fields;
+        fields.storage = allocator.storage;
+        fields.joined_event = allocator.place<EventImpl>(0, 3);
+        fields.lock_color = allocator.place<Volatile<int>>(colorLine);
+        fields.wait_done = allocator.place<Volatile<bool>>(0);
+        fields.joined_p = allocator.place<Volatile<bool>>(joinedLine);
+        fields.join_lock = allocator.place<Volatile<int>>(lockLine);
+        fields.restartStartTime = allocator.place<unsigned __int64>(restartLine);
+        return fields;
+    }
+
+    field_pointers fields;
+
+public:
+    // The fields live in a separate cache-line aligned block laid out according to
+    // 'layout'; the references below never change, so the line holding them is only read.
+    const join_layout layout;
     int n_threads;
-    EventImpl joined_event[3];
-    Volatile<int> lock_color;
-    Volatile<bool> wait_done;
-    Volatile<bool> joined_p;
-    Volatile<int> join_lock;
-    unsigned __int64 restartStartTime;
+    EventImpl* const joined_event;
+    Volatile<int>& lock_color;
+    Volatile<bool>& wait_done;
+    Volatile<bool>& joined_p;
+    Volatile<int>& join_lock;
+    unsigned __int64& restartStartTime;
+
+    join_structure(join_layout layout) :
+        fields(place_fields(layout)),
+        layout(layout),
+        n_threads(0),
+        joined_event(fields.joined_event),
+        lock_color(*fields.lock_color),
+        wait_done(*fields.wait_done),
+        joined_p(*fields.joined_p),
+        join_lock(*fields.join_lock),
+        restartStartTime(*fields.restartStartTime)
+    {
+    }
+
+    ~join_structure()
+    {
+        AlignedFree(fields.storage);
+    }
+
+    join_structure(const join_structure&) = delete;
+    join_structure& operator=(const join_structure&) = delete;
 };
 
 __forceinline LONGLONG GetCounter()
@@ -38,8 +167,17 @@ private:
 
 protected:
     join_structure join_struct;
+    hard_wait_backend* hardWait;
+
+    // When not 0, spin-loops that support it give up after this many TSC ticks
+    // instead of after a number of iterations.
+    unsigned __int64 spinBudgetTicks;
+
+    // When not 0, the thread whose arrival leaves this many threads still running
+    // wakes the hard-waiters, so they are back to spinning when the join completes.
+    int earlyWakeThreads;
 
-    t_join(int numThreads)
+    t_join(int numThreads, join_layout layout, hard_wait_kind hardWaitKind) : join_struct(layout), spinBudgetTicks(0), earlyWakeThreads(0)
     {
         join_struct.n_threads = numThreads;
         join_struct.lock_color = 0;
@@ -61,6 +199,38 @@ protected:
 
         // Create an event to wait for all threads to complete.
         waitToComplete.CreateManualEvent(false);
+
+        hardWait = create_hard_wait(hardWaitKind, join_struct.lock_color, join_struct.joined_event);
+        assert(hardWait != nullptr);
+    }
+
+    void signalCompletion()
+    {
+        waitToComplete.Set();
+    }
+
+    /// <summary>
+    /// Called on every arrival that doesn't complete the join, with what
+    /// Interlocked::Decrement() of join_lock returned.
+    /// </summary>
+    __forceinline void anticipateRelease(int color, int stillRunning)
+    {
+        if (stillRunning == earlyWakeThreads)
+        {
+            hardWait->wakeEarly(color);
+        }
+    }
+
+    /// <summary>
+    /// Called by restart() right after the color changed, for join types whose
+    /// waiters soft-wait on something other than lock_color.
+    /// </summary>
+    /// <param name="threadId">Thread that completed the join.</param>
+    /// <param name="color">Color of the join that just completed.</param>
+    virtual void releaseWaiters(int threadId, int color)
+    {
+        UNREFERENCED_PARAMETER(threadId);
+        UNREFERENCED_PARAMETER(color);
     }
 
     ulong old_join(int inputIndex, int threadId, bool* wasHardWait)
@@ -68,7 +238,7 @@ protected:
         ulong totalIterations = 0;
         *wasHardWait = false;
         int color = join_struct.lock_color.LoadWithoutBarrier();
-        if (_InterlockedDecrement((long*)&join_struct.join_lock) != 0)
+        if (Interlocked::Decrement(&join_struct.join_lock) != 0)
         {
             if (color == join_struct.lock_color.LoadWithoutBarrier())
             {
@@ -141,8 +311,55 @@ protected:
     }
 
 public:
+    virtual ~t_join()
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            if (join_struct.joined_event[i].IsValid())
+            {
+                join_struct.joined_event[i].CloseEvent();
+            }
+        }
+        waitToComplete.CloseEvent();
+        delete hardWait;
+    }
+
+    /// <summary>
+    /// Bounds the spin-loops of the composed join types by time rather than by
+    /// iterations. Must be called before the threads start.
+    /// </summary>
+    void setSpinBudget(unsigned __int64 ticks)
+    {
+        spinBudgetTicks = ticks;
+    }
+
+    /// <summary>
+    /// Wakes the hard-waiters once only 'threads' threads are still running, for the
+    /// join types that support it. 0 to only wake them when the join completes.
+    /// Must be called before the threads start.
+    /// </summary>
+    void setEarlyWake(int threads)
+    {
+        earlyWakeThreads = threads;
+    }
+
+    join_layout getLayout() const
+    {
+        return join_struct.layout;
+    }
+
     virtual ulong join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime) = 0;
 
+    /// <summary>
+    /// Prints statistics specific to a join type, after all threads completed.
+    /// </summary>
+    virtual void printStats() {}
+
+    void printHardWaitStats() const
+    {
+        hardWait->printStats();
+    }
+
     void waitForThreads()
     {
         uint32_t dwJoinWait = waitToComplete.Wait(INFINITE, FALSE);
@@ -155,7 +372,10 @@ public:
         }
     }
 
-    __forceinline void restart(int threadId, int numberIndex, bool isLastIteration)
+    /// <summary>
+    /// Called by the thread for which joined() is true, to release everyone else.
+    /// </summary>
+    virtual void restart(int threadId, int numberIndex, bool isLastIteration)
     {
         //printf("%d. Restart for Thread# %d\n", numberIndex, threadId);
         join_struct.joined_p = false;
@@ -168,11 +388,12 @@ public:
         // of "restart time".
         recordRestartStartTime();
         join_struct.lock_color = !color;
-        join_struct.joined_event[color].Set();
+        releaseWaiters(threadId, color);
+        hardWait->wake(color);
 
         if (isLastIteration)
         {
-            waitToComplete.Set();
+            signalCompletion();
         }
     }
 
@@ -180,16 +401,34 @@ public:
     {
         join_struct.restartStartTime = GetCounter();
     }
-    __forceinline unsigned __int64 getTicksSinceRestart()
+
+    /// <summary>
+    /// Ticks since the join this thread just returned from was completed.
+    /// </summary>
+    virtual unsigned __int64 getTicksSinceRestart(int threadId)
     {
+        UNREFERENCED_PARAMETER(threadId);
         assert(join_struct.restartStartTime != 0);
         return  GetCounter() - join_struct.restartStartTime;
     }
 
-    bool joined()
+    /// <summary>
+    /// Whether 'threadId' has to call restart() after the join it just returned from.
+    /// </summary>
+    virtual bool joined(int threadId)
     {
+        UNREFERENCED_PARAMETER(threadId);
         return join_struct.joined_p;
     }
+
+    /// <summary>
+    /// Called by every thread once it returned from its last join. Join types for which
+    /// no thread calls restart() signal completion here instead.
+    /// </summary>
+    virtual void finished(int threadId)
+    {
+        UNREFERENCED_PARAMETER(threadId);
+    }
     
 #define HARD_WAIT()                                                                     \
     *spinLoopStopTime = GetCounter();                                                   \
@@ -199,7 +438,7 @@ public:
     {                                                                                   \
         PRINT_HARD_WAIT("%d. %llu iterations.", threadId, inputIndex, totalIterations); \
         *wasHardWait = true;                                                            \
-        uint32_t dwJoinWait = join_struct.joined_event[color].Wait(INFINITE, FALSE);    \
+        uint32_t dwJoinWait = hardWait->wait(color);                                    \
                                                                                         \
         if (dwJoinWait != WAIT_OBJECT_0)                                                \
         {                                                                               \
@@ -219,148 +458,381 @@ public:
     PRINT_RELEASE("%d", threadId, inputIndex);      \
     PRINT_RELEASE("---------------\n", threadId);   \
     join_struct.joined_p = true;                    \
-    join_struct.joined_event[!color].Reset();
+    hardWait->reset(!color);
 
 
 };
 
-class t_join_pause : public t_join
+class t_join_pause_adaptive final : public t_join
 {
+private:
+    // Per-thread spin budget, on its own cache line so adapting it doesn't disturb other waiters.
+    struct alignas(HS_CACHE_LINE_SIZE) adaptive_spin_state
+    {
+        int spinCount;
+        double ticksPerIteration;
+        int growCount;
+        int shrinkCount;
+    };
+
+    static constexpr int MIN_SPIN_COUNT = 1024;
+    static constexpr int MAX_SPIN_COUNT = 8 * SPIN_COUNT;
+
+    adaptive_spin_state* spinStates;
+    const int threadCount;
+
+    void adaptSpinCount(adaptive_spin_state& state, ulong iterations, bool wasHardWait, unsigned __int64 spinLoopStartTime, unsigned __int64 spinLoopStopTime);
+
 public:
-    t_join_pause(int numThreads) : t_join(numThreads)
+    t_join_pause_adaptive(int numThreads, join_layout layout, hard_wait_kind hardWaitKind) : t_join(numThreads, layout, hardWaitKind), threadCount(numThreads)
     {
+        spinStates = new adaptive_spin_state[numThreads];
+        for (int i = 0; i < numThreads; i++)
+        {
+            spinStates[i].spinCount = SPIN_COUNT;
+            spinStates[i].ticksPerIteration = 0;
+            spinStates[i].growCount = 0;
+            spinStates[i].shrinkCount = 0;
+        }
     }
 
     /// <summary>
-    /// Use the default implementation of "join" where we use "pause"
-    /// inside the spin-loop and if after X spin iterations, color doesn't
-    /// change, we would go to hard-wait.
+    /// Same as t_join_pause, but every thread adapts its spin budget from the outcome
+    /// of its previous joins: the budget grows when the color flipped shortly after the
+    /// spin gave up, and shrinks when the thread either woke up early in the spin or
+    /// ended up in hard-wait long before the color flipped.
     /// </summary>
     /// <param name="inputIndex">index for which join is performed.</param>
     /// <param name="threadId">Thread id</param>
     /// <param name="wasHardWait">If there was hardwait needed</param>
     /// <returns>Total spin iterations performed.</returns>
     virtual ulong join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime);
+
+    virtual ~t_join_pause_adaptive()
+    {
+        delete[] spinStates;
+    }
+
+    virtual void printStats();
 };
 
-class t_join_mwaitx_noloop : public t_join
+class t_join_combining_tree final : public t_join
 {
 private:
-    const int mwaitx_cycles;
+    static const int MAX_TREE_DEPTH = 32;
+
+    // Arrivals decrement 'count' and waiters spin on 'released', so the two are on
+    // separate lines and a late arrival doesn't disturb the waiters.
+    //
+    // 'released' holds the number of joins the node was released for rather than a
+    // color: a thread woken from hard-wait can reach the next join before its node
+    // was released for the previous one, and would take the stale color for a release.
+    struct tree_node
+    {
+        alignas(HS_CACHE_LINE_SIZE) Volatile<int> count;
+        int arrivals;
+        int parent;
+        alignas(HS_CACHE_LINE_SIZE) Volatile<LONGLONG> released;
+    };
+
+    // Nodes from the thread's leaf up to the root, how many of them (counting from
+    // the leaf) the thread arrived at last in the current join, and how many joins
+    // the thread went through.
+    struct alignas(HS_CACHE_LINE_SIZE) tree_path
+    {
+        int nodes[MAX_TREE_DEPTH];
+        int depth;
+        int wonLevels;
+        LONGLONG joinCount;
+    };
+
+    tree_node* nodes;
+    int nodeCount;
+    tree_path* paths;
+    const int fanIn;
+
+    __forceinline void releasePath(tree_path& path)
+    {
+        // Top-down, so that the biggest subtrees start waking first.
+        for (int level = path.wonLevels - 1; level >= 0; level--)
+        {
+            nodes[path.nodes[level]].released = path.joinCount;
+        }
+    }
 
-public:
-    t_join_mwaitx_noloop(int numThreads, int mwaitx_timeout) : t_join(numThreads), mwaitx_cycles(mwaitx_timeout)
+protected:
+    virtual void releaseWaiters(int threadId, int color)
     {
+        UNREFERENCED_PARAMETER(color);
+        releasePath(paths[threadId]);
     }
 
+public:
+    t_join_combining_tree(int numThreads, int fan_in, join_layout layout, hard_wait_kind hardWaitKind);
+
     /// <summary>
-    /// Use monitorx/mwaitx without doing spin-loop. If the timeout
-    /// expires and the color hasn't change, it will go to hard-wait.
+    /// Threads arrive at the leaf of their group of 'fanIn' threads. The last to
+    /// arrive at a node moves up to its parent, so every node only sees 'fanIn'
+    /// arrivals, and the last to arrive at the root completes the join. Everyone
+    /// else soft-waits on the node where it stopped, which is released by the thread
+    /// that moved up from it once that thread is released itself. A thread whose
+    /// node is not released within SPIN_COUNT iterations falls into hard-wait, as
+    /// in t_join_pause.
     /// </summary>
     /// <param name="inputIndex">index for which join is performed.</param>
     /// <param name="threadId">Thread id</param>
     /// <param name="wasHardWait">If there was hardwait needed</param>
     /// <returns>Total spin iterations performed.</returns>
     virtual ulong join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime);
+
+    virtual ~t_join_combining_tree()
+    {
+        delete[] nodes;
+        delete[] paths;
+    }
+
+    virtual void printStats();
 };
 
-class t_join_mwaitx_loop : public t_join
+class t_join_dissemination final : public t_join
 {
 private:
-    const int mwaitx_cycles;
+    static const int MAX_ROUNDS = 32;
 
-public:
-    t_join_mwaitx_loop(int numThreads, int mwaitx_timeout) : t_join(numThreads), mwaitx_cycles(mwaitx_timeout)
+    // Written by the thread that signals us in a round. 'joinCount' rather than a color,
+    // for the same reason as in t_join_combining_tree, and 'arrivalTime' is the latest
+    // arrival that thread knows of.
+    struct alignas(HS_CACHE_LINE_SIZE) round_flag
     {
-    }
+        Volatile<LONGLONG> joinCount;
+        unsigned __int64 arrivalTime;
+    };
+
+    struct dissemination_state
+    {
+        // Flags of consecutive joins alternate, so a partner that already moved on to
+        // the next join never overwrites an arrivalTime we haven't read yet.
+        round_flag flags[2][MAX_ROUNDS];
+        alignas(HS_CACHE_LINE_SIZE) Volatile<int> sleeping;
+        EventImpl wakeEvent;
+        LONGLONG joinCount;
+        unsigned __int64 restartStartTime;
+    };
+
+    dissemination_state* states;
+    const int threadCount;
+    int roundCount;
+
+    void signal(dissemination_state& partner, int parity, int round, LONGLONG joinCount, unsigned __int64 arrivalTime);
+
+public:
+    t_join_dissemination(int numThreads, join_layout layout, hard_wait_kind hardWaitKind);
 
     /// <summary>
-    /// Use monitorx/mwaitx inside spin-loop. If the timeout
-    /// expires and the color hasn't change, it will go to hard-wait.
+    /// Dissemination barrier: in round r, every thread signals thread (id + 2^r) % N
+    /// and waits to be signaled by thread (id - 2^r) % N. After ceil(log2(N)) rounds
+    /// every thread has transitively heard from all others, so there is no shared
+    /// counter and no thread that releases everyone else. Waiting follows
+    /// t_join_pause: up to SPIN_COUNT iterations in total, then a hard-wait on a
+    /// per-thread event that the signaling thread only sets when we are asleep.
+    ///
+    /// The latest arrival time is passed along with the signals; it stands in for
+    /// the restart time of the other join types.
     /// </summary>
     /// <param name="inputIndex">index for which join is performed.</param>
     /// <param name="threadId">Thread id</param>
     /// <param name="wasHardWait">If there was hardwait needed</param>
     /// <returns>Total spin iterations performed.</returns>
     virtual ulong join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime);
-};
 
-class t_join_hard_wait_only : public t_join
-{
-public:
-    t_join_hard_wait_only(int numThreads) : t_join(numThreads)
+    /// <summary>
+    /// Nobody has to release anyone, so every thread waited, and nobody calls restart().
+    /// </summary>
+    virtual bool joined(int threadId)
     {
+        UNREFERENCED_PARAMETER(threadId);
+        return false;
     }
 
-    /// <summary>
-    /// Only hard-wait for color change.
-    /// </summary>
-    /// <param name="inputIndex">index for which join is performed.</param>
-    /// <param name="threadId">Thread id</param>
-    /// <param name="wasHardWait">If there was hardwait needed</param>
-    /// <param name="spinLoopStopTime">Time tick at which spin loop was completed
-    /// (either because color was changed sooner, or it had to hard-wait, in which case
-    /// it utilized all the spin iterations.</param>
-    /// <returns>Total spin iterations performed.</returns>
-    virtual ulong join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime);
+    virtual void finished(int threadId)
+    {
+        if (threadId == 0)
+        {
+            signalCompletion();
+        }
+    }
+
+    virtual unsigned __int64 getTicksSinceRestart(int threadId)
+    {
+        return GetCounter() - states[threadId].restartStartTime;
+    }
+
+    virtual ~t_join_dissemination()
+    {
+        for (int i = 0; i < threadCount; i++)
+        {
+            states[i].wakeEvent.CloseEvent();
+        }
+        delete[] states;
+    }
+
+    virtual void printStats();
 };
 
-class t_join_pause_soft_wait_only : public t_join
+class t_join_local_spin final : public t_join
 {
-public:
-    t_join_pause_soft_wait_only(int numThreads) : t_join(numThreads)
+private:
+    // Written by the releasing thread and read by the thread that owns it, except
+    // 'sleeping', which the owner only writes on its way into hard-wait.
+    struct alignas(HS_CACHE_LINE_SIZE) local_flag
     {
-    }
+        Volatile<int> color;
+        Volatile<int> sleeping;
+        EventImpl wakeEvent;
+    };
+
+    local_flag* flags;
+    std::vector<std::vector<int>> releaseOrders;
+    const int threadCount;
+
+public:
+    /// <param name="releaseOrders">For every thread, the order in which it releases
+    /// the others when it completes a join. Empty to release in thread order.</param>
+    t_join_local_spin(int numThreads, const std::vector<std::vector<int>>& releaseOrders, join_layout layout, hard_wait_kind hardWaitKind);
 
     /// <summary>
-    /// Only uses spin-loop for color change, with "pause" inside every iteration.
-    /// No hard-wait is done.
+    /// Arrives like t_join_pause, but every waiter spins on its own flag instead of
+    /// lock_color, and the thread completing the join writes the flags one by one,
+    /// so a release costs one line transfer per waiter instead of all of them missing
+    /// on the same line at once. A waiter that doesn't see its flag change within
+    /// SPIN_COUNT iterations hard-waits on its own event, which the releasing thread
+    /// only sets when the waiter is asleep.
     /// </summary>
     /// <param name="inputIndex">index for which join is performed.</param>
     /// <param name="threadId">Thread id</param>
     /// <param name="wasHardWait">If there was hardwait needed</param>
     /// <returns>Total spin iterations performed.</returns>
     virtual ulong join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime);
+
+    virtual void restart(int threadId, int numberIndex, bool isLastIteration);
+
+    virtual ~t_join_local_spin()
+    {
+        for (int i = 0; i < threadCount; i++)
+        {
+            flags[i].wakeEvent.CloseEvent();
+        }
+        delete[] flags;
+    }
 };
 
-class t_join_mwaitx_loop_soft_wait_only : public t_join
+class t_join_two_level final : public t_join
 {
 private:
-    const int mwaitx_cycles;
+    // One per L3 or NUMA domain. Arrivals of the domain's threads decrement 'count';
+    // 'color' is the domain's replica of lock_color, which its waiters spin on.
+    struct join_domain
+    {
+        alignas(HS_CACHE_LINE_SIZE) Volatile<int> count;
+        int arrivals;
+        alignas(HS_CACHE_LINE_SIZE) Volatile<int> color;
+    };
+
+    join_domain* domains;
+    int domainCount;
+    std::vector<int> threadDomains;
 
 public:
-    t_join_mwaitx_loop_soft_wait_only(int numThreads, int mwaitx_timeout) : t_join(numThreads), mwaitx_cycles(mwaitx_timeout)
-    {
-    }
+    /// <param name="threadDomains">Domain index of every thread, from 0 to the number of domains - 1.</param>
+    t_join_two_level(int numThreads, const std::vector<int>& threadDomains, join_layout layout, hard_wait_kind hardWaitKind);
 
     /// <summary>
-    /// Only uses spin-loop for color change, with "mwaitx" inside every iteration.
-    /// No hard-wait is done.
+    /// Threads first arrive at their domain. The last one to arrive there is the
+    /// domain's leader for this join and arrives at join_lock, which is therefore
+    /// only written once per domain. Everyone, leaders included, spins on its
+    /// domain's color; restart() flips lock_color and then every replica, so a
+    /// release costs one line per domain. A thread whose replica did not change
+    /// within SPIN_COUNT iterations hard-waits as in t_join_pause.
     /// </summary>
     /// <param name="inputIndex">index for which join is performed.</param>
     /// <param name="threadId">Thread id</param>
     /// <param name="wasHardWait">If there was hardwait needed</param>
     /// <returns>Total spin iterations performed.</returns>
     virtual ulong join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime);
+
+    virtual void restart(int threadId, int numberIndex, bool isLastIteration);
+
+    virtual ~t_join_two_level()
+    {
+        delete[] domains;
+    }
+
+    virtual void printStats();
 };
 
-class t_join_mwaitx_noloop_soft_wait_only : public t_join
+class t_join_predictive final : public t_join
 {
 private:
-    const int mwaitx_cycles;
+    // What a waiter does on arrival, from how long it expects to wait.
+    enum wait_decision
+    {
+        spin_full = 0,      // Short wait: spin up to SPIN_COUNT iterations, as t_join_pause.
+        spin_briefly = 1,   // In between: spin for spinThresholdTicks in case the prediction is wrong, then hard-wait.
+        block_now = 2,      // Long wait: hard-wait at once.
+        decision_count = 3,
+    };
+
+    // Per-thread counters, on their own cache line.
+    struct alignas(HS_CACHE_LINE_SIZE) predictive_state
+    {
+        ulong decisions[decision_count];
+        ulong spunInVain;           // Spun fully, and still hard-waited.
+        ulong blockedNeedlessly;    // Blocked at once, and the join completed within spinThresholdTicks.
+    };
+
+    // Ticks from a restart to the last arrival of the round that follows, averaged over
+    // recent rounds. Only written by the last arriver, so on its own line.
+    struct alignas(HS_CACHE_LINE_SIZE) round_estimate
+    {
+        unsigned __int64 predictedRoundTicks;
+        ulong rounds;
+    };
+
+    predictive_state* states;
+    round_estimate estimate;
+    const int threadCount;
+    const unsigned __int64 spinThresholdTicks;
+    const unsigned __int64 blockThresholdTicks;
+    const unsigned __int64 earlyWakeTicks;
+
+    bool predictWait(unsigned __int64 arrivalTime, unsigned __int64* predictedWait);
+    wait_decision decide(unsigned __int64 predictedWait);
+    void recordRound(unsigned __int64 arrivalTime);
 
 public:
-    t_join_mwaitx_noloop_soft_wait_only(int numThreads, int mwaitx_timeout) : t_join(numThreads), mwaitx_cycles(mwaitx_timeout)
-    {
-    }
+    /// <param name="spinThresholdTicks">Predicted waits up to this long spin fully.</param>
+    /// <param name="blockThresholdTicks">Predicted waits longer than this hard-wait at once.</param>
+    /// <param name="earlyWakeTicks">When not 0, the first thread to arrive with a predicted wait
+    /// at most this long wakes the hard-waiters, which then spin until the join completes.</param>
+    t_join_predictive(int numThreads, unsigned __int64 spinThresholdTicks, unsigned __int64 blockThresholdTicks, unsigned __int64 earlyWakeTicks, join_layout layout, hard_wait_kind hardWaitKind);
 
     /// <summary>
-    /// Only uses "mwaitx" with TIMEOUT inside every iteration.
-    /// No hard-wait is done.
+    /// Arrives like t_join_pause, but the last arriver of every round records how long
+    /// after the previous restart it arrived, and a waiter predicts its wait as that
+    /// round length minus how long its own input took since the restart. Waiters that
+    /// finished cheap inputs on an imbalanced round thus block at once instead of
+    /// burning their spin, while waiters on balanced rounds keep spinning.
     /// </summary>
     /// <param name="inputIndex">index for which join is performed.</param>
     /// <param name="threadId">Thread id</param>
     /// <param name="wasHardWait">If there was hardwait needed</param>
     /// <returns>Total spin iterations performed.</returns>
     virtual ulong join(int inputIndex, int threadId, bool* wasHardWait, unsigned __int64* spinLoopStartTime, unsigned __int64* spinLoopStopTime);
+
+    virtual ~t_join_predictive()
+    {
+        delete[] states;
+    }
+
+    virtual void printStats();
 };
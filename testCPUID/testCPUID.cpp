@@ -1,10 +1,24 @@
 
+#ifdef _WIN32
 #include <windows.h>
+#include <intrin.h>
+#include <conio.h>
+#else
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <x86intrin.h>
+#include <cpuid.h>
+
+typedef uint32_t DWORD;
+typedef void* LPVOID;
+#define WINAPI
+#define Sleep(ms) usleep((useconds_t)(ms) * 1000)
+#endif // _WIN32
 #include <limits.h>
 #include <stdio.h>
 #include <stdint.h>
-#include <intrin.h>
-#include <conio.h>
+#include <stdlib.h>
 #include <chrono>
 
 const unsigned HS_CACHE_LINE_SIZE = 128;
@@ -15,22 +29,22 @@ char cache_line_separator1[HS_CACHE_LINE_SIZE];
 // Credit: https://stackoverflow.com/a/1449859
 void printfcomma2(long long n) {
     if (n < 1000) {
-        printf("%d", n);
+        printf("%lld", n);
         return;
     }
     printfcomma2(n / 1000);
-    printf("%03d", n % 1000);
-    //printf(",%03d", n % 1000);
+    printf("%03lld", n % 1000);
+    //printf(",%03lld", n % 1000);
 }
 
 DWORD WINAPI MyThreadFunction(LPVOID lpParam)
 {
     size_t original_value = g_global_location;
-    unsigned int cyclesToWait = (unsigned int)lpParam;
+    unsigned int cyclesToWait = (unsigned int)(uintptr_t)lpParam;
     size_t waited_count = 0;
     size_t latency = UINT64_MAX;
 
-    unsigned __int64 start = __rdtsc();
+    unsigned long long start = __rdtsc();
     auto beginTimer = std::chrono::steady_clock::now();
     while (g_global_location == original_value)
     {
@@ -45,7 +59,7 @@ DWORD WINAPI MyThreadFunction(LPVOID lpParam)
             //start = __rdtsc();
         }
     }
-    unsigned __int64 end = __rdtsc();
+    unsigned long long end = __rdtsc();
     latency = end > start ? (end - start) : (start - end);
     long long latency_iteration = latency / waited_count;
     long long diff = cyclesToWait - latency_iteration;
@@ -61,21 +75,48 @@ DWORD WINAPI MyThreadFunction(LPVOID lpParam)
     return 0;
 }
 
+// monitorx/mwaitx are AMD only: CPUID.80000001h:ECX[29].
+bool IsMonitorXSupported()
+{
+    unsigned int regs[4];
+#ifdef _WIN32
+    __cpuid((int*)regs, 0x80000000);
+    if (regs[0] < 0x80000001)
+    {
+        return false;
+    }
+    __cpuid((int*)regs, 0x80000001);
+#else
+    if (__get_cpuid_max(0x80000000, nullptr) < 0x80000001)
+    {
+        return false;
+    }
+    __cpuid(0x80000001, regs[0], regs[1], regs[2], regs[3]);
+#endif // _WIN32
+    return (regs[2] & (1u << 29)) != 0;
+}
+
 int main(int argc, char** argv)
 {
+    if (!IsMonitorXSupported())
+    {
+        printf("This processor does not support monitorx/mwaitx.\n");
+        return 2;
+    }
+
     int secondsToSleep = atoi(argv[1]);
     //int cyclesToWait = atoi(argv[2]);
 
     printf("TIMEOUT | WAIT_COUNT | TOTAL_LATENCY | LATENCY_ITERATION | ELAPSED_TIME | DIFF |\n");
     for (unsigned int cyclesToWait = 0; cyclesToWait < 200000000; cyclesToWait += 500)
     {
-
+#ifdef _WIN32
         DWORD tid;
         HANDLE hThread = CreateThread(
             NULL,                   // default security attributes
             0,                      // use default stack size
             MyThreadFunction,     // thread function name
-            (LPVOID)cyclesToWait, // argument to thread function
+            (LPVOID)(uintptr_t)cyclesToWait, // argument to thread function
             CREATE_SUSPENDED,
             &tid);   // returns the thread identifier
 
@@ -86,6 +127,16 @@ int main(int argc, char** argv)
         }
 
         ResumeThread(hThread);
+#else
+        pthread_t hThread;
+        int result = pthread_create(&hThread, nullptr, [](void* arg) -> void* { MyThreadFunction(arg); return nullptr; }, (LPVOID)(uintptr_t)cyclesToWait);
+        if (result != 0)
+        {
+            printf("pthread_create failed: %d\n", result);
+            return 1;
+        }
+        pthread_detach(hThread);
+#endif // _WIN32
 
         Sleep((DWORD)secondsToSleep * 1000);
         g_global_location = 5;